@@ -2,6 +2,7 @@
 
 #include "stdafx.h"
 #include "profiler/profilerthread.h"
+#include "profiler/processgroup.h"
 #include "profiler/debugger.h"
 #include "utils/dbginterface.h"
 //#include "wxProfilerGUI/database.h"
@@ -45,6 +46,8 @@ struct AttachInfo
 #include <algorithm>
 #include "appinfo.h"
 #include "utils/except.h"
+#include "utils/osutils.h"
+#include <regex>
 
 class Database
 {
@@ -683,40 +686,354 @@ void LoadProfileData(const std::wstring &filename)
 	Database *database = new Database();
 	database->loadFromPath(filename, false, false);
 }
+
+static void usage()
+{
+	wprintf(
+		L"Usage: mypstack -a <pid> [options]\n"
+		L"       mypstack -name <regex> | -job <name> | -user <account> [options]\n"
+		L"\n"
+		L"  -a <pid>           Attaches to a process and profiles it.\n"
+		L"  -name <regex>      Profiles every process whose executable name matches, including ones started later.\n"
+		L"  -job <name>        Profiles every process in a named job object, including ones started later.\n"
+		L"  -user <account>    Profiles every process running as a user (name, DOMAIN\\name or SID).\n"
+		L"  -t <seconds>       Stops capturing after N seconds (default: when a key is pressed).\n"
+		L"  -o <file>          Saves the captured profile to the given file.\n"
+		L"  -alloc             Records heap allocations reported by sleepyshim.h instead of CPU samples.\n"
+		L"  -locks             Records blocking lock waits reported by sleepyshim.h instead of CPU samples.\n"
+		L"  -io                Records blocking file and socket I/O reported by sleepyshim.h instead of CPU samples.\n"
+		L"  -event <name>      Weights samples by time (default), context-switches, page-faults or major-faults.\n"
+		L"  -depth <N>         Cuts off CPU sample stacks deeper than N frames (default 1024).\n"
+		L"  -threads <N>       Samples at most N threads per tick, picked by recent CPU use.\n"
+		L"  -top <N>           Profiles only the N busiest threads, re-ranked every second.\n"
+		L"  -overhead <pct>    Slows CPU sampling down to use at most this %% of the target's CPU time.\n"
+		L"  -stall <us>        Slows CPU sampling down to suspend each thread at most N microseconds per second.\n"
+		L"  -cpus <list>       Pins the sampler to a set of processors, e.g. 0-3,8.\n"
+		L"  -priority <N>      Sampler thread priority: -15 (idle), -2 to 2, or 15 (time critical, the default).\n"
+		L"  -realtime          Runs the profiler in the realtime priority class while capturing.\n"
+		L"  -burst <N>         Samples N times a second while the target has a sleepyshim marked region open.\n"
+		L"  -placement         Also records the processor and NUMA node of each CPU sample.\n"
+		L"  -stuck <seconds>   Reports threads stuck in the same stack without using CPU for N seconds.\n"
+		L"  -tags              Also records the sleepyshim tag each CPU sample's thread had set.\n"
+		L"  -bgsymbols         Resolves symbols in the background while a CPU capture runs.\n"
+		L"  -deferred          Saves only addresses and the module list; symbols are resolved when opened.\n");
+}
+
+/// Everything the command line can ask for; the defaults match the GUI's.
+struct CaptureOptions
+{
+	CaptureOptions()
+	:	pid(0), timeout(-1), captureType(CAPTURE_CPU), sampleEvent(SAMPLE_TIME),
+		maxDepth(DEFAULT_MAX_CALLSTACK_LEVELS), threadsPerTick(0), topThreads(0),
+		overheadPercent(0), stallMicroseconds(0), priority(THREAD_PRIORITY_TIME_CRITICAL),
+		realtime(false), burstRate(0), placement(false), stuckSeconds(0), tags(false),
+		backgroundSymbols(false), deferred(false)
+	{}
+
+	DWORD pid;
+	ProcessSelector group;
+	std::wstring save;
+	long timeout;
+	CaptureType captureType;
+	SampleEvent sampleEvent;
+	long maxDepth, threadsPerTick, topThreads;
+	double overheadPercent, stallMicroseconds;
+	std::wstring cpus;
+	long priority;
+	bool realtime;
+	double burstRate;
+	bool placement;
+	double stuckSeconds;
+	bool tags, backgroundSymbols, deferred;
+};
+
+static bool parseNumber(const wchar_t *s, double *out)
+{
+	wchar_t *end;
+	*out = wcstod(s, &end);
+	return end != s && *end == 0;
+}
+
+static bool parseNumber(const wchar_t *s, long *out)
+{
+	wchar_t *end;
+	*out = wcstol(s, &end, 10);
+	return end != s && *end == 0;
+}
+
+/// Fills opts from the command line. Prints what's wrong and returns false
+/// if it doesn't make sense.
+static bool parseCommandLine(int argc, _TCHAR* argv[], CaptureOptions &opts)
+{
+	std::wstring error;
+	for (int i=1;i<argc;i++)
+	{
+		std::wstring arg = argv[i];
+		if (!arg.empty() && arg[0] == '/')
+			arg[0] = '-';
+
+		// Options that take a value.
+		const wchar_t *value = i+1 < argc ? argv[i+1] : NULL;
+		bool ok = true;
+		if (arg == L"-a" || arg == L"-t" || arg == L"-o" || arg == L"-name" || arg == L"-job" || arg == L"-user" ||
+			arg == L"-event" || arg == L"-depth" || arg == L"-threads" || arg == L"-top" || arg == L"-overhead" ||
+			arg == L"-stall" || arg == L"-cpus" || arg == L"-priority" || arg == L"-burst" || arg == L"-stuck")
+		{
+			if (!value)
+			{
+				fwprintf(stderr, L"%ls needs a value.\n", arg.c_str());
+				return false;
+			}
+			i++;
+		}
+
+		long pid;
+		if (arg == L"-a")
+		{
+			ok = parseNumber(value, &pid) && pid > 0;
+			opts.pid = ok ? (DWORD)pid : 0;
+		}
+		else if (arg == L"-t")
+			ok = parseNumber(value, &opts.timeout) && opts.timeout >= 0;
+		else if (arg == L"-o")
+			opts.save = value;
+		else if (arg == L"-name")
+		{
+			opts.group.imagePattern = value;
+			try
+			{
+				std::wregex check(opts.group.imagePattern);
+			}
+			catch (const std::regex_error &)
+			{
+				error = L"Invalid process name pattern: " + opts.group.imagePattern;
+				ok = false;
+			}
+		}
+		else if (arg == L"-job")
+			opts.group.jobName = value;
+		else if (arg == L"-user")
+			opts.group.user = value;
+		else if (arg == L"-alloc")
+			opts.captureType = CAPTURE_ALLOCATIONS;
+		else if (arg == L"-locks")
+			opts.captureType = CAPTURE_LOCKS;
+		else if (arg == L"-io")
+			opts.captureType = CAPTURE_IO;
+		else if (arg == L"-event")
+			ok = ProfilerThread::parseSampleEvent(value, &opts.sampleEvent, &error);
+		else if (arg == L"-depth")
+			ok = parseNumber(value, &opts.maxDepth) && opts.maxDepth >= 1;
+		else if (arg == L"-threads")
+			ok = parseNumber(value, &opts.threadsPerTick) && opts.threadsPerTick >= 0;
+		else if (arg == L"-top")
+			ok = parseNumber(value, &opts.topThreads) && opts.topThreads >= 1;
+		else if (arg == L"-overhead")
+			ok = parseNumber(value, &opts.overheadPercent) && opts.overheadPercent > 0;
+		else if (arg == L"-stall")
+			ok = parseNumber(value, &opts.stallMicroseconds) && opts.stallMicroseconds > 0;
+		else if (arg == L"-cpus")
+		{
+			GROUP_AFFINITY affinity;
+			ok = ParseProcessorList(value, &affinity, &error);
+			opts.cpus = value;
+		}
+		else if (arg == L"-priority")
+			ok = parseNumber(value, &opts.priority) && IsValidThreadPriority(opts.priority);
+		else if (arg == L"-realtime")
+			opts.realtime = true;
+		else if (arg == L"-burst")
+			ok = parseNumber(value, &opts.burstRate) && opts.burstRate >= 1;
+		else if (arg == L"-placement")
+			opts.placement = true;
+		else if (arg == L"-stuck")
+			ok = parseNumber(value, &opts.stuckSeconds) && opts.stuckSeconds >= 1;
+		else if (arg == L"-tags")
+			opts.tags = true;
+		else if (arg == L"-bgsymbols")
+			opts.backgroundSymbols = true;
+		else if (arg == L"-deferred")
+			opts.deferred = true;
+		else
+		{
+			fwprintf(stderr, L"Unknown option %ls.\n", arg.c_str());
+			return false;
+		}
+
+		if (!ok)
+		{
+			if (error.empty())
+				fwprintf(stderr, L"Bad value for %ls: %ls.\n", arg.c_str(), value);
+			else
+				fwprintf(stderr, L"%ls\n", error.c_str());
+			return false;
+		}
+	}
+
+	if (opts.group.empty() == !opts.pid)
+	{
+		fwprintf(stderr, L"Give either -a or any of -name, -job and -user.\n");
+		return false;
+	}
+
+	// Process groups are sampled by ProcessGroupThread, which only takes
+	// plain CPU samples.
+	if (!opts.group.empty() &&
+		(opts.captureType != CAPTURE_CPU || opts.sampleEvent != SAMPLE_TIME || opts.placement || opts.tags ||
+		 opts.overheadPercent > 0 || opts.stallMicroseconds > 0 || opts.stuckSeconds > 0 || opts.backgroundSymbols ||
+		 opts.burstRate > 0 || opts.deferred || opts.topThreads || opts.threadsPerTick))
+	{
+		fwprintf(stderr, L"-name, -job and -user only take plain CPU samples; the other capture options can't be used with them.\n");
+		return false;
+	}
+	return true;
+}
+
+/// Runs a capture thread (ProfilerThread or ProcessGroupThread) until the
+/// timeout, a key press, or (for a single process) the target exiting, then
+/// waits for it to save. Returns the path to the profile archive, or an
+/// empty string if it failed.
+template <class T>
+static std::wstring runCapture(T *profilerthread, const CaptureOptions &opts, bool stopWhenIdle)
+{
+	// Windows will quietly use the high class instead of realtime
+	// without SeIncreaseBasePriorityPrivilege.
+	DWORD prevClass = GetPriorityClass(GetCurrentProcess());
+	if (opts.realtime)
+	{
+		if (!SetPriorityClass(GetCurrentProcess(), REALTIME_PRIORITY_CLASS))
+			fwprintf(stderr, L"Couldn't use the realtime priority class (error %u).\n", (unsigned)GetLastError());
+		else if (GetPriorityClass(GetCurrentProcess()) != REALTIME_PRIORITY_CLASS)
+			fwprintf(stderr, L"Couldn't use the realtime priority class, using %ls instead.\n",
+				GetPriorityClass(GetCurrentProcess()) == HIGH_PRIORITY_CLASS ? L"high" : L"normal");
+	}
+
+	HANDLE thread = profilerthread->launch(false, opts.priority);
+	if (thread == NULL || thread == INVALID_HANDLE_VALUE)
+	{
+		fwprintf(stderr, L"Couldn't start the sampler thread.\n");
+		SetPriorityClass(GetCurrentProcess(), prevClass);
+		return std::wstring();
+	}
+
+	// MyThread::launch doesn't report whether the priority took.
+	int priority = GetThreadPriority(thread);
+	if (priority != opts.priority)
+		fwprintf(stderr, L"Couldn't set the sampler thread priority to %ld, it runs at %d.\n", opts.priority, priority);
+
+	GROUP_AFFINITY affinity;
+	std::wstring error;
+	if (!opts.cpus.empty() && ParseProcessorList(opts.cpus, &affinity, &error))
+	{
+		if (!SetThreadGroupAffinity(thread, &affinity, NULL))
+			fwprintf(stderr, L"Couldn't pin the sampler to processors %ls.\n", opts.cpus.c_str());
+	}
+
+	if (opts.timeout >= 0)
+	{
+		DWORD start = GetTickCount();
+		while (GetTickCount() - start < (DWORD)opts.timeout * 1000 &&
+			   !(stopWhenIdle && profilerthread->getNumThreadsRunning() <= 0))
+			Sleep(100);
+	}
+	else
+		system("pause");
+
+	profilerthread->commit_suicide = true;
+	while (!profilerthread->getDone() && !profilerthread->getFailed())
+		Sleep(100);
+	SetPriorityClass(GetCurrentProcess(), prevClass);
+
+	return profilerthread->getFailed() ? std::wstring() : profilerthread->getFilename();
+}
+
 int _tmain(int argc, _TCHAR* argv[])
 {
+	CaptureOptions opts;
+	if (!parseCommandLine(argc, argv, opts))
+	{
+		usage();
+		return 1;
+	}
+
 	if (!dbgHelpInit())
 	{
 		abort();
 		return -1;
 	}
-	DWORD processId = 1556;
-	Debugger *dbg = new Debugger(processId);
-	dbg->Attach();
-	getchar();
-	//dbg->Detach();
-
-	AttachInfo info;
-	info.process_handle = dbg->getProcess()->getProcessHandle();
-	std::vector<ThreadInfo> vt;
-	dbg->getThreads(vt);
-	for (size_t i = 0; i < vt.size(); i++)
-	{
-		ThreadInfo &t = vt[i];
-		info.thread_handles.push_back(t.getThreadHandle());
+
+	std::wstring ws;
+	if (!opts.group.empty())
+	{
+		ProcessGroupThread *profilerthread;
+		try
+		{
+			profilerthread = new ProcessGroupThread(opts.group);
+		}
+		catch (const SleepyException &e)
+		{
+			fwprintf(stderr, L"%ls\n", e.wwhat().c_str());
+			return 1;
+		}
+		profilerthread->setMaxDepth(opts.maxDepth);
+
+		// Matching processes can come and go, so keep going while there are none.
+		ws = runCapture(profilerthread, opts, false);
 	}
-	info.sym_info = new SymbolInfo();
-	info.sym_info->loadSymbols(info.process_handle, false);
-	ProfilerThread* profilerthread = new ProfilerThread(
-		info.process_handle,
-		info.thread_handles,
-		info.sym_info
-	);
-	profilerthread->launch(false, THREAD_PRIORITY_TIME_CRITICAL);
-	system("pause");
-	//profilerthread->cancel();
-	profilerthread->commit_suicide = true;
-	std::wstring ws = profilerthread->getFilename();
+	else
+	{
+		Debugger *dbg = new Debugger(opts.pid);
+		dbg->Attach();
+		if (opts.timeout < 0)
+			getchar();
+		//dbg->Detach();
+
+		AttachInfo info;
+		info.process_handle = dbg->getProcess()->getProcessHandle();
+		std::vector<ThreadInfo> vt;
+		dbg->getThreads(vt);
+		for (size_t i = 0; i < vt.size(); i++)
+		{
+			ThreadInfo &t = vt[i];
+			info.thread_handles.push_back(t.getThreadHandle());
+		}
+		info.sym_info = new SymbolInfo();
+		info.sym_info->setAddressOnly(opts.deferred);
+		info.sym_info->loadSymbols(info.process_handle, false);
+		ProfilerThread* profilerthread = new ProfilerThread(
+			info.process_handle,
+			info.thread_handles,
+			info.sym_info
+		);
+
+		profilerthread->setCaptureType(opts.captureType);
+		profilerthread->setSampleEvent(opts.sampleEvent);
+		profilerthread->setRecordPlacement(opts.placement);
+		profilerthread->setRecordTags(opts.tags);
+		profilerthread->setStuckThreshold(opts.stuckSeconds);
+		profilerthread->setBackgroundSymbols(opts.backgroundSymbols && !opts.deferred);
+		profilerthread->setMaxDepth(opts.maxDepth);
+		profilerthread->setThreadsPerTick(opts.threadsPerTick);
+		profilerthread->setOverheadBudget(opts.overheadPercent, opts.stallMicroseconds);
+		profilerthread->setTopThreads(opts.topThreads);
+		profilerthread->setBurstRate(opts.burstRate);
+
+		ws = runCapture(profilerthread, opts, true);
+	}
+
+	if (ws.empty())
+		return 1;
+
+	if (!opts.save.empty())
+	{
+		if (!CopyFile(ws.c_str(), opts.save.c_str(), FALSE))
+		{
+			fwprintf(stderr, L"Couldn't save the profile to %ls (error %u).\n", opts.save.c_str(), (unsigned)GetLastError());
+			return 1;
+		}
+		return 0;
+	}
+
 	std::string s( ws.begin(), ws.end() );
 	printf("file name:%s\n", s.c_str());
 	system("pause");
@@ -724,4 +1041,3 @@ int _tmain(int argc, _TCHAR* argv[])
 	system("pause");
 	return 0;
 }
-
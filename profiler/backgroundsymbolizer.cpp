@@ -0,0 +1,143 @@
+/*=====================================================================
+backgroundsymbolizer.cpp
+------------------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#include "backgroundsymbolizer.h"
+
+// Work for a slice, then sleep long enough to stay within this share of
+// a processor.
+static const double SLICE_MS = 5;
+static const double BUSY_SHARE = 0.25;
+
+BackgroundSymbolizer::BackgroundSymbolizer(SymbolInfo *sym_info_)
+:	sym_info(sym_info_),
+	stopping(false),
+	paused(false),
+	cpuTime(0),
+	thread(NULL)
+{
+	InitializeCriticalSection(&queueLock);
+	wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+BackgroundSymbolizer::~BackgroundSymbolizer()
+{
+	stop();
+	CloseHandle(wake);
+	DeleteCriticalSection(&queueLock);
+}
+
+HANDLE BackgroundSymbolizer::start(int priority)
+{
+	// run() can't return before stop() is called, so the handle is still
+	// open here.
+	HANDLE launched = launch(false, priority);
+	if (!DuplicateHandle(GetCurrentProcess(), launched, GetCurrentProcess(), &thread,
+						 0, FALSE, DUPLICATE_SAME_ACCESS))
+		thread = NULL;
+	return thread;
+}
+
+void BackgroundSymbolizer::add(const std::vector<PROFILER_ADDR> &addrs)
+{
+	EnterCriticalSection(&queueLock);
+	queue.insert(queue.end(), addrs.begin(), addrs.end());
+	LeaveCriticalSection(&queueLock);
+	SetEvent(wake);
+}
+
+void BackgroundSymbolizer::stop()
+{
+	stopping = true;
+	SetEvent(wake);
+
+	// Wait for the thread itself rather than for run() to return, as
+	// MyThread still reads this object after that.
+	if (thread)
+	{
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+		thread = NULL;
+	}
+}
+
+void BackgroundSymbolizer::updateCpuTime()
+{
+	FILETIME creation, exited, kernel, user;
+	if (GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user))
+	{
+		cpuTime = (((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime)
+			+ (((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime);
+	}
+}
+
+/// Sleeps once the current slice of work is used up, then starts the next.
+void BackgroundSymbolizer::pace(LARGE_INTEGER &sliceStart, const LARGE_INTEGER &freq)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	double busyMs = (double)(now.QuadPart - sliceStart.QuadPart) * 1000 / (double)freq.QuadPart;
+	if (busyMs < SLICE_MS)
+		return;
+
+	updateCpuTime();
+	Sleep((DWORD)(busyMs * (1 - BUSY_SHARE) / BUSY_SHARE) + 1);
+	QueryPerformanceCounter(&sliceStart);
+}
+
+void BackgroundSymbolizer::run()
+{
+	LARGE_INTEGER freq, sliceStart;
+	QueryPerformanceFrequency(&freq);
+
+	std::vector<PROFILER_ADDR> batch;
+	while (!stopping)
+	{
+		WaitForSingleObject(wake, 1000);
+
+		EnterCriticalSection(&queueLock);
+		batch.swap(queue);
+		LeaveCriticalSection(&queueLock);
+
+		QueryPerformanceCounter(&sliceStart);
+		for (size_t n=0;n<batch.size() && !stopping;n++)
+		{
+			while (paused && !stopping)
+			{
+				updateCpuTime();
+				Sleep(100);
+				QueryPerformanceCounter(&sliceStart);
+			}
+			if (stopping)
+				break;
+
+			// Each lookup is a search of a table, so the pacing and pausing
+			// between them are never held up for long.
+			ResolvedSymbol sym;
+			if (sym_info->getTableSymbol(batch[n], sym))
+				resolved[batch[n]] = sym;
+
+			pace(sliceStart, freq);
+		}
+		batch.clear();
+		updateCpuTime();
+	}
+}
@@ -0,0 +1,91 @@
+/*=====================================================================
+backgroundsymbolizer.h
+----------------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#ifndef __BACKGROUNDSYMBOLIZER_H_666_
+#define __BACKGROUNDSYMBOLIZER_H_666_
+
+#include <windows.h>
+#include <map>
+#include <vector>
+#include "symbolinfo.h"
+#include "../utils/mythread.h"
+
+/*=====================================================================
+BackgroundSymbolizer
+--------------------
+A low-priority thread that resolves addresses while a capture is still
+running, as the sampler first sees them, so saving the capture only has
+to write the results out rather than query them all then.
+
+It only resolves what native symbols and JIT maps can answer (see
+SymbolInfo::getTableSymbol). dbghelp lookups can take seconds, and the
+sampler would have to wait for them before walking a stack, so anything
+needing dbghelp is left for the end. It also keeps itself to a share of
+one processor however many threads are being sampled.
+=====================================================================*/
+class BackgroundSymbolizer : public MyThread
+{
+public:
+	BackgroundSymbolizer(SymbolInfo *sym_info);
+	virtual ~BackgroundSymbolizer();
+
+	virtual void run();
+
+	/// Launches the thread at the given priority. Returns its handle, which
+	/// stays valid until stop() returns.
+	HANDLE start(int priority);
+
+	/// Queues addresses to be resolved.
+	void add(const std::vector<PROFILER_ADDR> &addrs);
+
+	/// Nothing more is resolved while paused; e.g. while the capture is
+	/// over its overhead budget.
+	void setPaused(bool paused_) { paused = paused_; }
+
+	/// CPU time the thread has used so far, in 100ns units.
+	ULONGLONG getCpuTime() const { return cpuTime; }
+
+	/// Stops the thread, leaving anything still queued, and waits for it
+	/// to exit.
+	void stop();
+
+	/// The addresses resolved so far. Only to be used once stopped.
+	/// Anything that needed dbghelp is missing.
+	const std::map<PROFILER_ADDR, ResolvedSymbol> &getResolved() const { return resolved; }
+
+private:
+	SymbolInfo *sym_info;
+	CRITICAL_SECTION queueLock;
+	std::vector<PROFILER_ADDR> queue;
+	HANDLE wake;
+	// Our own copy of the thread handle; the one _beginthread returns is
+	// closed as the thread exits, before it's done with this object.
+	HANDLE thread;
+	volatile bool stopping, paused;
+	volatile ULONGLONG cpuTime;
+	std::map<PROFILER_ADDR, ResolvedSymbol> resolved;
+
+	void updateCpuTime();
+	void pace(LARGE_INTEGER &sliceStart, const LARGE_INTEGER &freq);
+};
+
+#endif //__BACKGROUNDSYMBOLIZER_H_666_
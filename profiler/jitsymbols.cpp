@@ -0,0 +1,343 @@
+/*=====================================================================
+jitsymbols.cpp
+--------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#include "jitsymbols.h"
+#include "symbolinfo.h"
+
+#include <algorithm>
+#include <stdlib.h>
+
+namespace
+{
+	// jitdump layout, from tools/perf/util/jitdump.h in Linux.
+	const DWORD JITDUMP_MAGIC = 0x4A695444;	// 'JiTD'
+
+	#pragma pack(push, 1)
+	struct JitDumpHeader
+	{
+		DWORD magic;
+		DWORD version;
+		DWORD totalSize;
+		DWORD elfMach;
+		DWORD pad;
+		DWORD pid;
+		ULONGLONG timestamp;
+		ULONGLONG flags;
+	};
+
+	struct JitDumpRecord
+	{
+		DWORD id;
+		DWORD totalSize;
+		ULONGLONG timestamp;
+	};
+
+	enum { JIT_CODE_LOAD = 0, JIT_CODE_MOVE = 1 };
+
+	struct JitCodeLoad			// followed by the name and then the code
+	{
+		DWORD pid, tid;
+		ULONGLONG vma;
+		ULONGLONG codeAddr;
+		ULONGLONG codeSize;
+		ULONGLONG codeIndex;
+	};
+
+	struct JitCodeMove
+	{
+		DWORD pid, tid;
+		ULONGLONG vma;
+		ULONGLONG oldCodeAddr;
+		ULONGLONG newCodeAddr;
+		ULONGLONG codeSize;
+		ULONGLONG codeIndex;
+	};
+	#pragma pack(pop)
+}
+
+JitSymbols::JitSymbols(DWORD pid)
+{
+	wchar_t temp[MAX_PATH + 1];
+	DWORD len = GetTempPathW(MAX_PATH + 1, temp);
+	std::wstring dir = len && len <= MAX_PATH ? std::wstring(temp, len) : std::wstring(L".\\");
+
+	wchar_t name[64];
+	swprintf(name, sizeof(name)/sizeof(name[0]), L"perf-%u.map", (unsigned)pid);
+	perfMap.path = dir + name;
+	swprintf(name, sizeof(name)/sizeof(name[0]), L"jit-%u.dump", (unsigned)pid);
+	jitDump.path = dir + name;
+
+	perfMap.offset = jitDump.offset = 0;
+	perfMap.headerRead = jitDump.headerRead = false;
+}
+
+bool JitSymbols::refresh(bool *replaced)
+{
+	*replaced = false;
+	size_t added = 0;
+	if (readMore(perfMap))
+		added += parsePerfMap();
+	if (readMore(jitDump))
+		added += parseJitDump();
+
+	if (!added)
+		return false;
+
+	for (size_t n=entries.size()-added;n<entries.size() && !*replaced;n++)
+		*replaced = overlaps(entries[n].start, entries[n].end);
+	buildIndex();
+	return true;
+}
+
+/// Appends whatever has been added to the file since last time to
+/// source.pending. Returns false if there was nothing.
+bool JitSymbols::readMore(Source &source)
+{
+	HANDLE file = CreateFileW(source.path.c_str(), GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	// A file that shrank was started over, i.e. by a new process that got
+	// the same ID; what we had of it is stale but harmless.
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(file, &size) && (ULONGLONG)size.QuadPart < source.offset)
+	{
+		source.offset = 0;
+		source.pending.clear();
+		source.headerRead = false;
+	}
+
+	LARGE_INTEGER pos;
+	pos.QuadPart = (LONGLONG)source.offset;
+	bool any = false;
+	if (SetFilePointerEx(file, pos, NULL, FILE_BEGIN))
+	{
+		char chunk[65536];
+		DWORD got;
+		while (ReadFile(file, chunk, sizeof(chunk), &got, NULL) && got)
+		{
+			source.pending.append(chunk, got);
+			source.offset += got;
+			any = true;
+		}
+	}
+
+	CloseHandle(file);
+	return any;
+}
+
+void JitSymbols::addEntry(PROFILER_ADDR start, PROFILER_ADDR size, const char *name, size_t len)
+{
+	if (!size || !len)
+		return;
+
+	Entry entry;
+	entry.start = start;
+	entry.end = start + size;
+	entry.name = (DWORD)names.size();
+	names.insert(names.end(), name, name + len);
+	names.push_back(0);
+	entries.push_back(entry);
+}
+
+size_t JitSymbols::parsePerfMap()
+{
+	size_t before = entries.size();
+	std::string &pending = perfMap.pending;
+
+	size_t pos = 0;
+	for (;;)
+	{
+		size_t eol = pending.find('\n', pos);
+		if (eol == std::string::npos)
+			break;
+
+		std::string line = pending.substr(pos, eol - pos);
+		pos = eol + 1;
+		if (!line.empty() && line[line.size()-1] == '\r')
+			line.erase(line.size()-1);
+
+		// start size name; the name may have spaces in it
+		const char *p = line.c_str();
+		char *end;
+		ULONGLONG start = _strtoui64(p, &end, 16);
+		if (end == p || *end != ' ')
+			continue;
+		p = end + 1;
+		ULONGLONG size = _strtoui64(p, &end, 16);
+		if (end == p || *end != ' ')
+			continue;
+		p = end + 1;
+
+		addEntry((PROFILER_ADDR)start, (PROFILER_ADDR)size, p, line.c_str() + line.size() - p);
+	}
+
+	pending.erase(0, pos);
+	return entries.size() - before;
+}
+
+size_t JitSymbols::parseJitDump()
+{
+	size_t before = entries.size();
+	std::string &pending = jitDump.pending;
+
+	size_t pos = 0;
+	if (!jitDump.headerRead)
+	{
+		if (pending.size() < sizeof(JitDumpHeader))
+			return 0;
+		const JitDumpHeader *header = (const JitDumpHeader *)pending.data();
+
+		// Byte swapped (written on another kind of machine) or not a
+		// jitdump at all; don't look at it again.
+		if (header->magic != JITDUMP_MAGIC || header->totalSize < sizeof(JitDumpHeader))
+		{
+			jitDump.path.clear();
+			pending.clear();
+			return 0;
+		}
+		if (pending.size() < header->totalSize)
+			return 0;
+		pos = header->totalSize;
+		jitDump.headerRead = true;
+	}
+
+	while (pending.size() - pos >= sizeof(JitDumpRecord))
+	{
+		const JitDumpRecord *record = (const JitDumpRecord *)(pending.data() + pos);
+		if (record->totalSize < sizeof(JitDumpRecord))
+		{
+			// Corrupt; give up on the file.
+			jitDump.path.clear();
+			pos = pending.size();
+			break;
+		}
+		if (pending.size() - pos < record->totalSize)
+			break;
+
+		const char *body = (const char *)(record + 1);
+		size_t bodySize = record->totalSize - sizeof(JitDumpRecord);
+		if (record->id == JIT_CODE_LOAD && bodySize > sizeof(JitCodeLoad))
+		{
+			const JitCodeLoad *load = (const JitCodeLoad *)body;
+			const char *name = body + sizeof(JitCodeLoad);
+			size_t len = strnlen(name, bodySize - sizeof(JitCodeLoad));
+			addEntry((PROFILER_ADDR)load->codeAddr, (PROFILER_ADDR)load->codeSize, name, len);
+		}
+		else if (record->id == JIT_CODE_MOVE && bodySize >= sizeof(JitCodeMove))
+		{
+			// Same code, same name, new place. Moves are rare, so just
+			// look for where it was last loaded. Where it was is left
+			// unmapped until something else is loaded there.
+			const JitCodeMove *move = (const JitCodeMove *)body;
+			for (size_t n=entries.size();n-- > 0;)
+			{
+				if (entries[n].start != (PROFILER_ADDR)move->oldCodeAddr)
+					continue;
+				if (entries[n].name == NO_NAME)
+					break;
+
+				Entry gap = entries[n];
+				gap.name = NO_NAME;
+				Entry entry = entries[n];
+				entry.start = (PROFILER_ADDR)move->newCodeAddr;
+				entry.end = entry.start + (PROFILER_ADDR)move->codeSize;
+				entries.push_back(gap);
+				entries.push_back(entry);
+				break;
+			}
+		}
+
+		pos += record->totalSize;
+	}
+
+	pending.erase(0, pos);
+	return entries.size() - before;
+}
+
+/// Sorts the entries by address, for findInterval. Of several entries
+/// starting at the same address the newest is kept, and none is allowed
+/// to run into the next. Gaps left by moves only cut off what's before.
+void JitSymbols::buildIndex()
+{
+	std::vector<size_t> order(entries.size());
+	for (size_t n=0;n<order.size();n++)
+		order[n] = n;
+	std::stable_sort(order.begin(), order.end(),
+		[this](size_t a, size_t b) { return entries[a].start < entries[b].start; });
+
+	starts.clear();
+	ends.clear();
+	nameOffsets.clear();
+	for (size_t n=0;n<order.size();n++)
+	{
+		const Entry &entry = entries[order[n]];
+		if (n+1 < order.size() && entries[order[n+1]].start == entry.start)
+			continue;
+
+		if (entry.name == NO_NAME)
+			continue;
+
+		PROFILER_ADDR end = entry.end;
+		if (n+1 < order.size() && end > entries[order[n+1]].start)
+			end = entries[order[n+1]].start;
+		starts.push_back(entry.start);
+		ends.push_back(end);
+		nameOffsets.push_back(entry.name);
+	}
+}
+
+ptrdiff_t JitSymbols::find(PROFILER_ADDR addr) const
+{
+	if (starts.empty())
+		return -1;
+	ptrdiff_t i = findInterval(&starts[0], starts.size(), addr);
+	return i >= 0 && addr < ends[i] ? i : -1;
+}
+
+/// Whether [start, end) shares any addresses with the current index.
+bool JitSymbols::overlaps(PROFILER_ADDR start, PROFILER_ADDR end) const
+{
+	if (starts.empty())
+		return false;
+	ptrdiff_t i = findInterval(&starts[0], starts.size(), start);
+	if (i >= 0 && ends[i] > start)
+		return true;
+	size_t next = (size_t)(i + 1);
+	return next < starts.size() && starts[next] < end;
+}
+
+bool JitSymbols::getProc(PROFILER_ADDR addr, std::wstring &name_out) const
+{
+	ptrdiff_t i = find(addr);
+	if (i < 0)
+		return false;
+
+	const char *name = &names[nameOffsets[i]];
+	int len = MultiByteToWideChar(CP_UTF8, 0, name, -1, NULL, 0);
+	if (len <= 1)
+		return false;
+	name_out.resize(len - 1);
+	MultiByteToWideChar(CP_UTF8, 0, name, -1, &name_out[0], len);
+	return true;
+}
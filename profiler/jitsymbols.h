@@ -0,0 +1,99 @@
+/*=====================================================================
+jitsymbols.h
+------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#ifndef __JITSYMBOLS_H_666_
+#define __JITSYMBOLS_H_666_
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include "profiler.h"
+
+/*=====================================================================
+JitSymbols
+----------
+Names for code a JIT compiler generated in the target, which lives
+outside any module. JITs that support Linux perf can describe their code
+in a perf map (perf-<pid>.map, a line of "start size name" per function)
+or a jitdump file (jit-<pid>.dump); on Windows we look for either in the
+temp folder.
+
+The JIT keeps appending to them as it compiles more, so refresh() only
+reads what was added since the last call. Entries are kept sorted by
+start address, non-overlapping, the same way SymbolInfo keeps modules;
+where code was replaced, the newest entry wins, and code that moved
+leaves a gap where it was.
+=====================================================================*/
+class JitSymbols
+{
+public:
+	JitSymbols(DWORD pid);
+
+	/// Reads whatever the files have gained since last time. Returns true
+	/// if there were new entries, and sets replaced if any of them took
+	/// over addresses already mapped (code recompiled or moved).
+	bool refresh(bool *replaced);
+
+	bool contains(PROFILER_ADDR addr) const { return find(addr) >= 0; }
+	bool getProc(PROFILER_ADDR addr, std::wstring &name_out) const;
+
+	size_t getCount() const { return starts.size(); }
+
+private:
+	/// A file being followed, and the end of what we've read of it that
+	/// didn't make a complete line or record yet.
+	struct Source
+	{
+		std::wstring path;
+		ULONGLONG offset;
+		std::string pending;
+		bool headerRead;
+	};
+
+	struct Entry
+	{
+		PROFILER_ADDR start, end;
+		DWORD name;				// offset into names, UTF-8, or NO_NAME
+	};
+
+	// Marks the range code moved away from as unmapped.
+	static const DWORD NO_NAME = (DWORD)-1;
+
+	Source perfMap, jitDump;
+
+	std::vector<Entry> entries;	// in the order read
+	std::vector<char> names;
+
+	// The index, rebuilt from entries when they change.
+	std::vector<PROFILER_ADDR> starts, ends;
+	std::vector<DWORD> nameOffsets;
+
+	static bool readMore(Source &source);
+	void addEntry(PROFILER_ADDR start, PROFILER_ADDR size, const char *name, size_t len);
+	size_t parsePerfMap();
+	size_t parseJitDump();
+	void buildIndex();
+	ptrdiff_t find(PROFILER_ADDR addr) const;
+	bool overlaps(PROFILER_ADDR start, PROFILER_ADDR end) const;
+};
+
+#endif //__JITSYMBOLS_H_666_
@@ -0,0 +1,1064 @@
+/*=====================================================================
+nativesymbols.cpp
+-----------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#include "nativesymbols.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string.h>
+#include <stdlib.h>
+
+static const DWORD NO_FILE = 0xFFFFFFFF;
+
+static std::wstring fromUtf8(const char *s, size_t len)
+{
+	if (!len)
+		return std::wstring();
+	std::wstring out(len, 0);
+	int n = MultiByteToWideChar(CP_UTF8, 0, s, (int)len, &out[0], (int)len);
+	out.resize(n > 0 ? n : 0);
+	return out;
+}
+
+/*=====================================================================
+DwarfCursor
+-----------
+Bounds-checked reads from a DWARF section. Reading past the end returns
+zeros and clears 'ok', so callers can check once after a batch of reads.
+=====================================================================*/
+struct DwarfCursor
+{
+	const BYTE *p, *end;
+	bool ok;
+
+	DwarfCursor(const BYTE *p_, const BYTE *end_) : p(p_), end(end_), ok(true) {}
+
+	bool have(size_t n)
+	{
+		if (ok && (size_t)(end - p) >= n)
+			return true;
+		ok = false;
+		return false;
+	}
+
+	BYTE u8() { return have(1) ? *p++ : 0; }
+	WORD u16() { WORD v = 0; if (have(2)) { memcpy(&v, p, 2); p += 2; } return v; }
+	DWORD u32() { DWORD v = 0; if (have(4)) { memcpy(&v, p, 4); p += 4; } return v; }
+	ULONGLONG u64() { ULONGLONG v = 0; if (have(8)) { memcpy(&v, p, 8); p += 8; } return v; }
+	void skip(ULONGLONG n) { if (have((size_t)n)) p += (size_t)n; }
+
+	ULONGLONG uleb()
+	{
+		ULONGLONG v = 0;
+		for (int shift = 0; have(1); shift += 7)
+		{
+			BYTE b = *p++;
+			if (shift < 64)
+				v |= (ULONGLONG)(b & 0x7f) << shift;
+			if (!(b & 0x80))
+				break;
+		}
+		return v;
+	}
+
+	LONGLONG sleb()
+	{
+		LONGLONG v = 0;
+		int shift = 0;
+		BYTE b = 0;
+		while (have(1))
+		{
+			b = *p++;
+			if (shift < 64)
+				v |= (LONGLONG)(b & 0x7f) << shift;
+			shift += 7;
+			if (!(b & 0x80))
+				break;
+		}
+		if (shift < 64 && (b & 0x40))
+			v |= -((LONGLONG)1 << shift);
+		return v;
+	}
+
+	ULONGLONG offset(bool dwarf64) { return dwarf64 ? u64() : u32(); }
+	ULONGLONG addr(ULONGLONG size) { return size == 8 ? u64() : size == 4 ? u32() : (skip(size), 0); }
+
+	const char *cstr()
+	{
+		const BYTE *nul = ok ? (const BYTE *)memchr(p, 0, end - p) : NULL;
+		if (!nul)
+		{
+			ok = false;
+			return "";
+		}
+		const char *s = (const char *)p;
+		p = nul + 1;
+		return s;
+	}
+};
+
+/*=====================================================================
+PeFile
+------
+A PE image (or a separate debug file, which is a PE with only the debug
+sections) mapped read-only, with the header, section table and COFF
+symbol table located.
+=====================================================================*/
+class PeFile
+{
+public:
+	PeFile()
+	:	file(INVALID_HANDLE_VALUE), mapping(NULL), base(NULL), size(0),
+		dirs(NULL), numDirs(0), sections(NULL), numSections(0),
+		symbols(NULL), numSymbols(0), strings(NULL), stringsSize(0),
+		imageBase(0), machine(0), is64(false), timeDateStamp(0), sizeOfImage(0)
+	{
+	}
+
+	~PeFile()
+	{
+		if (base)
+			UnmapViewOfFile(base);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+	}
+
+	bool open(const std::wstring &path);
+
+	void readFunctions(NativeSymbols *out) const;
+	void readExports(NativeSymbols *out) const;
+	void readLines(NativeSymbols *out) const;
+	std::wstring getDebugLink(DWORD *crc_out) const;
+	DWORD crc32() const;
+	std::wstring getIdentity() const;
+
+private:
+	HANDLE file, mapping;
+	const BYTE *base;
+	size_t size;
+
+	const IMAGE_DATA_DIRECTORY *dirs;
+	DWORD numDirs;
+	const IMAGE_SECTION_HEADER *sections;
+	WORD numSections;
+	const BYTE *symbols;
+	DWORD numSymbols;
+	const char *strings;
+	DWORD stringsSize;
+	ULONGLONG imageBase;
+	WORD machine;
+	bool is64;
+	DWORD timeDateStamp, sizeOfImage;
+
+	std::string getSectionName(const IMAGE_SECTION_HEADER &section) const;
+	const BYTE *getSection(const char *name, DWORD *size_out) const;
+	const BYTE *rvaToPtr(DWORD rva, DWORD len) const;
+	DWORD getSectionEnd(DWORD rva) const;
+	static void addFunction(NativeSymbols *out, DWORD start, DWORD end, const char *name, size_t len);
+};
+
+bool PeFile::open(const std::wstring &path)
+{
+	file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER filesize;
+	if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart < (LONGLONG)sizeof(IMAGE_DOS_HEADER) || filesize.QuadPart > 0x7fffffff)
+		return false;
+	size = (size_t)filesize.QuadPart;
+
+	mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping)
+		return false;
+	base = (const BYTE *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!base)
+		return false;
+
+	const IMAGE_DOS_HEADER *dos = (const IMAGE_DOS_HEADER *)base;
+	if (dos->e_magic != IMAGE_DOS_SIGNATURE || dos->e_lfanew < 0 ||
+		(size_t)dos->e_lfanew + sizeof(DWORD) + sizeof(IMAGE_FILE_HEADER) + sizeof(WORD) > size ||
+		*(const DWORD *)(base + dos->e_lfanew) != IMAGE_NT_SIGNATURE)
+		return false;
+
+	const IMAGE_FILE_HEADER *header = (const IMAGE_FILE_HEADER *)(base + dos->e_lfanew + sizeof(DWORD));
+	const BYTE *optional = (const BYTE *)(header + 1);
+	if ((size_t)(optional - base) + header->SizeOfOptionalHeader > size)
+		return false;
+	machine = header->Machine;
+	timeDateStamp = header->TimeDateStamp;
+
+	WORD magic = *(const WORD *)optional;
+	if (magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC && header->SizeOfOptionalHeader >= offsetof(IMAGE_OPTIONAL_HEADER64, DataDirectory))
+	{
+		const IMAGE_OPTIONAL_HEADER64 *opt = (const IMAGE_OPTIONAL_HEADER64 *)optional;
+		is64 = true;
+		imageBase = opt->ImageBase;
+		sizeOfImage = opt->SizeOfImage;
+		dirs = opt->DataDirectory;
+		numDirs = std::min<DWORD>(opt->NumberOfRvaAndSizes,
+			(header->SizeOfOptionalHeader - offsetof(IMAGE_OPTIONAL_HEADER64, DataDirectory)) / sizeof(IMAGE_DATA_DIRECTORY));
+	}
+	else if (magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC && header->SizeOfOptionalHeader >= offsetof(IMAGE_OPTIONAL_HEADER32, DataDirectory))
+	{
+		const IMAGE_OPTIONAL_HEADER32 *opt = (const IMAGE_OPTIONAL_HEADER32 *)optional;
+		imageBase = opt->ImageBase;
+		sizeOfImage = opt->SizeOfImage;
+		dirs = opt->DataDirectory;
+		numDirs = std::min<DWORD>(opt->NumberOfRvaAndSizes,
+			(header->SizeOfOptionalHeader - offsetof(IMAGE_OPTIONAL_HEADER32, DataDirectory)) / sizeof(IMAGE_DATA_DIRECTORY));
+	}
+	else
+		return false;
+
+	sections = (const IMAGE_SECTION_HEADER *)(optional + header->SizeOfOptionalHeader);
+	numSections = header->NumberOfSections;
+	if ((size_t)((const BYTE *)(sections + numSections) - base) > size)
+		return false;
+
+	// Linked images only keep a symbol table if they weren't stripped;
+	// the string table (for long names) follows it.
+	if (header->PointerToSymbolTable && header->NumberOfSymbols &&
+		(ULONGLONG)header->PointerToSymbolTable + (ULONGLONG)header->NumberOfSymbols * IMAGE_SIZEOF_SYMBOL + sizeof(DWORD) <= size)
+	{
+		symbols = base + header->PointerToSymbolTable;
+		numSymbols = header->NumberOfSymbols;
+		strings = (const char *)(symbols + (size_t)numSymbols * IMAGE_SIZEOF_SYMBOL);
+		stringsSize = std::min<DWORD>(*(const DWORD *)strings, (DWORD)(size - ((const BYTE *)strings - base)));
+	}
+
+	return true;
+}
+
+std::string PeFile::getSectionName(const IMAGE_SECTION_HEADER &section) const
+{
+	const char *name = (const char *)section.Name;
+	size_t len = strnlen(name, IMAGE_SIZEOF_SHORT_NAME);
+
+	// GNU ld spills names longer than 8 characters ("/4") into the string table.
+	if (len > 1 && name[0] == '/' && strings)
+	{
+		DWORD offset = (DWORD)atoi(std::string(name + 1, len - 1).c_str());
+		if (offset < stringsSize)
+			return std::string(strings + offset, strnlen(strings + offset, stringsSize - offset));
+	}
+	return std::string(name, len);
+}
+
+const BYTE *PeFile::getSection(const char *name, DWORD *size_out) const
+{
+	for (WORD n=0;n<numSections;n++)
+	{
+		const IMAGE_SECTION_HEADER &section = sections[n];
+		if (getSectionName(section) != name)
+			continue;
+
+		// The raw size is rounded up to the file alignment.
+		DWORD len = section.SizeOfRawData;
+		if (section.Misc.VirtualSize && section.Misc.VirtualSize < len)
+			len = section.Misc.VirtualSize;
+		if ((ULONGLONG)section.PointerToRawData + len > size)
+			return NULL;
+		*size_out = len;
+		return base + section.PointerToRawData;
+	}
+	return NULL;
+}
+
+const BYTE *PeFile::rvaToPtr(DWORD rva, DWORD len) const
+{
+	for (WORD n=0;n<numSections;n++)
+	{
+		const IMAGE_SECTION_HEADER &section = sections[n];
+		if (rva < section.VirtualAddress || (ULONGLONG)rva - section.VirtualAddress + len > section.SizeOfRawData)
+			continue;
+		ULONGLONG offset = (ULONGLONG)section.PointerToRawData + (rva - section.VirtualAddress);
+		return offset + len <= size ? base + offset : NULL;
+	}
+	return NULL;
+}
+
+DWORD PeFile::getSectionEnd(DWORD rva) const
+{
+	for (WORD n=0;n<numSections;n++)
+	{
+		const IMAGE_SECTION_HEADER &section = sections[n];
+		DWORD len = section.Misc.VirtualSize ? section.Misc.VirtualSize : section.SizeOfRawData;
+		if (rva >= section.VirtualAddress && rva - section.VirtualAddress < len)
+			return section.VirtualAddress + len;
+	}
+	return 0;
+}
+
+void PeFile::addFunction(NativeSymbols *out, DWORD start, DWORD end, const char *name, size_t len)
+{
+	NativeSymbols::Function function = { start, end, (DWORD)out->nameStore.size() };
+	out->functionStore.push_back(function);
+	out->nameStore.insert(out->nameStore.end(), name, name + len);
+	out->nameStore.push_back(0);
+}
+
+void PeFile::readFunctions(NativeSymbols *out) const
+{
+	for (DWORD n=0;n<numSymbols;n++)
+	{
+		const IMAGE_SYMBOL *symbol = (const IMAGE_SYMBOL *)(symbols + (size_t)n * IMAGE_SIZEOF_SYMBOL);
+		n += symbol->NumberOfAuxSymbols;
+
+		if (symbol->SectionNumber <= 0 || symbol->SectionNumber > numSections)
+			continue;
+		if (symbol->StorageClass != IMAGE_SYM_CLASS_EXTERNAL && symbol->StorageClass != IMAGE_SYM_CLASS_STATIC)
+			continue;
+		const IMAGE_SECTION_HEADER &section = sections[symbol->SectionNumber-1];
+		if (!(section.Characteristics & IMAGE_SCN_CNT_CODE))
+			continue;
+
+		// Static symbols that aren't typed as functions are section
+		// names and local labels.
+		if (!ISFCN(symbol->Type) && symbol->StorageClass != IMAGE_SYM_CLASS_EXTERNAL)
+			continue;
+
+		const char *name;
+		size_t len;
+		if (symbol->N.Name.Short)
+		{
+			name = (const char *)symbol->N.ShortName;
+			len = strnlen(name, IMAGE_SIZEOF_SHORT_NAME);
+		}
+		else
+		{
+			if (!strings || symbol->N.Name.Long >= stringsSize)
+				continue;
+			name = strings + symbol->N.Name.Long;
+			len = strnlen(name, stringsSize - symbol->N.Name.Long);
+		}
+		if (!len || name[0] == '.')
+			continue;
+
+		// 32-bit x86 C symbols carry a leading underscore.
+		if (machine == IMAGE_FILE_MACHINE_I386 && name[0] == '_')
+		{
+			name++;
+			len--;
+		}
+
+		DWORD sectionSize = section.Misc.VirtualSize ? section.Misc.VirtualSize : section.SizeOfRawData;
+		addFunction(out, section.VirtualAddress + symbol->Value, section.VirtualAddress + sectionSize, name, len);
+	}
+}
+
+void PeFile::readExports(NativeSymbols *out) const
+{
+	if (numDirs <= IMAGE_DIRECTORY_ENTRY_EXPORT)
+		return;
+
+	const IMAGE_DATA_DIRECTORY &dir = dirs[IMAGE_DIRECTORY_ENTRY_EXPORT];
+	const IMAGE_EXPORT_DIRECTORY *exports = (const IMAGE_EXPORT_DIRECTORY *)rvaToPtr(dir.VirtualAddress, sizeof(IMAGE_EXPORT_DIRECTORY));
+	if (!exports)
+		return;
+
+	const DWORD *functions = (const DWORD *)rvaToPtr(exports->AddressOfFunctions, exports->NumberOfFunctions * sizeof(DWORD));
+	const DWORD *names = (const DWORD *)rvaToPtr(exports->AddressOfNames, exports->NumberOfNames * sizeof(DWORD));
+	const WORD *ordinals = (const WORD *)rvaToPtr(exports->AddressOfNameOrdinals, exports->NumberOfNames * sizeof(WORD));
+	if (!functions || !names || !ordinals)
+		return;
+
+	for (DWORD n=0;n<exports->NumberOfNames;n++)
+	{
+		if (ordinals[n] >= exports->NumberOfFunctions)
+			continue;
+
+		// Forwarders point back into the export directory, at a string.
+		DWORD rva = functions[ordinals[n]];
+		if (rva >= dir.VirtualAddress && rva - dir.VirtualAddress < dir.Size)
+			continue;
+
+		DWORD end = getSectionEnd(rva);
+		const char *name = (const char *)rvaToPtr(names[n], 1);
+		if (!end || !name)
+			continue;
+		addFunction(out, rva, end, name, strnlen(name, size - ((const BYTE *)name - base)));
+	}
+}
+
+std::wstring PeFile::getDebugLink(DWORD *crc_out) const
+{
+	DWORD len;
+	const BYTE *link = getSection(".gnu_debuglink", &len);
+	if (!link)
+		return std::wstring();
+
+	// The file name, padded to four bytes, then the CRC-32 of the debug file.
+	size_t namelen = strnlen((const char *)link, len);
+	size_t crcpos = (namelen + 4) & ~(size_t)3;
+	if (crcpos + sizeof(DWORD) > len)
+		return std::wstring();
+	memcpy(crc_out, link + crcpos, sizeof(DWORD));
+	return fromUtf8((const char *)link, namelen);
+}
+
+/// A name for this exact build of the module: the GUID and age of its
+/// CodeView record (which GNU ld writes with --build-id), as a symbol
+/// server would name its PDB; else its timestamp and size, as a symbol
+/// server would name the image. Reproducible builds zero the timestamp,
+/// so then the file's modification time stands in for it.
+std::wstring PeFile::getIdentity() const
+{
+	wchar_t buf[64];
+	const IMAGE_DEBUG_DIRECTORY *debug = NULL;
+	DWORD count = 0;
+	if (numDirs > IMAGE_DIRECTORY_ENTRY_DEBUG)
+	{
+		const IMAGE_DATA_DIRECTORY &dir = dirs[IMAGE_DIRECTORY_ENTRY_DEBUG];
+		count = dir.Size / sizeof(IMAGE_DEBUG_DIRECTORY);
+		debug = (const IMAGE_DEBUG_DIRECTORY *)rvaToPtr(dir.VirtualAddress, count * sizeof(IMAGE_DEBUG_DIRECTORY));
+	}
+
+	for (DWORD n=0;debug && n<count;n++)
+	{
+		// 'RSDS', GUID, age, PDB path
+		const DWORD RSDS_SIGNATURE = 0x53445352;
+		if (debug[n].Type != IMAGE_DEBUG_TYPE_CODEVIEW || debug[n].SizeOfData < 24 ||
+			(ULONGLONG)debug[n].PointerToRawData + 24 > size)
+			continue;
+		const BYTE *cv = base + debug[n].PointerToRawData;
+		if (*(const DWORD *)cv != RSDS_SIGNATURE)
+			continue;
+
+		GUID guid;
+		DWORD age;
+		memcpy(&guid, cv + 4, sizeof(guid));
+		memcpy(&age, cv + 20, sizeof(age));
+		swprintf(buf, sizeof(buf)/sizeof(buf[0]), L"%08X%04X%04X%02X%02X%02X%02X%02X%02X%02X%02X%X",
+			guid.Data1, guid.Data2, guid.Data3,
+			guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
+			guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7], age);
+		return buf;
+	}
+
+	DWORD stamp = timeDateStamp;
+	FILETIME modified;
+	if (!stamp && GetFileTime(file, NULL, NULL, &modified))
+		stamp = modified.dwLowDateTime ^ modified.dwHighDateTime;
+	swprintf(buf, sizeof(buf)/sizeof(buf[0]), L"%08X%x", stamp, sizeOfImage);
+	return buf;
+}
+
+DWORD PeFile::crc32() const
+{
+	static DWORD table[256];
+	if (!table[1])
+	{
+		for (DWORD n=0;n<256;n++)
+		{
+			DWORD c = n;
+			for (int k=0;k<8;k++)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	}
+
+	DWORD crc = 0xFFFFFFFF;
+	for (size_t n=0;n<size;n++)
+		crc = table[(crc ^ base[n]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+// DWARF constants used by the line table header.
+enum
+{
+	DW_LNCT_path = 1,
+	DW_LNCT_directory_index = 2,
+
+	DW_FORM_block2 = 0x03,
+	DW_FORM_block4 = 0x04,
+	DW_FORM_data2 = 0x05,
+	DW_FORM_data4 = 0x06,
+	DW_FORM_data8 = 0x07,
+	DW_FORM_string = 0x08,
+	DW_FORM_block = 0x09,
+	DW_FORM_block1 = 0x0a,
+	DW_FORM_data1 = 0x0b,
+	DW_FORM_strp = 0x0e,
+	DW_FORM_udata = 0x0f,
+	DW_FORM_data16 = 0x1e,
+	DW_FORM_line_strp = 0x1f,
+};
+
+/// Reads one attribute of a DWARF 5 directory or file entry: a string for
+/// the string forms, a number for the others. Returns false for forms we
+/// can't read (e.g. those needing .debug_str_offsets).
+static bool readForm(DwarfCursor &cur, ULONGLONG form, bool dwarf64,
+	const BYTE *str, DWORD strSize, const BYTE *lineStr, DWORD lineStrSize,
+	const char **string_out, ULONGLONG *number_out)
+{
+	*string_out = NULL;
+	*number_out = 0;
+	switch (form)
+	{
+	case DW_FORM_string:	*string_out = cur.cstr(); break;
+	case DW_FORM_strp:
+	case DW_FORM_line_strp:
+		{
+			const BYTE *section = form == DW_FORM_strp ? str : lineStr;
+			DWORD sectionSize = form == DW_FORM_strp ? strSize : lineStrSize;
+			ULONGLONG offset = cur.offset(dwarf64);
+			if (!section || offset >= sectionSize || !memchr(section + offset, 0, sectionSize - (size_t)offset))
+				return false;
+			*string_out = (const char *)section + offset;
+		}
+		break;
+	case DW_FORM_data1:		*number_out = cur.u8(); break;
+	case DW_FORM_data2:		*number_out = cur.u16(); break;
+	case DW_FORM_data4:		*number_out = cur.u32(); break;
+	case DW_FORM_data8:		*number_out = cur.u64(); break;
+	case DW_FORM_udata:		*number_out = cur.uleb(); break;
+	case DW_FORM_data16:	cur.skip(16); break;
+	case DW_FORM_block:		cur.skip(cur.uleb()); break;
+	case DW_FORM_block1:	cur.skip(cur.u8()); break;
+	case DW_FORM_block2:	cur.skip(cur.u16()); break;
+	case DW_FORM_block4:	cur.skip(cur.u32()); break;
+	default:				return false;
+	}
+	return cur.ok;
+}
+
+static bool isAbsolutePath(const std::wstring &path)
+{
+	return (!path.empty() && (path[0] == '/' || path[0] == '\\')) || (path.size() > 1 && path[1] == ':');
+}
+
+void PeFile::readLines(NativeSymbols *out) const
+{
+	DWORD lineSize = 0, strSize = 0, lineStrSize = 0;
+	const BYTE *line = getSection(".debug_line", &lineSize);
+	const BYTE *str = getSection(".debug_str", &strSize);
+	const BYTE *lineStr = getSection(".debug_line_str", &lineStrSize);
+	if (!line)
+		return;
+
+	std::map<std::wstring, DWORD> fileIndex;
+	DwarfCursor all(line, line + lineSize);
+	while (all.ok && all.p < all.end)
+	{
+		// Unit header.
+		bool dwarf64 = false;
+		ULONGLONG length = all.u32();
+		if (length == 0xffffffff)
+		{
+			length = all.u64();
+			dwarf64 = true;
+		}
+		if (!all.ok || length > (ULONGLONG)(all.end - all.p))
+			break;
+
+		DwarfCursor cur(all.p, all.p + (size_t)length);
+		all.p += (size_t)length;
+
+		WORD version = cur.u16();
+		if (version < 2 || version > 5)
+			continue;
+		ULONGLONG addrSize = is64 ? 8 : 4;
+		if (version >= 5)
+		{
+			addrSize = cur.u8();
+			cur.u8(); // segment selector size
+		}
+		ULONGLONG headerLength = cur.offset(dwarf64);
+		if (!cur.ok || headerLength > (ULONGLONG)(cur.end - cur.p))
+			continue;
+		const BYTE *program = cur.p + (size_t)headerLength;
+
+		BYTE minInstLength = cur.u8();
+		if (version >= 4)
+			cur.u8(); // maximum operations per instruction; only for VLIW
+		cur.u8(); // default is_stmt
+		signed char lineBase = (signed char)cur.u8();
+		BYTE lineRange = cur.u8();
+		BYTE opcodeBase = cur.u8();
+		if (!cur.ok || !lineRange || !opcodeBase)
+			continue;
+		std::vector<BYTE> opcodeLengths(opcodeBase, 0);
+		for (BYTE n=1;n<opcodeBase;n++)
+			opcodeLengths[n] = cur.u8();
+
+		// Directory and file tables. Files are numbered from 1 before
+		// DWARF 5 and from 0 after; 'files' maps either to out->files.
+		std::vector<std::wstring> dirs;
+		std::vector<DWORD> files;
+		std::vector<std::pair<std::wstring, ULONGLONG> > names;
+		if (version >= 5)
+		{
+			bool readable = true;
+			for (int table=0;table<2 && readable;table++)
+			{
+				std::vector<std::pair<ULONGLONG, ULONGLONG> > formats(cur.u8());
+				for (size_t n=0;n<formats.size();n++)
+				{
+					formats[n].first = cur.uleb();
+					formats[n].second = cur.uleb();
+				}
+				ULONGLONG count = cur.uleb();
+				for (ULONGLONG n=0;n<count && readable && cur.ok;n++)
+				{
+					std::wstring path;
+					ULONGLONG dir = 0;
+					for (size_t f=0;f<formats.size() && readable;f++)
+					{
+						const char *s;
+						ULONGLONG v;
+						readable = readForm(cur, formats[f].second, dwarf64, str, strSize, lineStr, lineStrSize, &s, &v);
+						if (formats[f].first == DW_LNCT_path && s)
+							path = fromUtf8(s, strlen(s));
+						else if (formats[f].first == DW_LNCT_directory_index)
+							dir = v;
+					}
+					if (table == 0)
+						dirs.push_back(path);
+					else
+						names.push_back(std::make_pair(path, dir));
+				}
+			}
+			if (!readable)
+				continue;
+		}
+		else
+		{
+			// Directory 0 is the compilation directory, which is only
+			// recorded in .debug_info; leave such paths relative.
+			dirs.push_back(std::wstring());
+			for (const char *s = cur.cstr(); cur.ok && *s; s = cur.cstr())
+				dirs.push_back(fromUtf8(s, strlen(s)));
+			names.push_back(std::make_pair(std::wstring(), (ULONGLONG)-1));
+			for (const char *s = cur.cstr(); cur.ok && *s; s = cur.cstr())
+			{
+				ULONGLONG dir = cur.uleb();
+				cur.uleb(); // modification time
+				cur.uleb(); // length
+				names.push_back(std::make_pair(fromUtf8(s, strlen(s)), dir));
+			}
+		}
+		if (!cur.ok)
+			continue;
+
+		for (size_t n=0;n<names.size();n++)
+		{
+			if (names[n].second == (ULONGLONG)-1 || names[n].first.empty())
+			{
+				files.push_back(NO_FILE);
+				continue;
+			}
+
+			std::wstring path = names[n].first;
+			if (!isAbsolutePath(path) && names[n].second < dirs.size() && !dirs[(size_t)names[n].second].empty())
+				path = dirs[(size_t)names[n].second] + L"\\" + path;
+			std::replace(path.begin(), path.end(), L'/', L'\\');
+
+			auto known = fileIndex.find(path);
+			if (known == fileIndex.end())
+			{
+				known = fileIndex.insert(std::make_pair(path, (DWORD)out->files.size())).first;
+				out->files.push_back(path);
+			}
+			files.push_back(known->second);
+		}
+
+		// Run the line number program.
+		cur.p = program;
+		ULONGLONG address = 0;
+		ULONGLONG file = 1;
+		LONGLONG lineNum = 1;
+		while (cur.ok && cur.p < cur.end)
+		{
+			bool emit = false, endSequence = false;
+			BYTE op = cur.u8();
+			if (op >= opcodeBase)
+			{
+				int adjusted = op - opcodeBase;
+				address += (adjusted / lineRange) * minInstLength;
+				lineNum += lineBase + adjusted % lineRange;
+				emit = true;
+			}
+			else if (op == 0)
+			{
+				ULONGLONG len = cur.uleb();
+				if (!cur.ok || !len || len > (ULONGLONG)(cur.end - cur.p))
+					break;
+				const BYTE *next = cur.p + (size_t)len;
+				BYTE sub = cur.u8();
+				if (sub == 1) // DW_LNE_end_sequence
+					emit = endSequence = true;
+				else if (sub == 2) // DW_LNE_set_address
+					address = cur.addr(len - 1);
+				cur.p = next;
+			}
+			else switch (op)
+			{
+			case 1:	emit = true; break;											// DW_LNS_copy
+			case 2:	address += cur.uleb() * minInstLength; break;				// DW_LNS_advance_pc
+			case 3:	lineNum += cur.sleb(); break;								// DW_LNS_advance_line
+			case 4:	file = cur.uleb(); break;									// DW_LNS_set_file
+			case 8:	address += ((255 - opcodeBase) / lineRange) * minInstLength; break;	// DW_LNS_const_add_pc
+			case 9:	address += cur.u16(); break;								// DW_LNS_fixed_advance_pc
+			default:
+				for (BYTE n=0;n<opcodeLengths[op];n++)
+					cur.uleb();
+				break;
+			}
+
+			// Code the linker threw away keeps its address of zero.
+			if (emit && address >= imageBase && address - imageBase <= 0xffffffff)
+			{
+				NativeSymbols::Line row;
+				row.rva = (DWORD)(address - imageBase);
+				row.file = file < files.size() ? files[(size_t)file] : NO_FILE;
+				row.line = endSequence ? 0 : (DWORD)lineNum;
+				out->lineStore.push_back(row);
+			}
+			if (endSequence)
+			{
+				address = 0;
+				file = 1;
+				lineNum = 1;
+			}
+		}
+	}
+}
+
+// Index files hold this header, then the functions, the lines, the names
+// and the file paths (UTF-8, each NUL terminated), all little-endian.
+// Change the magic whenever the layout or the decoding changes.
+static const char INDEX_MAGIC[8] = { 'S', 'L', 'P', 'Y', 'I', 'D', 'X', '1' };
+
+struct IndexHeader
+{
+	char magic[8];
+	DWORD numFunctions;
+	DWORD numLines;
+	DWORD namesSize;
+	DWORD filesSize;
+	DWORD numFiles;
+	DWORD reserved;
+};
+
+NativeSymbols::NativeSymbols()
+:	functions(NULL), numFunctions(0),
+	lines(NULL), numLines(0),
+	names(NULL),
+	indexFile(INVALID_HANDLE_VALUE), indexMapping(NULL), indexView(NULL)
+{
+}
+
+NativeSymbols::~NativeSymbols()
+{
+	if (indexView)
+		UnmapViewOfFile(indexView);
+	if (indexMapping)
+		CloseHandle(indexMapping);
+	if (indexFile != INVALID_HANDLE_VALUE)
+		CloseHandle(indexFile);
+}
+
+NativeSymbols *NativeSymbols::load(const std::wstring &path, const std::vector<std::wstring> &searchDirs,
+	const std::wstring &indexDir)
+{
+	PeFile image;
+	if (!image.open(path))
+		return NULL;
+
+	std::wstring indexPath;
+	std::wstring identity = image.getIdentity();
+	if (!indexDir.empty() && !identity.empty())
+		indexPath = indexDir + L"\\" + path.substr(path.find_last_of(L"\\/") + 1) + L"." + identity + L".sym";
+
+	std::unique_ptr<NativeSymbols> syms(new NativeSymbols());
+	if (!indexPath.empty() && syms->loadIndex(indexPath))
+		return syms.release();
+
+	image.readFunctions(syms.get());
+	image.readLines(syms.get());
+
+	// A stripped module may name a separate file with the rest.
+	DWORD crc = 0;
+	std::wstring link = (syms->functionStore.empty() || syms->lineStore.empty()) ? image.getDebugLink(&crc) : std::wstring();
+	if (!link.empty())
+	{
+		std::wstring folder = path.substr(0, path.find_last_of(L"\\/") + 1);
+		std::vector<std::wstring> candidates;
+		candidates.push_back(folder + link);
+		candidates.push_back(folder + L".debug\\" + link);
+		for (size_t n=0;n<searchDirs.size();n++)
+			candidates.push_back(searchDirs[n] + L"\\" + link);
+
+		for (size_t n=0;n<candidates.size();n++)
+		{
+			PeFile debug;
+			if (!debug.open(candidates[n]) || debug.crc32() != crc)
+				continue;
+			if (syms->functionStore.empty())
+				debug.readFunctions(syms.get());
+			if (syms->lineStore.empty())
+				debug.readLines(syms.get());
+			break;
+		}
+	}
+
+	if (syms->functionStore.empty())
+		image.readExports(syms.get());
+
+	if (syms->functionStore.empty() && syms->lineStore.empty())
+		return NULL;
+
+	syms->sortStores();
+	if (!indexPath.empty())
+		syms->saveIndex(indexPath);
+	return syms.release();
+}
+
+std::wstring NativeSymbols::getIdentity(const std::wstring &path)
+{
+	PeFile image;
+	if (!image.open(path))
+		return std::wstring();
+	return image.getIdentity();
+}
+
+/// Sorts the freshly decoded tables by address and points the lookups at
+/// them. A function ends where the next one starts (or its section does);
+/// of several names for one address, the first one seen is kept.
+void NativeSymbols::sortStores()
+{
+	std::stable_sort(functionStore.begin(), functionStore.end(), [](const Function &a, const Function &b) {
+		return a.start < b.start;
+	});
+	functionStore.erase(std::unique(functionStore.begin(), functionStore.end(), [](const Function &a, const Function &b) {
+		return a.start == b.start;
+	}), functionStore.end());
+	for (size_t n=0;n+1<functionStore.size();n++)
+		functionStore[n].end = std::min(functionStore[n].end, functionStore[n+1].start);
+
+	// Where a sequence ends at the address the next one starts, the end
+	// marker must sort first so lookups land on the real row.
+	std::stable_sort(lineStore.begin(), lineStore.end(), [](const Line &a, const Line &b) {
+		return a.rva < b.rva || (a.rva == b.rva && a.line == 0 && b.line != 0);
+	});
+
+	functionStore.shrink_to_fit();
+	lineStore.shrink_to_fit();
+
+	functions = functionStore.empty() ? NULL : &functionStore[0];
+	numFunctions = functionStore.size();
+	lines = lineStore.empty() ? NULL : &lineStore[0];
+	numLines = lineStore.size();
+	names = nameStore.empty() ? NULL : &nameStore[0];
+}
+
+/// Maps an index file written by saveIndex. Returns false, having mapped
+/// nothing, if it's missing or doesn't add up.
+bool NativeSymbols::loadIndex(const std::wstring &path)
+{
+	indexFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (indexFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER filesize;
+	if (GetFileSizeEx(indexFile, &filesize) && filesize.QuadPart >= (LONGLONG)sizeof(IndexHeader) && filesize.QuadPart <= 0x7fffffff)
+	{
+		indexMapping = CreateFileMappingW(indexFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (indexMapping)
+			indexView = (const BYTE *)MapViewOfFile(indexMapping, FILE_MAP_READ, 0, 0, 0);
+	}
+
+	bool valid = false;
+	if (indexView)
+	{
+		const IndexHeader *header = (const IndexHeader *)indexView;
+		ULONGLONG expected = sizeof(IndexHeader)
+			+ (ULONGLONG)header->numFunctions * sizeof(Function)
+			+ (ULONGLONG)header->numLines * sizeof(Line)
+			+ header->namesSize + header->filesSize;
+		valid = memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && expected == (ULONGLONG)filesize.QuadPart
+			&& (!header->namesSize || indexView[sizeof(IndexHeader) + header->numFunctions * sizeof(Function)
+				+ header->numLines * sizeof(Line) + header->namesSize - 1] == 0)
+			&& (!header->filesSize || indexView[filesize.QuadPart - 1] == 0);
+
+		if (valid)
+		{
+			functions = (const Function *)(indexView + sizeof(IndexHeader));
+			numFunctions = header->numFunctions;
+			lines = (const Line *)(functions + numFunctions);
+			numLines = header->numLines;
+			names = (const char *)(lines + numLines);
+
+			const char *path = names + header->namesSize;
+			const char *end = path + header->filesSize;
+			while (path < end)
+			{
+				size_t len = strlen(path);
+				files.push_back(fromUtf8(path, len));
+				path += len + 1;
+			}
+
+			// Everything the lookups index by must be in range.
+			valid = files.size() == header->numFiles;
+			for (size_t n=0;n<numFunctions && valid;n++)
+				valid = functions[n].name < header->namesSize;
+			for (size_t n=0;n<numLines && valid;n++)
+				valid = lines[n].file < files.size() || lines[n].file == NO_FILE;
+		}
+	}
+
+	if (!valid)
+	{
+		if (indexView)
+			UnmapViewOfFile(indexView);
+		if (indexMapping)
+			CloseHandle(indexMapping);
+		CloseHandle(indexFile);
+		indexView = NULL;
+		indexMapping = NULL;
+		indexFile = INVALID_HANDLE_VALUE;
+		functions = NULL;
+		lines = NULL;
+		names = NULL;
+		numFunctions = numLines = 0;
+		files.clear();
+	}
+	return valid;
+}
+
+/// Writes the tables out for loadIndex. The file is written under a
+/// temporary name and renamed into place, so other instances never map a
+/// partial one. Failing to write it is fine, it's only a cache.
+void NativeSymbols::saveIndex(const std::wstring &path) const
+{
+	std::string fileData;
+	for (size_t n=0;n<files.size();n++)
+	{
+		int len = WideCharToMultiByte(CP_UTF8, 0, files[n].c_str(), (int)files[n].size(), NULL, 0, NULL, NULL);
+		size_t pos = fileData.size();
+		fileData.resize(pos + len + 1);
+		if (len)
+			WideCharToMultiByte(CP_UTF8, 0, files[n].c_str(), (int)files[n].size(), &fileData[pos], len, NULL, NULL);
+	}
+
+	IndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.numFunctions = (DWORD)numFunctions;
+	header.numLines = (DWORD)numLines;
+	header.namesSize = (DWORD)nameStore.size();
+	header.filesSize = (DWORD)fileData.size();
+	header.numFiles = (DWORD)files.size();
+
+	wchar_t suffix[32];
+	swprintf(suffix, sizeof(suffix)/sizeof(suffix[0]), L".%u.tmp", (unsigned)GetCurrentProcessId());
+	std::wstring temp = path + suffix;
+
+	HANDLE file = CreateFileW(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+
+	struct { const void *data; size_t size; } parts[] = {
+		{ &header, sizeof(header) },
+		{ functions, numFunctions * sizeof(Function) },
+		{ lines, numLines * sizeof(Line) },
+		{ names, nameStore.size() },
+		{ fileData.data(), fileData.size() },
+	};
+	bool ok = true;
+	for (size_t n=0;n<sizeof(parts)/sizeof(parts[0]) && ok;n++)
+	{
+		DWORD written = 0;
+		ok = !parts[n].size || (WriteFile(file, parts[n].data, (DWORD)parts[n].size, &written, NULL) && written == parts[n].size);
+	}
+	CloseHandle(file);
+
+	if (!ok || !MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+		DeleteFileW(temp.c_str());
+}
+
+bool NativeSymbols::getProc(DWORD rva, std::wstring &name_out) const
+{
+	const Function *i = std::upper_bound(functions, functions + numFunctions, rva, [](DWORD rva, const Function &f) {
+		return rva < f.start;
+	});
+	if (i == functions)
+		return false;
+	--i;
+	if (rva >= i->end)
+		return false;
+
+	const char *name = &names[i->name];
+	name_out = fromUtf8(name, strlen(name));
+	return true;
+}
+
+bool NativeSymbols::getLine(DWORD rva, std::wstring &filepath_out, int &linenum_out) const
+{
+	const Line *i = std::upper_bound(lines, lines + numLines, rva, [](DWORD rva, const Line &l) {
+		return rva < l.rva;
+	});
+	if (i == lines)
+		return false;
+	--i;
+	if (i->line == 0 || i->file == NO_FILE)
+		return false;
+
+	filepath_out = files[i->file];
+	linenum_out = (int)i->line;
+	return true;
+}
+
+void NativeSymbols::getSymbols(const DWORD *rvas, size_t count,
+	std::wstring *names_out, std::wstring *filepaths_out, int *linenums_out) const
+{
+	// f and l stay one past the last entry starting at or below the
+	// current RVA, and only move forwards.
+	size_t f = 0, l = 0;
+	for (size_t n=0;n<count;n++)
+	{
+		DWORD rva = rvas[n];
+
+		while (f < numFunctions && functions[f].start <= rva)
+			f++;
+		names_out[n].clear();
+		if (f > 0 && rva < functions[f-1].end)
+		{
+			const char *name = &names[functions[f-1].name];
+			names_out[n] = fromUtf8(name, strlen(name));
+		}
+
+		while (l < numLines && lines[l].rva <= rva)
+			l++;
+		filepaths_out[n].clear();
+		linenums_out[n] = 0;
+		if (l > 0 && lines[l-1].line != 0 && lines[l-1].file != NO_FILE)
+		{
+			filepaths_out[n] = files[lines[l-1].file];
+			linenums_out[n] = (int)lines[l-1].line;
+		}
+	}
+}
@@ -0,0 +1,120 @@
+/*=====================================================================
+nativesymbols.h
+---------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#ifndef __NATIVESYMBOLS_H_666_
+#define __NATIVESYMBOLS_H_666_
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+/*=====================================================================
+NativeSymbols
+-------------
+Function names and line numbers read straight out of a module built by
+GCC or Clang for MinGW, for modules dbghelp has no PDB for: names from
+the COFF symbol table (or failing that the export table), and lines from
+DWARF .debug_line. If the module has been stripped, its .gnu_debuglink
+is followed to the separate debug file.
+
+Everything is decoded once, when the module is loaded, into sorted
+arrays keyed by RVA, so lookups are a binary search and don't depend on
+where ASLR put the module.
+
+Given an index folder, the arrays are also written to a file there named
+after the module's identity (the CodeView GUID and age GNU ld writes with
+--build-id, else its timestamp and size), and later loads of the same
+module just map that file rather than decoding anything.
+=====================================================================*/
+class NativeSymbols
+{
+public:
+	/// Reads a module (a path to the image on disk). searchDirs are looked
+	/// in for .gnu_debuglink files, after the module's own folder and its
+	/// .debug subfolder. indexDir may be empty for no index. Returns NULL
+	/// if there are neither names nor lines.
+	static NativeSymbols *load(const std::wstring &path, const std::vector<std::wstring> &searchDirs,
+		const std::wstring &indexDir);
+
+	/// The identity load names index files by, for the image at path;
+	/// empty if it can't be read. Also how a capture records which build
+	/// of a module it saw.
+	static std::wstring getIdentity(const std::wstring &path);
+
+	~NativeSymbols();
+
+	/// rva is the address minus the base the module is loaded at.
+	bool getProc(DWORD rva, std::wstring &name_out) const;
+	bool getLine(DWORD rva, std::wstring &filepath_out, int &linenum_out) const;
+
+	/// getProc and getLine for a batch of RVAs, which must be sorted, in a
+	/// single pass over the tables rather than a search each. An empty name
+	/// or file means getProc or getLine would have returned false.
+	void getSymbols(const DWORD *rvas, size_t count,
+		std::wstring *names_out, std::wstring *filepaths_out, int *linenums_out) const;
+
+	size_t getFunctionCount() const { return numFunctions; }
+	size_t getLineCount() const { return numLines; }
+	bool isFromIndex() const { return indexView != NULL; }
+
+private:
+	NativeSymbols();
+
+	struct Function
+	{
+		DWORD start, end;		// RVAs
+		DWORD name;				// offset into names, UTF-8
+	};
+
+	/// One row of the decoded line tables. A row with line 0 ends a
+	/// sequence: addresses from there on have no line until the next row.
+	struct Line
+	{
+		DWORD rva;
+		DWORD file;				// index into files
+		DWORD line;
+	};
+
+	// The tables, pointing either into the stores below or into a mapped
+	// index file.
+	const Function *functions;
+	size_t numFunctions;
+	const Line *lines;
+	size_t numLines;
+	const char *names;
+	std::vector<std::wstring> files;
+
+	std::vector<Function> functionStore;
+	std::vector<Line> lineStore;
+	std::vector<char> nameStore;
+
+	HANDLE indexFile, indexMapping;
+	const BYTE *indexView;
+
+	void sortStores();
+	bool loadIndex(const std::wstring &path);
+	void saveIndex(const std::wstring &path) const;
+
+	friend class PeFile;
+};
+
+#endif //__NATIVESYMBOLS_H_666_
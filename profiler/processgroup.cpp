@@ -0,0 +1,586 @@
+/*=====================================================================
+processgroup.cpp
+----------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#include "processgroup.h"
+#include <wx/filename.h>
+#include <wx/wfstream.h>
+#include <wx/zipstrm.h>
+#include <wx/txtstrm.h>
+
+#include "../utils/stringutils.h"
+#include "../utils/osutils.h"
+#include "../utils/except.h"
+#include "../appinfo.h"
+#include <sddl.h>
+#include <time.h>
+
+// Same as a normal capture without an overhead budget.
+static const double SAMPLE_INTERVAL_MS = 100;
+
+// A process that has only just started may not have its modules listed
+// yet, so loading its symbols is retried on the next few samples.
+static const int MAX_SYMBOL_ATTEMPTS = 10;
+
+std::wstring ProcessSelector::describe() const
+{
+	std::wstring s;
+	if (!imagePattern.empty())
+		s += L"name " + imagePattern;
+	if (!jobName.empty())
+		s += (s.empty() ? L"" : L", ") + std::wstring(L"job ") + jobName;
+	if (!user.empty())
+		s += (s.empty() ? L"" : L", ") + std::wstring(L"user ") + user;
+	return L"Processes matching " + s;
+}
+
+ProcessGroupThread::ProcessGroupThread(const ProcessSelector &selector_)
+:	selector(selector_),
+	job(NULL)
+{
+	if (!selector.imagePattern.empty())
+		imageRegex.assign(selector.imagePattern, std::regex::ECMAScript | std::regex::icase);
+	if (!selector.jobName.empty())
+		job = wenforce(OpenJobObject(JOB_OBJECT_QUERY, FALSE, selector.jobName.c_str()), "OpenJobObject");
+
+	maxDepth = DEFAULT_MAX_CALLSTACK_LEVELS;
+	intervalMs = SAMPLE_INTERVAL_MS;
+	numsamplessofar = 0;
+	numThreadsRunning = 0;
+	done = false;
+	failed = false;
+	paused = false;
+	cancelled = false;
+	symbolsPermille = 0;
+	status = L"Initializing";
+
+	filename = wxFileName::CreateTempFileName(wxEmptyString);
+}
+
+ProcessGroupThread::~ProcessGroupThread()
+{
+	for (size_t n=0;n<targets.size();n++)
+	{
+		retire(*targets[n]);
+		CloseHandle(targets[n]->process);
+	}
+	if (job)
+		CloseHandle(job);
+}
+
+/// Looks for new matching processes, and new or finished threads in the
+/// ones already found.
+void ProcessGroupThread::discover()
+{
+	if (!snapshot.take())
+		return;
+
+	std::set<DWORD> present;
+	const std::vector<ProcessCounters> &processes = snapshot.getProcesses();
+	for (size_t n=0;n<processes.size();n++)
+	{
+		const ProcessCounters &proc = processes[n];
+		present.insert(proc.id);
+
+		// Don't profile the idle process, or ourselves. Bad things happen.
+		if (proc.id == 0 || proc.id == GetCurrentProcessId())
+			continue;
+
+		Target *target = NULL;
+		auto live = liveTargets.find(proc.id);
+		if (live != liveTargets.end())
+			target = live->second;
+		else if (rejected.find(proc.id) == rejected.end())
+			target = addTarget(proc);
+
+		if (target)
+			refreshThreads(*target, proc);
+		else
+			rejected.insert(proc.id);
+	}
+
+	// Retire processes that have exited, and forget rejected ones whose
+	// ids may now be reused.
+	for (auto it = liveTargets.begin(); it != liveTargets.end();)
+	{
+		Target &target = *it->second;
+		if (present.find(target.id) == present.end() || WaitForSingleObject(target.process, 0) == WAIT_OBJECT_0)
+		{
+			retire(target);
+			it = liveTargets.erase(it);
+		}
+		else
+			++it;
+	}
+	for (auto it = rejected.begin(); it != rejected.end();)
+	{
+		if (present.find(*it) == present.end())
+			it = rejected.erase(it);
+		else
+			++it;
+	}
+}
+
+ProcessGroupThread::Target *ProcessGroupThread::addTarget(const ProcessCounters &proc)
+{
+	if (!selector.imagePattern.empty() && !std::regex_match(proc.imageName, imageRegex))
+		return NULL;
+
+	HANDLE process = OpenProcess(PROCESS_ALL_ACCESS, FALSE, proc.id);
+	if (!process)
+		return NULL;
+
+	BOOL inJob = TRUE;
+	if (!CanProfileProcess(process) ||
+		(job && (!IsProcessInJob(process, job, &inJob) || !inJob)) ||
+		(!selector.user.empty() && !matchesUser(process)))
+	{
+		CloseHandle(process);
+		return NULL;
+	}
+
+	std::unique_ptr<Target> target(new Target);
+	target->id = proc.id;
+	target->name = proc.imageName;
+	target->process = process;
+	target->exited = false;
+	target->symbolAttempts = 0;
+
+	Target *added = target.get();
+	targets.push_back(std::move(target));
+	liveTargets[proc.id] = added;
+	return added;
+}
+
+/// Compares the account a process runs as with selector.user, as a SID
+/// string or an account name with or without its domain. Account lookups
+/// can go to a domain controller, so the answer is kept for each SID.
+bool ProcessGroupThread::matchesUser(HANDLE process)
+{
+	HANDLE token;
+	if (!OpenProcessToken(process, TOKEN_QUERY, &token))
+		return false;
+
+	BYTE buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+	DWORD size = 0;
+	BOOL gotUser = GetTokenInformation(token, TokenUser, buffer, sizeof(buffer), &size);
+	CloseHandle(token);
+	if (!gotUser)
+		return false;
+
+	PSID sid = ((TOKEN_USER *)buffer)->User.Sid;
+	LPWSTR sidString = NULL;
+	if (!ConvertSidToStringSid(sid, &sidString))
+		return false;
+	std::wstring key = sidString;
+	LocalFree(sidString);
+
+	auto cached = userMatches.find(key);
+	if (cached != userMatches.end())
+		return cached->second;
+
+	bool match = _wcsicmp(key.c_str(), selector.user.c_str()) == 0;
+	if (!match)
+	{
+		wchar_t name[256], domain[256];
+		DWORD nameLen = _countof(name), domainLen = _countof(domain);
+		SID_NAME_USE use;
+		if (LookupAccountSid(NULL, sid, name, &nameLen, domain, &domainLen, &use))
+		{
+			match = _wcsicmp(name, selector.user.c_str()) == 0 ||
+				_wcsicmp((std::wstring(domain) + L"\\" + name).c_str(), selector.user.c_str()) == 0;
+		}
+	}
+
+	userMatches[key] = match;
+	return match;
+}
+
+void ProcessGroupThread::refreshThreads(Target &target, const ProcessCounters &proc)
+{
+	std::set<DWORD> present;
+	for (size_t n=0;n<proc.threads.size();n++)
+	{
+		DWORD id = proc.threads[n].id;
+		present.insert(id);
+		if (target.threads.find(id) != target.threads.end())
+			continue;
+
+		HANDLE thread = OpenThread(THREAD_ALL_ACCESS, FALSE, id);
+		if (!thread)
+			continue;
+		target.threads[id] = thread;
+		target.profilers.push_back(Profiler(target.process, thread, target.callstacks, target.flatcounts));
+		target.profilers.back().setMaxDepth(maxDepth);
+	}
+
+	for (auto it = target.threads.begin(); it != target.threads.end();)
+	{
+		if (present.find(it->first) != present.end())
+		{
+			++it;
+			continue;
+		}
+
+		for (size_t n=0;n<target.profilers.size();n++)
+		{
+			if (target.profilers[n].getTarget() == it->second)
+			{
+				target.profilers[n] = target.profilers.back();
+				target.profilers.pop_back();
+				break;
+			}
+		}
+		CloseHandle(it->second);
+		it = target.threads.erase(it);
+	}
+}
+
+/// Stops sampling a process. Its handle and symbols are kept until the
+/// capture has been saved.
+void ProcessGroupThread::retire(Target &target)
+{
+	target.exited = true;
+	target.profilers.clear();
+	for (auto it = target.threads.begin(); it != target.threads.end(); ++it)
+		CloseHandle(it->second);
+	target.threads.clear();
+}
+
+bool ProcessGroupThread::loadSymbols(Target &target)
+{
+	if (target.sym_info)
+		return true;
+	if (target.symbolAttempts >= MAX_SYMBOL_ATTEMPTS)
+		return false;
+	target.symbolAttempts++;
+
+	std::unique_ptr<SymbolInfo> sym_info(new SymbolInfo);
+	try
+	{
+		sym_info->loadSymbols(target.process, false);
+	}
+	catch (const SleepyException &)
+	{
+		return false;
+	}
+	target.sym_info = std::move(sym_info);
+	return true;
+}
+
+void ProcessGroupThread::sample(const SAMPLE_TYPE timeSpent)
+{
+	int numSuccessful = 0;
+	for (auto it = liveTargets.begin(); it != liveTargets.end(); ++it)
+	{
+		Target &target = *it->second;
+		if (!loadSymbols(target))
+			continue;
+
+		for (size_t n=0;n<target.profilers.size();n++)
+		{
+			// Unlike a single-process capture, processes exiting mid-sample
+			// are expected here, so failures just skip the thread.
+			try {
+				if (target.profilers[n].sampleTarget(timeSpent, target.sym_info.get()))
+				{
+					++numsamplessofar;
+					++numSuccessful;
+				}
+			}
+			catch (const ProfilerExcep &)
+			{
+			}
+		}
+	}
+
+	numThreadsRunning = numSuccessful;
+}
+
+void ProcessGroupThread::sampleLoop()
+{
+	timeBeginPeriod(1);
+
+	LARGE_INTEGER prev, now, lastDiscovery, freq;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&prev);
+	lastDiscovery.QuadPart = 0;
+
+	while(!this->commit_suicide)
+	{
+		if (paused)
+		{
+			Sleep(100);
+			continue;
+		}
+
+		QueryPerformanceCounter(&now);
+		double t = (double)(now.QuadPart - prev.QuadPart) / (double)freq.QuadPart;
+
+		if (lastDiscovery.QuadPart == 0 || now.QuadPart - lastDiscovery.QuadPart >= freq.QuadPart)
+		{
+			lastDiscovery = now;
+			discover();
+		}
+
+		sample(t);
+		Sleep((DWORD)intervalMs);
+
+		prev = now;
+	}
+
+	timeEndPeriod(1);
+}
+
+namespace
+{
+	typedef ResolvedSymbol GroupSymbol;
+}
+
+// Each process has its own address space, so the same address can stand
+// for different code in two of them. Output addresses keep the original
+// where it is unambiguous, and clashes are given a spare address from
+// just below the synthetic range, which no process can map either.
+static PROFILER_ADDR assignAddr(PROFILER_ADDR addr, const GroupSymbol &sym,
+	std::map<PROFILER_ADDR, GroupSymbol> &symbols,
+	std::map<std::pair<PROFILER_ADDR, std::wstring>, PROFILER_ADDR> &assigned,
+	PROFILER_ADDR &spare)
+{
+	std::pair<PROFILER_ADDR, std::wstring> key(addr,
+		sym.module + L"\n" + sym.proc + L"\n" + sym.file + L"\n" + ::toString(sym.line));
+	auto it = assigned.find(key);
+	if (it != assigned.end())
+		return it->second;
+
+	PROFILER_ADDR out = addr;
+	if (symbols.find(addr) != symbols.end())
+		out = --spare;
+	symbols[out] = sym;
+	assigned[key] = out;
+	return out;
+}
+
+void ProcessGroupThread::saveData()
+{
+	wxFFileOutputStream out(filename);
+	wxZipOutputStream zip(out);
+	wxTextOutputStream txt(zip, wxEOL_NATIVE, wxConvAuto(wxFONTENCODING_UTF8));
+
+	if (!out.IsOk() || !zip.IsOk())
+	{
+		error(L"Error writing to file");
+		return;
+	}
+
+	//------------------------------------------------------------------------
+	beginProgress(L"Saving stats", 100);
+	zip.PutNextEntry(_T("Stats.txt"));
+
+	time_t rawtime;
+	time(&rawtime);
+	txt << "Filename: " << selector.describe() << "\n";
+	txt << "Duration: " << duration << "\n";
+	txt << "Date: " << asctime(localtime(&rawtime));
+	txt << "Samples: " << numsamplessofar << "\n";
+	txt << "Sample type: cpu\n";
+	txt << "Units: seconds\n";
+	txt << "Processes: " << (unsigned)targets.size() << "\n";
+	txt << "Max stack depth: " << (unsigned)maxDepth << "\n";
+
+	//------------------------------------------------------------------------
+	size_t totalAddresses = 0;
+	std::vector<std::map<PROFILER_ADDR, PROFILER_ADDR> > remaps(targets.size());
+	for (size_t t=0;t<targets.size();t++)
+	{
+		const Target &target = *targets[t];
+		std::map<PROFILER_ADDR, PROFILER_ADDR> &remap = remaps[t];
+		for (auto i = target.flatcounts.begin(); i != target.flatcounts.end(); ++i)
+			remap[i->first] = 0;
+		for (auto i = target.callstacks.begin(); i != target.callstacks.end(); ++i)
+			for (size_t d=0;d<i->first.depth;d++)
+				remap[i->first.addr[d]] = 0;
+		totalAddresses += remap.size();
+	}
+
+	beginProgress(L"Querying symbols", (int)totalAddresses);
+
+	std::map<PROFILER_ADDR, GroupSymbol> symbols;
+	std::map<std::pair<PROFILER_ADDR, std::wstring>, PROFILER_ADDR> assigned;
+	PROFILER_ADDR spare = SymbolInfo::SYNTHETIC_ADDR_BASE;
+
+	std::map<CallStack, SAMPLE_TYPE> callstacks;
+	std::map<PROFILER_ADDR, SAMPLE_TYPE> flatcounts;
+	SAMPLE_TYPE totalCounts = 0;
+
+	for (size_t t=0;t<targets.size();t++)
+	{
+		const Target &target = *targets[t];
+		if (!target.sym_info)
+			continue;
+
+		std::map<PROFILER_ADDR, PROFILER_ADDR> &remap = remaps[t];
+		for (auto i = remap.begin(); i != remap.end(); ++i)
+		{
+			GroupSymbol sym;
+			target.sym_info->getSymbol(i->first, sym);
+			i->second = assignAddr(i->first, sym, symbols, assigned, spare);
+
+			if (updateProgress())
+				return;
+		}
+
+		GroupSymbol root;
+		root.module = L"[process]";
+		root.proc = target.name + L" " + ::toString((int)target.id);
+		root.line = 0;
+		PROFILER_ADDR rootAddr = --spare;
+		symbols[rootAddr] = root;
+
+		for (auto i = target.callstacks.begin(); i != target.callstacks.end(); ++i)
+		{
+			CallStack stack;
+			stack.reserve(i->first.depth + 1);
+			for (size_t d=0;d<i->first.depth;d++)
+				stack.push(remap[i->first.addr[d]]);
+			stack.push(rootAddr);
+			callstacks[stack] += i->second;
+		}
+
+		for (auto i = target.flatcounts.begin(); i != target.flatcounts.end(); ++i)
+		{
+			flatcounts[remap[i->first]] += i->second;
+			totalCounts += i->second;
+		}
+	}
+
+	//------------------------------------------------------------------------
+	beginProgress(L"Saving symbols", (int)symbols.size());
+	zip.PutNextEntry(_T("Symbols.txt"));
+
+	for (auto i = symbols.begin(); i != symbols.end(); ++i)
+	{
+		txt << ::toHexString(i->first);
+		txt << " ";
+		writeQuote(txt, i->second.module);
+		txt << " ";
+		writeQuote(txt, i->second.proc);
+		txt << " ";
+		writeQuote(txt, i->second.file);
+		txt << " ";
+		txt << ::toString(i->second.line);
+		txt << '\n';
+
+		if (updateProgress())
+			return;
+	}
+
+	//------------------------------------------------------------------------
+	beginProgress(L"Saving IP counts", (int)flatcounts.size());
+	zip.PutNextEntry(_T("IPCounts.txt"));
+
+	txt << totalCounts << "\n";
+
+	for (auto i = flatcounts.begin(); i != flatcounts.end(); ++i)
+	{
+		txt << ::toHexString(i->first) << " " << i->second << "\n";
+
+		if (updateProgress())
+			return;
+	}
+
+	//------------------------------------------------------------------------
+	beginProgress(L"Saving Callstacks.txt", (int)callstacks.size());
+	zip.PutNextEntry(_T("Callstacks.txt"));
+
+	for (auto i = callstacks.begin(); i != callstacks.end(); ++i)
+	{
+		txt << i->second;
+		for (size_t d=0;d<i->first.depth;d++)
+			txt << " " << ::toHexString(i->first.addr[d]);
+		txt << "\n";
+
+		if (updateProgress())
+			return;
+	}
+
+	//------------------------------------------------------------------------
+	// Change FORMAT_VERSION when the file format changes
+	// (and becomes unreadable by older versions of Sleepy).
+	zip.PutNextEntry(L"Version " _T(FORMAT_VERSION) L" required");
+	txt << FORMAT_VERSION << "\n";
+
+	if (!out.IsOk() || !zip.IsOk())
+	{
+		error(L"Error writing to file");
+		return;
+	}
+}
+
+void ProcessGroupThread::run()
+{
+	startTick = GetTickCount();
+
+	status = NULL;
+	sampleLoop();
+
+	status = L"Exiting";
+
+	if (cancelled)
+		return;
+
+	setPriority(THREAD_PRIORITY_NORMAL);
+
+	DWORD endTick = GetTickCount();
+	int diff = endTick - startTick;
+	duration = diff / 1000.0;
+
+	saveData();
+
+	done = true;
+}
+
+void ProcessGroupThread::error(const std::wstring& what)
+{
+	failed = true;
+	std::cerr << "ProcessGroupThread Error: " << what << std::endl;
+
+	::MessageBox(NULL, std::wstring(L"Error: " + what).c_str(), L"Profiler Error", MB_OK);
+}
+
+void ProcessGroupThread::beginProgress(std::wstring stage, int total)
+{
+	symbolsStage = stage;
+	symbolsDone = 0;
+	symbolsTotal = total;
+	symbolsPermille = 0;
+}
+
+bool ProcessGroupThread::updateProgress()
+{
+	symbolsDone++;
+	symbolsPermille = MulDiv(symbolsDone, 1000, symbolsTotal);
+	if (cancelled)
+	{
+		failed = true;
+		return true;
+	}
+	return false;
+}
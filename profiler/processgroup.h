@@ -0,0 +1,145 @@
+/*=====================================================================
+processgroup.h
+--------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#ifndef __PROCESSGROUP_H_666_
+#define __PROCESSGROUP_H_666_
+
+#include "../utils/mythread.h"
+#include "profiler.h"
+#include "symbolinfo.h"
+#include "systemsnapshot.h"
+
+#include <memory>
+#include <regex>
+#include <set>
+
+class wxZipOutputStream;
+class wxTextOutputStream;
+
+/// Which processes a ProcessGroupThread profiles. A process has to match
+/// every criterion that is set.
+struct ProcessSelector
+{
+	std::wstring imagePattern;	// regex matched against the whole executable name, ignoring case
+	std::wstring jobName;		// named job object the process belongs to
+	std::wstring user;			// account it runs as: user, DOMAIN\user or a SID string
+
+	bool empty() const { return imagePattern.empty() && jobName.empty() && user.empty(); }
+	std::wstring describe() const;
+};
+
+/*=====================================================================
+ProcessGroupThread
+------------------
+Profiles every process matching a ProcessSelector, including ones that
+start after the capture has. Processes and their threads are discovered
+once a second and all sampled from this one thread. Each process gets
+its own SymbolInfo, loaded the first time it is sampled, and at the end
+its samples are given a '[process]' root frame naming it, so the capture
+can be split by process.
+=====================================================================*/
+class ProcessGroupThread : public MyThread
+{
+public:
+	/// Throws SleepyException if the job object can't be opened.
+	ProcessGroupThread(const ProcessSelector &selector);
+	virtual ~ProcessGroupThread();
+
+	//call this to start profiling.
+	virtual void run();
+
+	int getNumThreadsRunning() const { return numThreadsRunning; }
+	int getNumProcesses() const { return (int)targets.size(); }
+	bool getDone() const { return done; }
+	bool getFailed() const { return failed; }
+	const wchar_t* getStatus() const { return status; }
+	int getSampleProgress() const { return numsamplessofar; }
+	void getSymbolsProgress(int *permille, std::wstring *stage) const { *permille = symbolsPermille; *stage = symbolsStage; }
+	const std::wstring &getFilename() const { return filename; }
+	void setPaused(bool paused_) { paused = paused_; }
+	void cancel() { cancelled = true; }
+
+	/// Must be called before launch().
+	void setMaxDepth(size_t depth) { maxDepth = depth; }
+	/// Time between samples. Must be called before launch().
+	void setSampleInterval(double ms) { intervalMs = ms; }
+
+private:
+	// One profiled process. Its Profilers refer to its maps, so it
+	// mustn't move once created.
+	struct Target
+	{
+		DWORD id;
+		std::wstring name;
+		HANDLE process;
+		bool exited;
+		std::unique_ptr<SymbolInfo> sym_info;
+		int symbolAttempts;
+		std::map<DWORD, HANDLE> threads;
+		std::vector<Profiler> profilers;
+		std::map<CallStack, SAMPLE_TYPE> callstacks;
+		std::map<PROFILER_ADDR, SAMPLE_TYPE> flatcounts;
+	};
+
+	void error(const std::wstring& what);
+
+	void sampleLoop();
+	void discover();
+	Target *addTarget(const ProcessCounters &proc);
+	bool matchesUser(HANDLE process);
+	void refreshThreads(Target &target, const ProcessCounters &proc);
+	void retire(Target &target);
+	bool loadSymbols(Target &target);
+	void sample(const SAMPLE_TYPE timeSpent);
+	void saveData();
+
+	std::wstring symbolsStage;
+	int symbolsPermille, symbolsDone, symbolsTotal;
+	void beginProgress(std::wstring stage, int total=0);
+	bool updateProgress();
+
+	ProcessSelector selector;
+	std::wregex imageRegex;
+	HANDLE job;
+	std::map<std::wstring, bool> userMatches;	// by SID string
+
+	SystemSnapshot snapshot;
+	std::vector<std::unique_ptr<Target> > targets;
+	std::map<DWORD, Target *> liveTargets;
+	std::set<DWORD> rejected;
+	size_t maxDepth;
+	double intervalMs;
+
+	double duration;
+	const wchar_t* status;
+	int numsamplessofar;
+	int numThreadsRunning;
+	bool done;
+	bool paused;
+	bool failed;
+	bool cancelled;
+	std::wstring filename;
+
+	DWORD startTick;
+};
+
+#endif //__PROCESSGROUP_H_666_
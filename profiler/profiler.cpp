@@ -32,6 +32,7 @@ http://www.gnu.org/copyleft/gpl.html..
 #include <process.h>
 #include <iostream>
 #include <assert.h>
+#include <algorithm>
 #include <winnt.h>
 #include "../utils/dbginterface.h"
 #include "../utils/WoW64.h"
@@ -55,7 +56,15 @@ Profiler::Profiler(HANDLE target_process_, HANDLE target_thread_,
 	target_thread(target_thread_),
 	callstacks(callstacks_),
 	flatcounts(flatcounts_),
-	is64BitProcess(Is64BitProcess(target_process_))
+	is64BitProcess(Is64BitProcess(target_process_)),
+	placementcallstacks(NULL),
+	regioncallstacks(NULL),
+	tagcallstacks(NULL),
+	tagslot(NULL),
+	maxDepth(DEFAULT_MAX_CALLSTACK_LEVELS),
+	stallTicks(0),
+	laststackSince(0),
+	lastModule(NULL)
 {
 }
 
@@ -66,7 +75,16 @@ Profiler::Profiler(const Profiler& iOther)
 	target_thread(iOther.target_thread),
 	callstacks(iOther.callstacks),
 	flatcounts(iOther.flatcounts),
-	is64BitProcess(iOther.is64BitProcess)
+	is64BitProcess(iOther.is64BitProcess),
+	placementcallstacks(iOther.placementcallstacks),
+	regioncallstacks(iOther.regioncallstacks),
+	tagcallstacks(iOther.tagcallstacks),
+	tagslot(iOther.tagslot),
+	maxDepth(iOther.maxDepth),
+	stallTicks(iOther.stallTicks),
+	laststack(iOther.laststack),
+	laststackSince(iOther.laststackSince),
+	lastModule(iOther.lastModule)
 {
 }
 
@@ -78,6 +96,15 @@ Profiler& Profiler::operator=(const Profiler& iOther)
 	target_thread = iOther.target_thread;
 	callstacks = iOther.callstacks;
 	flatcounts = iOther.flatcounts;
+	placementcallstacks = iOther.placementcallstacks;
+	regioncallstacks = iOther.regioncallstacks;
+	tagcallstacks = iOther.tagcallstacks;
+	tagslot = iOther.tagslot;
+	maxDepth = iOther.maxDepth;
+	stallTicks = iOther.stallTicks;
+	laststack = iOther.laststack;
+	laststackSince = iOther.laststackSince;
+	lastModule = iOther.lastModule;
 
 	return *this;
 }
@@ -149,18 +176,45 @@ void applyHacks(HANDLE process_handle, CONTEXT32 &context)
 	}
 }
 
+// We can't walk the kernel side of a thread's stack from user mode, but we
+// can tell when it's sitting in a system call: its IP is just past the
+// instruction in the ntdll stub that entered the kernel.
+static bool isInSyscall(HANDLE process_handle, PROFILER_ADDR ip, bool is64Bit)
+{
+	BYTE code[8]; // code[7] is the byte at ip
+	SIZE_T numRead = 0;
+	if (!ReadProcessMemory(process_handle, (LPCVOID)(ip - 7), code, 8, &numRead) || numRead < 8)
+		return false;
+
+	if (is64Bit)
+		return code[5] == 0x0f && code[6] == 0x05; // syscall
+
+	// 32-bit stubs (native and WoW64) call the transition through edx or
+	// fs:[0C0h] and return straight after.
+	if (code[7] != 0xc2 && code[7] != 0xc3)
+		return false;
+	if (code[5] == 0xff && code[6] == 0xd2) // call edx
+		return true;
+	static const BYTE callFs[7] = { 0x64, 0xff, 0x15, 0xc0, 0x00, 0x00, 0x00 }; // call fs:[0C0h]
+	return memcmp(code, callFs, 7) == 0;
+}
+
 bool Profiler::sampleTarget(SAMPLE_TYPE timeSpent, SymbolInfo *syminfo)
 {
 	// DE: 20090325: Moved declaration of stack variables to reduce size of code inside Suspend/Resume thread
 
-	CallStack stack;
+	CallStack &stack = scratch;
 	stack.depth = 0;
+	bool truncated = false;
 
 	STACKFRAME64 frame;
 	PROFILER_ADDR ip, sp, bp;
 	void *context;
 	DWORD machine;
 
+	LARGE_INTEGER suspendStart, suspendEnd;
+	QueryPerformanceCounter(&suspendStart);
+
 #if defined(_WIN64)
 	CONTEXT64 threadcontext64;
 	CONTEXT32 threadcontext32;
@@ -245,11 +299,12 @@ bool Profiler::sampleTarget(SAMPLE_TYPE timeSpent, SymbolInfo *syminfo)
 
 	DbgHelp *prevDbgHelp = NULL;
 	bool first = true;
+	const PROFILER_ADDR leafIp = ip;
 
 	for (;;)
 	{
 		// See which module this IP is in.
-		Module *mod = syminfo->getModuleForAddr(ip);
+		Module *mod = syminfo->getModuleForAddr(ip, lastModule);
 		DbgHelp *dbgHelp = mod ? mod->dbghelp : &dbgHelpMs;
 		if (!dbgHelp->Loaded)
 			break;
@@ -273,8 +328,16 @@ bool Profiler::sampleTarget(SAMPLE_TYPE timeSpent, SymbolInfo *syminfo)
 		// We skip the first one, as the first call to StackWalk64
 		// simply fills in more registers for the current frame,
 		// rather than walking down to the next one.
+		// A stack is only cut off once the walk has a frame past the limit.
 		if (!first)
-			stack.addr[stack.depth++] = ip;
+		{
+			if (stack.depth >= maxDepth)
+			{
+				truncated = true;
+				break;
+			}
+			stack.push(ip);
+		}
 		first = false;
 
 		BOOL result = dbgHelp->StackWalk64(
@@ -289,7 +352,7 @@ bool Profiler::sampleTarget(SAMPLE_TYPE timeSpent, SymbolInfo *syminfo)
 			NULL
 		);
 
-		if (!result || stack.depth >= MAX_CALLSTACK_LEVELS)
+		if (!result)
 			break;
 
 		ip = (PROFILER_ADDR)frame.AddrPC.Offset;
@@ -299,26 +362,91 @@ bool Profiler::sampleTarget(SAMPLE_TYPE timeSpent, SymbolInfo *syminfo)
 		// Stop once we hit the end of the stack.
 		if (frame.AddrReturn.Offset == 0)
 		{
-			stack.addr[stack.depth++] = ip;
+			if (stack.depth >= maxDepth)
+				truncated = true;
+			else
+				stack.push(ip);
 			break;
 		}
 	}
 
 	// TODO: Don't count samples for suspended threads
 
+	// Read the tag before resuming, so it's the one the stack was running under.
+	LONG tag = tagslot ? *tagslot : 0;
+
 	if (ResumeThread(target_thread) == 0xffffffff)
 		throw ProfilerExcep(L"ResumeThread failed.");
 
+	QueryPerformanceCounter(&suspendEnd);
+	stallTicks += suspendEnd.QuadPart - suspendStart.QuadPart;
+
 	//NOTE: this has to go after ResumeThread.  Otherwise mem allocation needed by std::map
 	//may hit a lock held by the suspended thread.
+	if (stack.depth > 0 && isInSyscall(target_process, leafIp, is64BitProcess))
+	{
+		PROFILER_ADDR kernel = syminfo->getKernelFrameAddr(leafIp);
+		if (kernel)
+			stack.pushLeaf(kernel);
+	}
+
+	// Mark cut-off stacks, so their outermost frame isn't mistaken for the root.
+	if (truncated)
+		stack.push(syminfo->getSyntheticAddr(L"[truncated]", L"[truncated]"));
+
+	if (!(stack == laststack))
+	{
+		laststack = stack;
+		laststackSince = suspendStart.QuadPart;
+	}
+
 	if (stack.depth > 0)
 	{
 		flatcounts[stack.addr[0]]+=timeSpent;
 		callstacks[stack]+=timeSpent;
+
+		if (regioncallstacks)
+		{
+			stack.push(syminfo->getSyntheticAddr(L"[marked region]", L"[marked region]"));
+			(*regioncallstacks)[stack] += timeSpent;
+			stack.depth--;
+		}
+
+		if (tagcallstacks)
+		{
+			stack.push((PROFILER_ADDR)(ULONG)tag);
+			(*tagcallstacks)[stack] += timeSpent;
+			stack.depth--;
+		}
+
+		if (placementcallstacks)
+			addPlacement(stack, timeSpent, syminfo);
 	}
 	return true;
 }
 
+// Windows doesn't expose the processor a thread last ran on, so this uses
+// its ideal processor: the one the scheduler tries to run it on, and the
+// only one it runs on if its affinity is a single processor.
+void Profiler::addPlacement(CallStack &stack, SAMPLE_TYPE timeSpent, SymbolInfo *syminfo)
+{
+	PROCESSOR_NUMBER proc;
+	if (!GetThreadIdealProcessorEx(target_thread, &proc))
+		return;
+
+	USHORT node;
+	if (!GetNumaProcessorNodeEx(&proc, &node))
+		node = 0;
+
+	wchar_t cpuname[32], nodename[32];
+	swprintf(cpuname, 32, L"CPU %u:%u", proc.Group, proc.Number);
+	swprintf(nodename, 32, L"Node %u", node);
+
+	stack.push(syminfo->getSyntheticAddr(L"[placement]", cpuname));
+	stack.push(syminfo->getSyntheticAddr(L"[placement]", nodename));
+	(*placementcallstacks)[stack] += timeSpent;
+}
+
 // returns true if the target thread has finished
 bool Profiler::targetExited() const
 {
@@ -32,6 +32,8 @@ http://www.gnu.org/copyleft/gpl.html..
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <string.h>
 
 //64 bit mode:
 #if defined(_WIN64)
@@ -43,14 +45,69 @@ typedef unsigned int PROFILER_ADDR;
 
 typedef double SAMPLE_TYPE;
 class SymbolInfo;
+class Module;
 
-#define MAX_CALLSTACK_LEVELS 256
+// Stacks deeper than the limit keep their innermost frames and get a
+// synthetic [truncated] frame as their root. See Profiler::setMaxDepth.
+#define DEFAULT_MAX_CALLSTACK_LEVELS 1024
+
+// Frames stored inside the CallStack itself; deeper stacks spill to the heap.
+#define INLINE_CALLSTACK_LEVELS 64
 
 class CallStack
 {
 public:
+	CallStack() : depth(0), addr(inline_addr), capacity(INLINE_CALLSTACK_LEVELS) {}
+	CallStack(const CallStack &other) : depth(0), addr(inline_addr), capacity(INLINE_CALLSTACK_LEVELS) { *this = other; }
+
+	CallStack &operator = (const CallStack &other)
+	{
+		if (this != &other)
+		{
+			depth = 0;
+			reserve(other.depth);
+			memcpy(addr, other.addr, other.depth * sizeof(PROFILER_ADDR));
+			depth = other.depth;
+		}
+		return *this;
+	}
+
 	size_t depth;
-	PROFILER_ADDR addr[MAX_CALLSTACK_LEVELS];
+	PROFILER_ADDR *addr; // leaf first
+
+	/// Makes room for n frames, keeping the existing ones.
+	void reserve(size_t n)
+	{
+		if (n <= capacity)
+			return;
+		n = std::max(n, capacity * 2);
+		std::vector<PROFILER_ADDR> grown(n);
+		memcpy(&grown[0], addr, depth * sizeof(PROFILER_ADDR));
+		heap.swap(grown);
+		addr = &heap[0];
+		capacity = n;
+	}
+
+	void push(PROFILER_ADDR a)
+	{
+		if (depth == capacity)
+			reserve(depth + 1);
+		addr[depth++] = a;
+	}
+
+	/// Inserts a new leaf frame.
+	void pushLeaf(PROFILER_ADDR a)
+	{
+		reserve(depth + 1);
+		memmove(&addr[1], &addr[0], depth * sizeof(PROFILER_ADDR));
+		addr[0] = a;
+		depth++;
+	}
+
+	bool operator == (const CallStack &other) const
+	{
+		return depth == other.depth && memcmp(addr, other.addr, depth * sizeof(PROFILER_ADDR)) == 0;
+	}
 
 	bool operator < (const CallStack &other) const
 	{
@@ -67,6 +124,11 @@ public:
 
 		return false;
 	}
+
+private:
+	size_t capacity;
+	PROFILER_ADDR inline_addr[INLINE_CALLSTACK_LEVELS];
+	std::vector<PROFILER_ADDR> heap;
 };
 
 class ProfilerExcep
@@ -112,11 +174,56 @@ public:
 	bool sampleTarget(SAMPLE_TYPE timeSpent, SymbolInfo *syminfo);//throws ProfilerExcep
 	bool targetExited() const;
 
+	/// If set, each sample is also added here with the processor the thread
+	/// is placed on and its NUMA node appended as two outermost frames.
+	void setPlacementCallstacks(std::map<CallStack, SAMPLE_TYPE> *stacks) { placementcallstacks = stacks; }
+
+	/// If set, each sample is also added here with a '[marked region]' root
+	/// frame. Set while the target has a marked region open.
+	void setRegionCallstacks(std::map<CallStack, SAMPLE_TYPE> *stacks) { regioncallstacks = stacks; }
+
+	/// If set, each sample is also added here with the thread's current
+	/// sleepyshim tag id appended as the outermost frame (0 if it has none).
+	/// That frame is the raw id, not an address, until ProfilerThread names it.
+	/// 'slot' is the thread's tag slot in the shim block, read while the
+	/// thread is suspended; NULL until the thread has set a tag.
+	void setTagCallstacks(std::map<CallStack, SAMPLE_TYPE> *stacks, const volatile LONG *slot) { tagcallstacks = stacks; tagslot = slot; }
+
+	/// Frames walked before a stack is cut off and marked [truncated].
+	void setMaxDepth(size_t depth) { maxDepth = depth; }
+
+	/// Total time the target thread has spent suspended by sampleTarget,
+	/// in QueryPerformanceCounter ticks.
+	LONGLONG getStallTicks() const { return stallTicks; }
+
+	/// The stack of the latest sample, and when the thread was first sampled
+	/// in exactly that stack (QueryPerformanceCounter ticks). Empty until
+	/// the first sample.
+	const CallStack &getLastStack() const { return laststack; }
+	LONGLONG getLastStackSince() const { return laststackSince; }
+
 	//void saveIPs(std::ostream& stream);//write IP values to a stream
 
-	HANDLE getTarget(){ return target_thread; }
+	HANDLE getTarget() const { return target_thread; }
 private:
+	void addPlacement(CallStack &stack, SAMPLE_TYPE timeSpent, SymbolInfo *syminfo);
+
 	HANDLE target_process, target_thread;
+	std::map<CallStack, SAMPLE_TYPE> *placementcallstacks;
+	std::map<CallStack, SAMPLE_TYPE> *regioncallstacks;
+	std::map<CallStack, SAMPLE_TYPE> *tagcallstacks;
+	const volatile LONG *tagslot;
+	size_t maxDepth;
+	LONGLONG stallTicks;
+	CallStack laststack;
+	LONGLONG laststackSince;
+
+	// Module the last frame looked up was in; see SymbolInfo::getModuleForAddr.
+	Module *lastModule;
+
+	// Reused for every sample so the walk doesn't allocate once it has
+	// grown to the depth this thread needs.
+	CallStack scratch;
 };
 
 
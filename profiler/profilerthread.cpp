@@ -32,12 +32,18 @@ http://www.gnu.org/copyleft/gpl.html..
 #include "../utils/stringutils.h"
 #include <fstream>
 #include <assert.h>
+#include <math.h>
 #include <algorithm>
 #include <Psapi.h>
 #include "../appinfo.h"
 
 #pragma comment(lib, "winmm.lib")
 
+// Sampling interval without an overhead budget, and the slowest the rate
+// controller will go to stay within one.
+static const double BASE_INTERVAL_MS = 100;
+static const double MAX_INTERVAL_MS = 10000;
+
 // DE: 20090325: Profiler has a list of threads to profile
 // RM: 20130614: Profiler time can now be limited (-1 = until cancelled)
 ProfilerThread::ProfilerThread(HANDLE target_process_, const std::vector<HANDLE>& target_threads, SymbolInfo *sym_info_)
@@ -55,6 +61,42 @@ ProfilerThread::ProfilerThread(HANDLE target_process_, const std::vector<HANDLE>
 	failed = false;
 	paused = false;
 	cancelled = false;
+	captureType = CAPTURE_CPU;
+	shimEvents.resize(256);
+	recordPlacement = false;
+	maxDepth = DEFAULT_MAX_CALLSTACK_LEVELS;
+	sampleEvent = SAMPLE_TIME;
+	prevProcessFaults = 0;
+	haveEventBaseline = false;
+	totalEvents = 0;
+	threadsPerTick = 0;
+	rotationAlive = 0;
+	rotationVariance = 0;
+	cpuBudget = 0;
+	stallBudget = 0;
+	intervalMs = BASE_INTERVAL_MS;
+	burstIntervalMs = 0;
+	windowStart.QuadPart = 0;
+	windowSamplerCpu = windowTargetCpu = 0;
+	windowStall = 0;
+	topThreads = 0;
+	lastRanking.QuadPart = 0;
+	retiredStall = 0;
+	wakeLatencyTotal = wakeLatencyMax = 0;
+	wakeCount = 0;
+	burstRate = 0;
+	inRegion = false;
+	lastShimAttempt.QuadPart = 0;
+	regionSamples = 0;
+	regionTime = 0;
+	recordTags = false;
+	tagSlotCount = 0;
+	tagSlotsComplete = true;
+	tagSlotsVersion = tagSlotsAssigned = 0;
+	stuckThreshold = 0;
+	lastStuckCheck.QuadPart = 0;
+	backgroundSymbols = false;
+	symbolizer = NULL;
 	symbolsPermille = 0;
 	numThreadsRunning = (int)target_threads.size();
 	status = L"Initializing";
@@ -65,6 +107,37 @@ ProfilerThread::ProfilerThread(HANDLE target_process_, const std::vector<HANDLE>
 
 ProfilerThread::~ProfilerThread()
 {
+	delete symbolizer;
+
+	for (auto it = openedThreads.begin(); it != openedThreads.end(); ++it)
+		CloseHandle(it->second);
+}
+
+void ProfilerThread::setMaxDepth(size_t depth)
+{
+	maxDepth = depth;
+	for (auto it = profilers.begin(); it != profilers.end(); ++it)
+		it->setMaxDepth(depth);
+}
+
+void ProfilerThread::setOverheadBudget(double cpuPercent, double stallMicroseconds)
+{
+	cpuBudget = cpuPercent / 100;
+	stallBudget = stallMicroseconds;
+}
+
+void ProfilerThread::setRecordPlacement(bool record)
+{
+	recordPlacement = record;
+	for (auto it = profilers.begin(); it != profilers.end(); ++it)
+		it->setPlacementCallstacks(record ? &placementstacks : NULL);
+}
+
+void ProfilerThread::setRecordTags(bool record)
+{
+	recordTags = record;
+	for (auto it = profilers.begin(); it != profilers.end(); ++it)
+		it->setTagCallstacks(record ? &tagstacks : NULL, NULL);
 }
 
 
@@ -80,25 +153,69 @@ void ProfilerThread::sample(const SAMPLE_TYPE timeSpent)
 	if ( count == 0)
 		return;
 
+	if (sampleEvent != SAMPLE_TIME && !computeEventWeights())
+		return;
+
+	const bool rotating = threadsPerTick && count > threadsPerTick;
+	if (rotating && !chooseRotation())
+		return;
+
 	size_t *order = (size_t *)alloca( count * sizeof(size_t) );
-	for (size_t n=0;n<count;n++)
-		order[n] = n;
-	for (size_t n=count;n--;)
+	size_t active = count;
+	if (rotating)
+	{
+		active = rotationOrder.size();
+		std::copy(rotationOrder.begin(), rotationOrder.end(), order);
+	}
+	else
+	{
+		for (size_t n=0;n<count;n++)
+			order[n] = n;
+	}
+	for (size_t n=active;n--;)
 	{
-		size_t i = rand() * count / (RAND_MAX+1);
-		assert( i < count );
+		size_t i = rand() * active / (RAND_MAX+1);
+		assert( i < active );
 		std::swap( order[i], order[n] );
 	}
 
 	int numSuccessful = 0;
-	for (size_t n = 0;n < count; ++n)
+	for (size_t n = 0;n < active; ++n)
 	{
 		Profiler& profiler = profilers[order[n]];
+		SAMPLE_TYPE weight = timeSpent;
+		if (sampleEvent != SAMPLE_TIME)
+		{
+			// Negative means the thread has gone; zero that it had no events,
+			// which isn't worth suspending it for.
+			weight = eventWeights[order[n]];
+			if (weight < 0)
+				continue;
+			if (weight == 0)
+			{
+				++numSuccessful;
+				continue;
+			}
+		}
+
+		// Scale by the inverse of the chance this thread had of being
+		// picked, so the expected total is the same as sampling them all.
+		double p = rotating ? inclusion[order[n]] : 1;
+
 		try {
-			if (profiler.sampleTarget(timeSpent, sym_info))
+			if (profiler.sampleTarget(weight / p, sym_info))
 			{
 				++numsamplessofar;
 				++numSuccessful;
+				rotationVariance += (1 - p) / (p * p) * weight * weight;
+
+				if (symbolizer)
+				{
+					const CallStack &stack = profiler.getLastStack();
+					for (size_t f=0;f<stack.depth;f++)
+						if (seenAddresses.insert(stack.addr[f]).second)
+							newAddresses.push_back(stack.addr[f]);
+				}
 			}
 		}
 		catch (const ProfilerExcep& e)
@@ -108,7 +225,202 @@ void ProfilerThread::sample(const SAMPLE_TYPE timeSpent)
 		}
 	}
 
-	numThreadsRunning = numSuccessful;
+	// With top-N sampling, rerankThreads counts all of the target's threads.
+	if (!topThreads)
+		numThreadsRunning = rotating ? (int)rotationAlive : numSuccessful;
+}
+
+// Threads are always given at least this fraction of the mean CPU time
+// when picking them, so idle ones still turn up from time to time.
+static const double ROTATION_MIN_SHARE = 0.1;
+
+/// Picks the threads to sample this tick when there are more than
+/// threadsPerTick of them. Each thread is picked with probability
+/// proportional to the CPU time it used since the last tick, using
+/// systematic sampling over the threads sorted by that time, which
+/// stratifies busy and idle threads. Threads busy enough to be certain
+/// of a place are always sampled. Fills inclusion with each profiler's
+/// probability of being picked and rotationOrder with those picked.
+bool ProfilerThread::chooseRotation()
+{
+	// Software-event sampling has already taken this tick's snapshot.
+	if (sampleEvent == SAMPLE_TIME && !snapshot.take())
+		return false;
+
+	const ProcessCounters *proc = snapshot.findProcess(GetProcessId(target_process));
+	if (!proc)
+		return false;
+
+	if (threadIndex.empty())
+	{
+		for (size_t n=0;n<profilers.size();n++)
+			threadIndex[GetThreadId(profilers[n].getTarget())] = n;
+	}
+
+	// Start with the CPU time used as each thread's size.
+	inclusion.assign(profilers.size(), 0);
+	rotationOrder.clear();
+	double total = 0;
+	for (size_t t=0;t<proc->threads.size();t++)
+	{
+		const ThreadCounters &thread = proc->threads[t];
+		auto it = threadIndex.find(thread.id);
+		if (it == threadIndex.end())
+			continue;
+
+		// A thread seen for the first time has nothing to compare against,
+		// so it only gets the minimum share this tick.
+		ULONGLONG cpu = thread.kernelTime + thread.userTime;
+		auto prev = rotationCpu.find(thread.id);
+		inclusion[it->second] = prev == rotationCpu.end() ? 0 : (double)(cpu - prev->second);
+		rotationCpu[thread.id] = cpu;
+		rotationOrder.push_back(it->second);
+		total += inclusion[it->second];
+	}
+
+	rotationAlive = rotationOrder.size();
+	if (rotationAlive == 0)
+		return false;
+
+	double minSize = std::max(1.0, total / rotationAlive * ROTATION_MIN_SHARE);
+	total = 0;
+	for (size_t n=0;n<rotationAlive;n++)
+		total += inclusion[rotationOrder[n]] += minSize;
+
+	std::sort(rotationOrder.begin(), rotationOrder.end(),
+		[this](size_t a, size_t b) { return inclusion[a] > inclusion[b]; });
+
+	// Probabilities can't exceed one, so the busiest threads may be certain
+	// to be picked; the rest of the budget is shared by the others.
+	size_t budget = std::min(threadsPerTick, rotationAlive);
+	size_t certain = 0;
+	while (certain < rotationAlive && inclusion[rotationOrder[certain]] * (budget - certain) >= total)
+	{
+		total -= inclusion[rotationOrder[certain]];
+		inclusion[rotationOrder[certain]] = 1;
+		++certain;
+	}
+
+	size_t picked = certain;
+	double start = rand() / (RAND_MAX + 1.0);
+	double sum = 0;
+	for (size_t n=certain;n<rotationAlive;n++)
+	{
+		size_t i = rotationOrder[n];
+		double prev = sum;
+		inclusion[i] = inclusion[i] * (budget - certain) / total;
+		sum += inclusion[i];
+		if (floor(sum - start) > floor(prev - start))
+			rotationOrder[picked++] = i;
+	}
+
+	rotationOrder.resize(picked);
+	return true;
+}
+
+static const struct { SampleEvent event; const wchar_t *name; } sampleEventNames[] = {
+	{ SAMPLE_TIME,				L"time" },
+	{ SAMPLE_CONTEXT_SWITCHES,	L"context-switches" },
+	{ SAMPLE_PAGE_FAULTS,		L"page-faults" },
+	{ SAMPLE_HARD_FAULTS,		L"major-faults" },
+};
+
+bool ProfilerThread::parseSampleEvent(const std::wstring& name, SampleEvent *event, std::wstring *error)
+{
+	for (size_t n=0;n<_countof(sampleEventNames);n++)
+	{
+		if (name == sampleEventNames[n].name)
+		{
+			*event = sampleEventNames[n].event;
+			return true;
+		}
+	}
+
+	if (name == L"cpu-migrations")
+		*error = L"cpu-migrations can't be sampled: Windows doesn't report which processor a thread last ran on without an ETW session.";
+	else
+		*error = L"Unknown sample event '" + name + L"'. Use time, context-switches, page-faults or major-faults.";
+	return false;
+}
+
+const wchar_t *ProfilerThread::getSampleEventName(SampleEvent event)
+{
+	for (size_t n=0;n<_countof(sampleEventNames);n++)
+		if (sampleEventNames[n].event == event)
+			return sampleEventNames[n].name;
+	return L"?";
+}
+
+/// Fills eventWeights with the number of events each profiled thread had
+/// since the last call. Returns false if there's nothing to sample.
+/// Page faults are only counted per process, so they are shared out
+/// between threads in proportion to the CPU time each used meanwhile.
+bool ProfilerThread::computeEventWeights()
+{
+	if (!snapshot.take())
+		return false;
+
+	const ProcessCounters *proc = snapshot.findProcess(GetProcessId(target_process));
+	if (!proc)
+		return false;
+
+	ULONGLONG faults = sampleEvent == SAMPLE_HARD_FAULTS ? proc->hardFaultCount : proc->pageFaultCount;
+	ULONGLONG processFaults = faults - prevProcessFaults;
+	prevProcessFaults = faults;
+
+	eventWeights.assign(profilers.size(), -1);
+	ULONGLONG totalCpu = 0;
+	for (size_t n=0;n<profilers.size();n++)
+	{
+		const ThreadCounters *thread = proc->findThread(GetThreadId(profilers[n].getTarget()));
+		if (!thread)
+			continue;
+
+		ULONGLONG cpu = thread->kernelTime + thread->userTime;
+		ULONGLONG switches = thread->contextSwitches;
+
+		// A thread without a baseline yet (say, one top-N sampling only just
+		// picked) starts counting from now rather than from its creation.
+		auto found = prevThreadEvents.find(thread->id);
+		if (found == prevThreadEvents.end())
+		{
+			ThreadEvents baseline = { switches, cpu };
+			found = prevThreadEvents.insert(std::make_pair(thread->id, baseline)).first;
+		}
+		ThreadEvents &prev = found->second;
+
+		if (sampleEvent == SAMPLE_CONTEXT_SWITCHES)
+			eventWeights[n] = (SAMPLE_TYPE)(switches - prev.contextSwitches);
+		else
+		{
+			eventWeights[n] = (SAMPLE_TYPE)(cpu - prev.cpuTime);
+			totalCpu += cpu - prev.cpuTime;
+		}
+
+		prev.contextSwitches = switches;
+		prev.cpuTime = cpu;
+	}
+
+	if (sampleEvent != SAMPLE_CONTEXT_SWITCHES)
+	{
+		for (size_t n=0;n<eventWeights.size();n++)
+			if (eventWeights[n] > 0)
+				eventWeights[n] = totalCpu ? eventWeights[n] * processFaults / totalCpu : 0;
+	}
+
+	// The first snapshot only establishes the baseline.
+	if (!haveEventBaseline)
+	{
+		haveEventBaseline = true;
+		for (size_t n=0;n<eventWeights.size();n++)
+			if (eventWeights[n] > 0)
+				eventWeights[n] = 0;
+	}
+
+	for (size_t n=0;n<eventWeights.size();n++)
+		if (eventWeights[n] > 0)
+			totalEvents += eventWeights[n];
+	return true;
 }
 
 class ProcPred
@@ -155,10 +467,70 @@ void ProfilerThread::sampleLoop()
 			continue;
 		}
 
-		sample(t);
+		if (captureType != CAPTURE_CPU)
+			drainShim();
+		else
+		{
+			if (topThreads)
+				rerankThreads(now, freq, start);
+			if (burstRate > 0)
+				updateRegion(now, freq);
+			if (recordTags)
+				updateTags(now, freq);
+			if (backgroundSymbols && !symbolizer && now.QuadPart - start.QuadPart >= freq.QuadPart)
+				startSymbolizer();
+			sample(t);
+			if (symbolizer && !newAddresses.empty())
+			{
+				symbolizer->add(newAddresses);
+				newAddresses.clear();
+			}
+			if (stuckThreshold > 0)
+				checkStuck(now, freq, start);
+			if (cpuBudget > 0 || stallBudget > 0)
+				adjustRate(now, freq, start);
+		}
+
+		double waitMs = intervalMs;// / prefs.throttle;
+		if (inRegion)
+		{
+			regionSamples++;
+			regionTime += t;
+			waitMs = burstIntervalMs;
+		}
+
+		LARGE_INTEGER slept, woke;
+		double late;
+		QueryPerformanceCounter(&slept);
+		if (waitMs < 2)
+		{
+			// Sleep can't wake more than once a millisecond, so wait for the
+			// next burst sample by spinning, yielding to anything else that
+			// wants this processor.
+			LONGLONG deadline = now.QuadPart + (LONGLONG)((double)freq.QuadPart * waitMs / 1000);
+			do
+			{
+				SwitchToThread();
+				QueryPerformanceCounter(&woke);
+			}
+			while (woke.QuadPart < deadline);
+			late = (double)(woke.QuadPart - std::max(deadline, slept.QuadPart)) / (double)freq.QuadPart;
+		}
+		else
+		{
+			DWORD ms = (DWORD)waitMs;
+			Sleep(ms);
+			QueryPerformanceCounter(&woke);
+			late = (double)(woke.QuadPart - slept.QuadPart) / (double)freq.QuadPart - ms / 1000.0;
+		}
 
-		int ms = 100;// / prefs.throttle;
-		Sleep(ms);
+		// How long the scheduler took to run us again once the wait was up.
+		if (late > 0)
+		{
+			wakeLatencyTotal += late;
+			wakeLatencyMax = std::max(wakeLatencyMax, late);
+		}
+		wakeCount++;
 
 		prev = now;
 	}
@@ -166,6 +538,593 @@ void ProfilerThread::sampleLoop()
 	timeEndPeriod(1);
 }
 
+/// Starts the background symbolizer on the processors the sampler has
+/// been pinned to, if any, below the sampler's priority.
+void ProfilerThread::startSymbolizer()
+{
+	symbolizer = new BackgroundSymbolizer(sym_info);
+	HANDLE thread = symbolizer->start(THREAD_PRIORITY_LOWEST);
+
+	GROUP_AFFINITY affinity;
+	if (thread && GetThreadGroupAffinity(GetCurrentThread(), &affinity))
+		SetThreadGroupAffinity(thread, &affinity, NULL);
+}
+
+static ULONGLONG fileTimeToUint64(const FILETIME &ft)
+{
+	return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+/// Measures the profiler's overhead about once a second and scales the
+/// sampling interval to keep it within budget. Overhead is roughly
+/// proportional to the sampling rate, so an overshoot is corrected in one
+/// step; when well under budget the rate is raised gradually, but never
+/// above the base rate.
+void ProfilerThread::adjustRate(const LARGE_INTEGER &now, const LARGE_INTEGER &freq, const LARGE_INTEGER &start)
+{
+	FILETIME creation, exited, kernel, user;
+	ULONGLONG samplerCpu = 0, targetCpu = 0;
+	if (GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user))
+		samplerCpu = fileTimeToUint64(kernel) + fileTimeToUint64(user);
+	if (symbolizer)
+		samplerCpu += symbolizer->getCpuTime();
+	if (GetProcessTimes(target_process, &creation, &exited, &kernel, &user))
+		targetCpu = fileTimeToUint64(kernel) + fileTimeToUint64(user);
+
+	LONGLONG stall = retiredStall;
+	for (size_t n=0;n<profilers.size();n++)
+		stall += profilers[n].getStallTicks();
+
+	if (windowStart.QuadPart == 0)
+	{
+		windowStart = now;
+		windowSamplerCpu = samplerCpu;
+		windowTargetCpu = targetCpu;
+		windowStall = stall;
+		return;
+	}
+
+	double window = (double)(now.QuadPart - windowStart.QuadPart) / (double)freq.QuadPart;
+	if (window < 1.0)
+		return;
+
+	// An idle target makes any sampling too much, so count it as one tick
+	// of CPU time rather than dividing by zero.
+	double cpuOverhead = (double)(samplerCpu - windowSamplerCpu) / (double)std::max<ULONGLONG>(targetCpu - windowTargetCpu, 1);
+	double stallMicroseconds = (double)(stall - windowStall) / (double)freq.QuadPart * 1e6
+		/ (double)std::max<size_t>(profilers.size(), 1) / window;
+
+	windowStart = now;
+	windowSamplerCpu = samplerCpu;
+	windowTargetCpu = targetCpu;
+	windowStall = stall;
+
+	double ratio = 0;
+	if (cpuBudget > 0)
+		ratio = std::max(ratio, cpuOverhead / cpuBudget);
+	if (stallBudget > 0)
+		ratio = std::max(ratio, stallMicroseconds / stallBudget);
+
+	// Symbols can always be left for the end, so stop resolving them in
+	// the background before anything else while over budget.
+	if (symbolizer)
+		symbolizer->setPaused(ratio > 1);
+
+	double scale = 1;
+	if (ratio > 1)
+		scale = ratio * 1.25; // leave some headroom
+	else if (ratio < 0.5)
+		scale = std::max(ratio * 2, 0.5);
+	double interval = std::min(std::max(intervalMs * scale, BASE_INTERVAL_MS), MAX_INTERVAL_MS);
+
+	// Burst sampling inside marked regions is held to the same budget, but
+	// never runs faster than the burst rate asked for.
+	double burstInterval = burstIntervalMs;
+	if (burstRate > 0)
+		burstInterval = std::min(std::max(burstIntervalMs * scale, 1000 / burstRate), MAX_INTERVAL_MS);
+
+	if (fabs(interval - intervalMs) < 1 && fabs(burstInterval - burstIntervalMs) <= burstIntervalMs * 0.01)
+		return;
+
+	intervalMs = interval;
+	burstIntervalMs = burstInterval;
+	RateChange change;
+	change.time = (double)(now.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+	change.intervalMs = interval;
+	change.burstIntervalMs = burstInterval;
+	change.cpuOverhead = cpuOverhead;
+	change.stallMicroseconds = stallMicroseconds;
+	rateChanges.push_back(change);
+}
+
+/// Once a second, ranks the target's threads by the CPU time they used
+/// since the last ranking and swaps the profiled set to the top N.
+/// Ties go to threads already being profiled, so idle periods don't
+/// churn the set. Each swap is logged, since a stack's weight only
+/// covers the time its thread spent in the set.
+void ProfilerThread::rerankThreads(const LARGE_INTEGER &now, const LARGE_INTEGER &freq, const LARGE_INTEGER &start)
+{
+	if (lastRanking.QuadPart && now.QuadPart - lastRanking.QuadPart < freq.QuadPart)
+		return;
+	double window = lastRanking.QuadPart ? (double)(now.QuadPart - lastRanking.QuadPart) / (double)freq.QuadPart : 0;
+	lastRanking = now;
+
+	if (!snapshot.take())
+		return;
+	const ProcessCounters *proc = snapshot.findProcess(GetProcessId(target_process));
+	if (!proc)
+	{
+		numThreadsRunning = 0;
+		return;
+	}
+	numThreadsRunning = (int)proc->threads.size();
+
+	std::map<DWORD, size_t> current;
+	for (size_t n=0;n<profilers.size();n++)
+		current[GetThreadId(profilers[n].getTarget())] = n;
+
+	// A thread's first ranking has nothing to compare against, so it
+	// counts as idle until the next one.
+	struct Rank
+	{
+		ULONGLONG cpu;
+		bool current;
+		DWORD id;
+	};
+	std::vector<Rank> ranking;
+	ranking.reserve(proc->threads.size());
+	std::map<DWORD, ULONGLONG> seen;
+	for (size_t t=0;t<proc->threads.size();t++)
+	{
+		const ThreadCounters &thread = proc->threads[t];
+		ULONGLONG cpu = thread.kernelTime + thread.userTime;
+		auto prev = rankingCpu.find(thread.id);
+		Rank rank;
+		rank.cpu = prev == rankingCpu.end() ? 0 : cpu - prev->second;
+		rank.current = current.find(thread.id) != current.end();
+		rank.id = thread.id;
+		ranking.push_back(rank);
+		seen[thread.id] = cpu;
+	}
+	rankingCpu.swap(seen);
+
+	std::sort(ranking.begin(), ranking.end(), [](const Rank &a, const Rank &b) {
+		return a.cpu != b.cpu ? a.cpu > b.cpu : a.current > b.current;
+	});
+	ranking.resize(std::min(ranking.size(), topThreads));
+
+	double time = (double)(now.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+	std::map<DWORD, ULONGLONG> wanted;
+	for (size_t n=0;n<ranking.size();n++)
+		wanted[ranking[n].id] = ranking[n].cpu;
+
+	bool changed = false;
+	for (size_t n=profilers.size();n--;)
+	{
+		DWORD id = GetThreadId(profilers[n].getTarget());
+		if (wanted.find(id) != wanted.end())
+			continue;
+
+		ThreadChange change = { time, id, false, 0 };
+		auto used = rankingCpu.find(id);
+		auto prev = seen.find(id);
+		if (window > 0 && used != rankingCpu.end() && prev != seen.end())
+			change.cpu = (double)(used->second - prev->second) / 1e7 / window;
+		threadChanges.push_back(change);
+
+		retiredStall += profilers[n].getStallTicks();
+		prevThreadEvents.erase(id);
+		rotationCpu.erase(id);
+		auto opened = openedThreads.find(id);
+		if (opened != openedThreads.end())
+		{
+			CloseHandle(opened->second);
+			openedThreads.erase(opened);
+		}
+		profilers[n] = profilers.back();
+		profilers.pop_back();
+		changed = true;
+	}
+
+	for (size_t n=0;n<ranking.size();n++)
+	{
+		if (ranking[n].current)
+			continue;
+
+		HANDLE thread = OpenThread(THREAD_ALL_ACCESS, FALSE, ranking[n].id);
+		if (!thread)
+			continue;
+		openedThreads[ranking[n].id] = thread;
+
+		profilers.push_back(Profiler(target_process, thread, callstacks, flatcounts));
+		profilers.back().setMaxDepth(maxDepth);
+		profilers.back().setPlacementCallstacks(recordPlacement ? &placementstacks : NULL);
+		profilers.back().setRegionCallstacks(inRegion ? &regionstacks : NULL);
+		profilers.back().setTagCallstacks(recordTags ? &tagstacks : NULL, findTagSlot(thread));
+
+		// Count its events and CPU time from here on, not over its lifetime.
+		if (const ThreadCounters *counters = proc->findThread(ranking[n].id))
+		{
+			ThreadEvents baseline = { counters->contextSwitches, counters->kernelTime + counters->userTime };
+			prevThreadEvents[ranking[n].id] = baseline;
+			rotationCpu[ranking[n].id] = baseline.cpuTime;
+		}
+
+		ThreadChange change = { time, ranking[n].id, true, window > 0 ? ranking[n].cpu / 1e7 / window : 0 };
+		threadChanges.push_back(change);
+		changed = true;
+	}
+
+	// Thread rotation indexes the profilers, so have it rebuild the index.
+	// The baselines are kept by thread id, so surviving threads keep theirs.
+	if (changed)
+		threadIndex.clear();
+}
+
+/// The target creates the shim block on first use, so keep looking for
+/// it about once a second.
+void ProfilerThread::openShim(const LARGE_INTEGER &now, const LARGE_INTEGER &freq)
+{
+	if (!shim.isOpen() && (lastShimAttempt.QuadPart == 0 || now.QuadPart - lastShimAttempt.QuadPart >= freq.QuadPart))
+	{
+		lastShimAttempt = now;
+		shim.open(GetProcessId(target_process));
+	}
+}
+
+/// Follows the target's marked regions, switching the profilers to record
+/// into regionstacks while one is open.
+void ProfilerThread::updateRegion(const LARGE_INTEGER &now, const LARGE_INTEGER &freq)
+{
+	openShim(now, freq);
+
+	bool active = shim.inMarkedRegion();
+	if (active == inRegion)
+		return;
+
+	inRegion = active;
+	for (auto it = profilers.begin(); it != profilers.end(); ++it)
+		it->setRegionCallstacks(active ? &regionstacks : NULL);
+}
+
+/// Picks up the shim slots claimed by the target's threads since the last call.
+void ProfilerThread::updateThreadSlots(const LARGE_INTEGER &now, const LARGE_INTEGER &freq)
+{
+	openShim(now, freq);
+
+	LONG count = shim.getTagSlotCount();
+	if (count == tagSlotCount && tagSlotsComplete)
+		return;
+
+	tagSlotCount = count;
+	tagSlotsComplete = shim.getTagSlots(tagSlots);
+	tagSlotsVersion++;
+}
+
+/// Hands each profiler its thread's tag slot once the thread has claimed one.
+void ProfilerThread::updateTags(const LARGE_INTEGER &now, const LARGE_INTEGER &freq)
+{
+	updateThreadSlots(now, freq);
+	if (tagSlotsAssigned == tagSlotsVersion)
+		return;
+
+	tagSlotsAssigned = tagSlotsVersion;
+	for (auto it = profilers.begin(); it != profilers.end(); ++it)
+		it->setTagCallstacks(&tagstacks, findTagSlot(it->getTarget()));
+}
+
+const SleepyShimTagSlot *ProfilerThread::findThreadSlot(DWORD thread_id) const
+{
+	auto slot = tagSlots.find(thread_id);
+	return slot == tagSlots.end() ? NULL : slot->second;
+}
+
+const volatile LONG *ProfilerThread::findTagSlot(HANDLE thread) const
+{
+	const SleepyShimTagSlot *slot = findThreadSlot(GetThreadId(thread));
+	return slot ? &slot->tag : NULL;
+}
+
+/// Once a second, looks for threads that have sat in the same stack (which
+/// includes the system call they're in) without using any CPU time for
+/// longer than the threshold.
+void ProfilerThread::checkStuck(const LARGE_INTEGER &now, const LARGE_INTEGER &freq, const LARGE_INTEGER &start)
+{
+	if (lastStuckCheck.QuadPart != 0 && now.QuadPart - lastStuckCheck.QuadPart < freq.QuadPart)
+		return;
+	lastStuckCheck = now;
+
+	const ProcessCounters *proc = snapshot.take() ? snapshot.findProcess(GetProcessId(target_process)) : NULL;
+	if (!proc)
+		return;
+
+	// Where the shim is in, it can tell us what blocked threads wait on.
+	updateThreadSlots(now, freq);
+
+	for (size_t n=0;n<profilers.size();n++)
+	{
+		const Profiler &profiler = profilers[n];
+		DWORD id = GetThreadId(profiler.getTarget());
+		const ThreadCounters *thread = proc->findThread(id);
+		auto stuck = stuckThreads.find(id);
+		if (!thread || profiler.getLastStack().depth == 0)
+		{
+			if (stuck != stuckThreads.end())
+				stuck->second.current = false;
+			continue;
+		}
+
+		ULONGLONG cpu = thread->kernelTime + thread->userTime;
+		auto progress = threadProgress.find(id);
+		if (progress == threadProgress.end() || progress->second.cpu != cpu)
+		{
+			ThreadProgress moved = { cpu, now.QuadPart };
+			threadProgress[id] = moved;
+		}
+
+		LONGLONG since = std::max(threadProgress[id].since, profiler.getLastStackSince());
+		double seconds = (double)(now.QuadPart - since) / (double)freq.QuadPart;
+		if (seconds < stuckThreshold)
+		{
+			if (stuck != stuckThreads.end())
+				stuck->second.current = false;
+			continue;
+		}
+
+		// Keep the longest time each thread was stuck.
+		if (stuck != stuckThreads.end() && !stuck->second.current && stuck->second.seconds >= seconds)
+			continue;
+
+		StuckThread &entry = stuckThreads[id];
+		entry.stack = profiler.getLastStack();
+		entry.start = (double)(since - start.QuadPart) / (double)freq.QuadPart;
+		entry.seconds = seconds;
+		entry.current = true;
+
+		const SleepyShimTagSlot *slot = findThreadSlot(id);
+		entry.waitKind = slot ? slot->wait_kind : 0;
+		entry.waitKey = entry.waitKind ? slot->wait_key : 0;
+		entry.owner = getLockOwner(entry.waitKind, entry.waitKey);
+	}
+}
+
+/// The thread holding a lock, where the lock records it: only critical
+/// sections do (RTL_CRITICAL_SECTION::OwningThread). 0 if not known.
+DWORD ProfilerThread::getLockOwner(ULONG kind, ULONGLONG lock) const
+{
+	if (kind != SLEEPY_WAIT_CRITICAL_SECTION || !lock)
+		return 0;
+
+	// DebugInfo, LockCount, RecursionCount, then OwningThread.
+	ULONG ptrsize = shim.getPointerSize();
+	ULONGLONG owner = 0;
+	SIZE_T numRead = 0;
+	if (!ReadProcessMemory(target_process, (LPCVOID)(ULONG_PTR)(lock + ptrsize + 8), &owner, ptrsize, &numRead) || numRead != ptrsize)
+		return 0;
+	return (DWORD)owner;
+}
+
+static std::wstring ioFrameName(ULONG value)
+{
+	static const wchar_t *calls[] = {
+		L"?", L"ReadFile", L"WriteFile", L"FlushFileBuffers",
+		L"GetQueuedCompletionStatus", L"GetQueuedCompletionStatusEx",
+		L"recv", L"send", L"WSARecv", L"WSASend", L"select", L"WSAPoll",
+	};
+	static const wchar_t *types[] = {
+		L"unknown", L"disk", L"char", L"pipe", L"remote", L"socket", L"iocp",
+	};
+
+	ULONG call = value & 0xff, type = (value >> 8) & 0xff;
+	std::wstring name = call < _countof(calls) ? calls[call] : calls[0];
+	name += L" (";
+	name += type < _countof(types) ? types[type] : types[0];
+	name += L")";
+	return name;
+}
+
+void ProfilerThread::drainShim()
+{
+	// The shim is created lazily by the target on its first sampled
+	// allocation or wait, so keep trying until it shows up.
+	if (!shim.isOpen())
+	{
+		status = L"Waiting for sleepyshim";
+		if (!shim.open(GetProcessId(target_process)))
+		{
+			numThreadsRunning = (WaitForSingleObject(target_process, 0) == WAIT_OBJECT_0) ? 0 : 1;
+			return;
+		}
+		status = NULL;
+	}
+
+	size_t count;
+	while ((count = shim.read(&shimEvents[0], shimEvents.size())) != 0)
+	{
+		for (size_t n=0;n<count;n++)
+		{
+			const SleepyShimEvent &ev = shimEvents[n];
+			if (ev.kind == SLEEPY_EVENT_FREE && captureType == CAPTURE_ALLOCATIONS)
+			{
+				liveblocks.erase(ev.key);
+				continue;
+			}
+
+			bool wanted = (ev.kind == SLEEPY_EVENT_ALLOC && captureType == CAPTURE_ALLOCATIONS)
+					   || (ev.kind == SLEEPY_EVENT_WAIT  && captureType == CAPTURE_LOCKS)
+					   || (ev.kind == SLEEPY_EVENT_IO    && captureType == CAPTURE_IO);
+			if (!wanted || ev.depth == 0)
+				continue;
+
+			// I/O calls get a synthetic leaf frame naming the call and the
+			// kind of handle, so the time shows up under the call site.
+			CallStack stack;
+			if (ev.kind == SLEEPY_EVENT_IO)
+				stack.push(sym_info->getSyntheticAddr(L"[syscall]", ioFrameName((ULONG)ev.value)));
+
+			size_t depth = std::min<size_t>(ev.depth, SLEEPY_SHIM_MAX_FRAMES);
+			for (size_t d=0;d<depth;d++)
+				stack.push((PROFILER_ADDR)ev.frames[d]);
+
+			flatcounts[stack.addr[0]] += ev.weight;
+			callstacks[stack] += ev.weight;
+			eventcounts[stack] += ev.count;
+
+			if (ev.kind == SLEEPY_EVENT_ALLOC)
+			{
+				LiveBlock &block = liveblocks[ev.key];
+				block.stack = stack;
+				block.bytes = ev.weight;
+			}
+			else
+			{
+				PROFILER_ADDR lock = (PROFILER_ADDR)ev.key;
+				lockkinds[lock] = (ULONG)ev.value;
+				stack.push(lock);
+				lockstacks[stack] += ev.weight;
+			}
+
+			++numsamplessofar;
+		}
+	}
+
+	numThreadsRunning = (WaitForSingleObject(target_process, 0) == WAIT_OBJECT_0) ? 0 : 1;
+}
+
+static const wchar_t *lockKindName(ULONG kind)
+{
+	switch (kind)
+	{
+	case SLEEPY_WAIT_CRITICAL_SECTION:		return L"CRITICAL_SECTION";
+	case SLEEPY_WAIT_SRW_EXCLUSIVE:			return L"SRWLOCK (exclusive)";
+	case SLEEPY_WAIT_SRW_SHARED:			return L"SRWLOCK (shared)";
+	case SLEEPY_WAIT_CONDITION_VARIABLE:	return L"CONDITION_VARIABLE";
+	case SLEEPY_WAIT_ADDRESS:				return L"WaitOnAddress";
+	case SLEEPY_WAIT_OBJECT:				return L"HANDLE";
+	default:								return L"lock";
+	}
+}
+
+/// Writes the stuck thread report: each thread with the longest time it
+/// was stuck and its stack, then who waits for whom.
+void ProfilerThread::saveStuckThreads(wxTextOutputStream &txt)
+{
+	std::vector<std::pair<double, DWORD>> order;
+	for (auto i = stuckThreads.begin(); i != stuckThreads.end(); ++i)
+		order.push_back(std::make_pair(i->second.seconds, i->first));
+	std::sort(order.rbegin(), order.rend());
+
+	for (size_t n=0;n<order.size();n++)
+	{
+		const StuckThread &stuck = stuckThreads[order[n].second];
+		txt << "Thread " << (unsigned)order[n].second << ": stuck " << stuck.seconds << "s from "
+			<< stuck.start << "s" << (stuck.current ? " until the end of the capture" : "") << "\n";
+		if (stuck.waitKind)
+		{
+			txt << "\twaiting on " << lockKindName(stuck.waitKind) << " " << ::toHexString(stuck.waitKey).c_str();
+			if (stuck.owner)
+				txt << ", held by thread " << (unsigned)stuck.owner;
+			txt << "\n";
+		}
+		for (size_t f=0;f<stuck.stack.depth;f++)
+		{
+			ResolvedSymbol sym;
+			sym_info->getSymbol(stuck.stack.addr[f], sym);
+			txt << "\t" << sym.proc.c_str() << " (" << sym.module.c_str() << ")\n";
+		}
+		txt << "\n";
+	}
+
+	// Edges to the owning thread where the lock names one, and deadlocks
+	// where following those edges comes back round. Each thread is only
+	// stuck for part of the capture, so a cycle only counts as a deadlock
+	// if every thread in it was stuck at the same time.
+	bool header = false;
+	for (auto i = stuckThreads.begin(); i != stuckThreads.end(); ++i)
+	{
+		if (!i->second.owner)
+			continue;
+		if (!header)
+			txt << "Wait-for graph:\n";
+		header = true;
+		txt << "\t" << (unsigned)i->first << " -> " << (unsigned)i->second.owner << " ("
+			<< lockKindName(i->second.waitKind) << " " << ::toHexString(i->second.waitKey).c_str() << ")\n";
+	}
+	for (auto i = stuckThreads.begin(); i != stuckThreads.end(); ++i)
+	{
+		std::vector<DWORD> chain(1, i->first);
+		double from = i->second.start, to = i->second.start + i->second.seconds;
+		for (;;)
+		{
+			auto next = stuckThreads.find(chain.back());
+			if (next == stuckThreads.end() || !next->second.owner || chain.size() > stuckThreads.size())
+				break;
+			DWORD owner = next->second.owner;
+			auto held = stuckThreads.find(owner);
+			if (held == stuckThreads.end())
+				break;
+			from = std::max(from, held->second.start);
+			to = std::min(to, held->second.start + held->second.seconds);
+			if (from > to)
+				break;
+			if (std::find(chain.begin(), chain.end(), owner) != chain.end())
+			{
+				// Report each cycle once, from its lowest thread id.
+				if (owner == i->first && *std::min_element(chain.begin(), chain.end()) == i->first)
+				{
+					txt << "\tDeadlock:";
+					for (size_t n=0;n<chain.size();n++)
+						txt << " " << (unsigned)chain[n] << " ->";
+					txt << " " << (unsigned)owner << "\n";
+				}
+				break;
+			}
+			chain.push_back(owner);
+		}
+	}
+
+	// Locks that don't record an owner can still show threads piled up on
+	// the same address.
+	std::map<std::pair<ULONG, ULONGLONG>, std::vector<DWORD>> waiters;
+	for (auto i = stuckThreads.begin(); i != stuckThreads.end(); ++i)
+		if (i->second.waitKind && !i->second.owner)
+			waiters[std::make_pair(i->second.waitKind, i->second.waitKey)].push_back(i->first);
+	for (auto i = waiters.begin(); i != waiters.end(); ++i)
+	{
+		if (i->second.size() < 2)
+			continue;
+		if (!header)
+			txt << "Wait-for graph:\n";
+		header = true;
+		txt << "\t" << lockKindName(i->first.first) << " " << ::toHexString(i->first.second).c_str() << ": waited on by";
+		for (size_t n=0;n<i->second.size();n++)
+			txt << " " << (unsigned)i->second[n];
+		txt << "\n";
+	}
+}
+
+bool ProfilerThread::saveCallstacks(wxZipOutputStream &zip, wxTextOutputStream &txt, const wchar_t *name,
+									const std::map<CallStack, SAMPLE_TYPE> &stacks)
+{
+	beginProgress(std::wstring(L"Saving ") + name, stacks.size());
+	zip.PutNextEntry(name);
+
+	for (auto i = stacks.begin(); i != stacks.end(); ++i)
+	{
+		const CallStack &callstack = i->first;
+		SAMPLE_TYPE count = i->second;
+
+		txt << count;
+		for( size_t d=0;d<callstack.depth;d++ )
+			txt << " " << ::toHexString(callstack.addr[d]);
+		txt << "\n";
+
+		if (updateProgress())
+			return true;
+	}
+	return false;
+}
+
 void ProfilerThread::saveData()
 {
 	//get process id of the process the target thread is running in
@@ -194,6 +1153,30 @@ void ProfilerThread::saveData()
 		wxRemoveFile(minidump);
 	}
 
+	// Tag stacks carry the raw tag id as their root frame; swap in a
+	// synthetic frame named after the tag.
+	std::map<CallStack, SAMPLE_TYPE> namedtagstacks;
+	std::map<PROFILER_ADDR, PROFILER_ADDR> tagframes;
+	SAMPLE_TYPE untagged = 0;
+	for (auto i = tagstacks.begin(); i != tagstacks.end(); ++i)
+	{
+		CallStack stack = i->first;
+		PROFILER_ADDR &root = stack.addr[stack.depth-1];
+		auto frame = tagframes.find(root);
+		if (frame == tagframes.end())
+		{
+			LONG tag = (LONG)root;
+			std::wstring name = tag ? shim.getTagName(tag) : L"(untagged)";
+			if (name.empty())
+				name = L"#" + ::toString((int)tag);
+			frame = tagframes.insert(std::make_pair(root, sym_info->getSyntheticAddr(L"[tag]", name))).first;
+		}
+		if (root == 0)
+			untagged += i->second;
+		root = frame->second;
+		namedtagstacks[stack] += i->second;
+	}
+
 	//------------------------------------------------------------------------
 	beginProgress(L"Saving stats", 100);
 	zip.PutNextEntry(_T("Stats.txt"));
@@ -206,6 +1189,128 @@ void ProfilerThread::saveData()
 	txt << "Duration: " << duration << "\n";
 	txt << "Date: " << asctime(localtime(&rawtime));
 	txt << "Samples: " << numsamplessofar << "\n";
+	if (captureType == CAPTURE_ALLOCATIONS)
+	{
+		txt << "Sample type: allocations\n";
+		txt << "Units: bytes\n";
+		txt << "Sample period: " << (unsigned long long)shim.getSamplePeriod() << " bytes\n";
+		txt << "Dropped events: " << shim.getDropped() << "\n";
+	}
+	else if (captureType == CAPTURE_IO)
+	{
+		txt << "Sample type: io\n";
+		txt << "Units: seconds\n";
+		txt << "Dropped events: " << shim.getDropped() << "\n";
+	}
+	else if (captureType == CAPTURE_LOCKS)
+	{
+		txt << "Sample type: locks\n";
+		txt << "Units: seconds\n";
+		txt << "Locks: " << (unsigned)lockkinds.size() << "\n";
+		txt << "Dropped events: " << shim.getDropped() << "\n";
+	}
+	else if (sampleEvent != SAMPLE_TIME)
+	{
+		txt << "Sample type: cpu\n";
+		txt << "Sample event: " << getSampleEventName(sampleEvent) << "\n";
+		txt << "Units: " << getSampleEventName(sampleEvent) << "\n";
+		txt << "Total events: " << totalEvents << "\n";
+	}
+	else
+	{
+		txt << "Sample type: cpu\n";
+		txt << "Units: seconds\n";
+	}
+	if (recordPlacement)
+		txt << "Placement: ideal processor\n";
+	if (captureType == CAPTURE_CPU)
+	{
+		PROFILER_ADDR truncatedAddr = sym_info->getSyntheticAddr(L"[truncated]", L"[truncated]");
+		SAMPLE_TYPE truncated = 0;
+		for (auto i = callstacks.begin(); i != callstacks.end(); ++i)
+			if (i->first.addr[i->first.depth-1] == truncatedAddr)
+				truncated += i->second;
+		txt << "Max stack depth: " << (unsigned)maxDepth << "\n";
+		txt << "Truncated samples: " << truncated << "\n";
+	}
+	if (captureType == CAPTURE_CPU && threadsPerTick && profilers.size() > threadsPerTick)
+	{
+		// Variance of the estimated total (in squared units) added by only
+		// sampling some threads each tick.
+		txt << "Threads per tick: " << (unsigned)threadsPerTick << "\n";
+		txt << "Rotation variance: " << rotationVariance << "\n";
+		txt << "Rotation std. error: " << sqrt(rotationVariance) << "\n";
+	}
+	if (captureType == CAPTURE_CPU && topThreads)
+	{
+		txt << "Attach mode: top " << (unsigned)topThreads << " threads\n";
+		txt << "Thread changes: " << (unsigned)threadChanges.size() << "\n";
+	}
+	if (captureType == CAPTURE_CPU && burstRate > 0)
+	{
+		txt << "Burst rate: " << burstRate << " Hz\n";
+		txt << "Marked region samples: " << regionSamples << "\n";
+		txt << "Marked region time: " << regionTime << "\n";
+	}
+	if (captureType == CAPTURE_CPU && stuckThreshold > 0)
+	{
+		txt << "Stuck threshold: " << stuckThreshold << "s\n";
+		txt << "Stuck threads: " << (unsigned)stuckThreads.size() << "\n";
+	}
+	if (symbolizer)
+		txt << "Background symbols: " << (unsigned)symbolizer->getResolved().size() << "\n";
+	if (sym_info->isAddressOnly())
+		txt << "Symbols: deferred\n";
+	if (captureType == CAPTURE_CPU && recordTags)
+	{
+		txt << "Tags: " << (unsigned)(tagframes.size() - tagframes.count(0)) << "\n";
+		txt << "Untagged samples: " << untagged << "\n";
+	}
+	if (wakeCount > 0)
+	{
+		txt << "Wake latency: " << wakeLatencyTotal / wakeCount * 1e6 << "us mean, "
+			<< wakeLatencyMax * 1e6 << "us max\n";
+	}
+	if (captureType == CAPTURE_CPU && (cpuBudget > 0 || stallBudget > 0))
+	{
+		if (cpuBudget > 0)
+			txt << "Overhead budget: " << cpuBudget * 100 << "% CPU\n";
+		if (stallBudget > 0)
+			txt << "Stall budget: " << stallBudget << "us per thread per second\n";
+		txt << "Sample interval: " << intervalMs << "ms\n";
+		if (burstRate > 0)
+			txt << "Burst interval: " << burstIntervalMs << "ms\n";
+		txt << "Rate changes: " << (unsigned)rateChanges.size() << "\n";
+	}
+
+	if (captureType == CAPTURE_CPU && topThreads)
+	{
+		// time +/-thread_id cpus, one line per thread swapped in or out
+		zip.PutNextEntry(_T("ThreadChanges.txt"));
+		for (size_t n=0;n<threadChanges.size();n++)
+		{
+			const ThreadChange &change = threadChanges[n];
+			txt << change.time << " " << (change.added ? "+" : "-") << (unsigned)change.threadId
+				<< " " << change.cpu << "\n";
+		}
+	}
+	if (captureType == CAPTURE_CPU && (cpuBudget > 0 || stallBudget > 0))
+	{
+		// time interval_ms cpu_overhead stall_us burst_interval_ms, one line per change
+		zip.PutNextEntry(_T("RateChanges.txt"));
+		for (size_t n=0;n<rateChanges.size();n++)
+		{
+			const RateChange &change = rateChanges[n];
+			txt << change.time << " " << change.intervalMs << " "
+				<< change.cpuOverhead << " " << change.stallMicroseconds << " "
+				<< change.burstIntervalMs << "\n";
+		}
+	}
+	if (captureType == CAPTURE_CPU && stuckThreshold > 0 && !stuckThreads.empty())
+	{
+		zip.PutNextEntry(_T("StuckThreads.txt"));
+		saveStuckThreads(txt);
+	}
 
 	//------------------------------------------------------------------------
 	beginProgress(L"Summarizing results");
@@ -229,30 +1334,97 @@ void ProfilerThread::saveData()
 		}
 	}
 
+	// Every event count stack is also in callstacks, and every live
+	// block's stack in eventcounts, so there are no new addresses to add.
+	// Lock stacks only add the lock addresses, which get symbols of their own.
+	// Placement stacks add their two outermost (synthetic) frames.
+	for (auto i = placementstacks.begin(); i != placementstacks.end(); ++i)
+	{
+		const CallStack &callstack = i->first;
+		for (size_t n=callstack.depth-2;n<callstack.depth;n++)
+			used_addresses[callstack.addr[n]] = true;
+	}
+
+	// Region stacks add their (synthetic) root frame.
+	for (auto i = regionstacks.begin(); i != regionstacks.end(); ++i)
+		used_addresses[i->first.addr[i->first.depth-1]] = true;
+
+	// And tag stacks their tag.
+	for (auto i = tagframes.begin(); i != tagframes.end(); ++i)
+		used_addresses[i->second] = true;
+
+	std::map<CallStack, SAMPLE_TYPE> livestacks;
+	for (auto i = liveblocks.begin(); i != liveblocks.end(); ++i)
+		livestacks[i->second.stack] += i->second.bytes;
+
 	//------------------------------------------------------------------------
-	beginProgress(L"Querying and saving symbols", used_addresses.size());
+	// Only what the background symbolizer didn't get to is left to query.
+	static const std::map<PROFILER_ADDR, ResolvedSymbol> noneResolved;
+	const std::map<PROFILER_ADDR, ResolvedSymbol> &resolved = symbolizer ? symbolizer->getResolved() : noneResolved;
+
+	std::vector<PROFILER_ADDR> addrs;
+	for (auto i = used_addresses.begin(); i != used_addresses.end(); ++i)
+		if (resolved.find(i->first) == resolved.end())
+			addrs.push_back(i->first);
+
+	beginProgress(L"Querying and saving symbols", addrs.size());
+
+	std::vector<ResolvedSymbol> syms;
+	if (!sym_info->getSymbols(addrs, syms, symbolsProgress, this))
+		return;
+
+	// base size identity "name" "path", one line per module. Goes before
+	// Symbols.txt, so whatever it left unresolved can be looked up as
+	// that is read.
+	zip.PutNextEntry(_T("Modules.txt"));
+	std::vector<ModuleRecord> modules;
+	sym_info->getModuleRecords(modules);
+	for (size_t n=0;n<modules.size();n++)
+	{
+		const ModuleRecord &mod = modules[n];
+		txt << ::toHexString(mod.base) << " " << ::toHexString(mod.size) << " "
+			<< (mod.identity.empty() ? L"-" : mod.identity.c_str()) << " ";
+		writeQuote(txt, mod.name);
+		txt << " ";
+		writeQuote(txt, mod.path);
+		txt << '\n';
+	}
+
 	zip.PutNextEntry(_T("Symbols.txt"));
 
+	size_t queried = 0;
 	for (auto i = used_addresses.begin(); i != used_addresses.end(); ++i)
 	{
-		int proclinenum;
-		std::wstring procfile;
 		PROFILER_ADDR addr = i->first;
+		auto r = resolved.find(addr);
+		const ResolvedSymbol &sym = r != resolved.end() ? r->second : syms[queried++];
 
-		const std::wstring proc_name = sym_info->getProcForAddr(addr, procfile, proclinenum);
 		txt << ::toHexString(addr);
 		txt << " ";
-		writeQuote(txt, sym_info->getModuleNameForAddr(addr));
+		writeQuote(txt, sym.module);
 		txt << " ";
-		writeQuote(txt, proc_name);
+		writeQuote(txt, sym.proc);
 		txt << " ";
-		writeQuote(txt, procfile);
+		writeQuote(txt, sym.file);
 		txt << " ";
-		txt << ::toString(proclinenum);
+		txt << ::toString(sym.line);
 		txt << '\n';
+	}
 
-		if (updateProgress())
-			return;
+	for (auto i = lockkinds.begin(); i != lockkinds.end(); ++i)
+	{
+		// A lock can't share an address with code, but be careful anyway.
+		if (used_addresses.find(i->first) != used_addresses.end())
+			continue;
+
+		txt << ::toHexString(i->first);
+		txt << " ";
+		writeQuote(txt, L"[locks]");
+		txt << " ";
+		writeQuote(txt, std::wstring(lockKindName(i->second)) + L" " + ::toHexString(i->first));
+		txt << " ";
+		writeQuote(txt, L"");
+		txt << " 0\n";
 	}
 
 	//------------------------------------------------------------------------
@@ -273,20 +1445,44 @@ void ProfilerThread::saveData()
 	}
 
 	//------------------------------------------------------------------------
-	beginProgress(L"Saving callstacks", callstacks.size());
-	zip.PutNextEntry(_T("Callstacks.txt"));
+	if (saveCallstacks(zip, txt, L"Callstacks.txt", callstacks))
+		return;
 
-	for (auto i = callstacks.begin(); i != callstacks.end(); ++i)
+	if (captureType == CAPTURE_ALLOCATIONS)
 	{
-		const CallStack &callstack = i->first;
-		SAMPLE_TYPE count = i->second;
+		if (saveCallstacks(zip, txt, L"AllocCallstacks.txt", eventcounts))
+			return;
+		if (saveCallstacks(zip, txt, L"LiveCallstacks.txt", livestacks))
+			return;
+	}
+	else if (captureType == CAPTURE_IO)
+	{
+		if (saveCallstacks(zip, txt, L"WaitCallstacks.txt", eventcounts))
+			return;
+	}
+	else if (captureType == CAPTURE_LOCKS)
+	{
+		if (saveCallstacks(zip, txt, L"WaitCallstacks.txt", eventcounts))
+			return;
+		if (saveCallstacks(zip, txt, L"LockCallstacks.txt", lockstacks))
+			return;
+	}
 
-		txt << count;
-		for( size_t d=0;d<callstack.depth;d++ )
-			txt << " " << ::toHexString(callstack.addr[d]);
-		txt << "\n";
+	if (recordPlacement)
+	{
+		if (saveCallstacks(zip, txt, L"PlacementCallstacks.txt", placementstacks))
+			return;
+	}
 
-		if (updateProgress())
+	if (burstRate > 0)
+	{
+		if (saveCallstacks(zip, txt, L"RegionCallstacks.txt", regionstacks))
+			return;
+	}
+
+	if (recordTags)
+	{
+		if (saveCallstacks(zip, txt, L"TaggedCallstacks.txt", namedtagstacks))
 			return;
 	}
 
@@ -331,6 +1527,9 @@ void ProfilerThread::run()
 
 	status = L"Exiting";
 
+	if (symbolizer)
+		symbolizer->stop();
+
 	if (cancelled)
 		return;
 
@@ -362,6 +1561,14 @@ void ProfilerThread::beginProgress(std::wstring stage, int total)
 	symbolsPermille = 0;
 }
 
+// getSymbols reports how far it's got rather than each address.
+bool ProfilerThread::symbolsProgress(void *context, size_t done)
+{
+	ProfilerThread *thread = (ProfilerThread *)context;
+	thread->symbolsDone = (int)done - 1;
+	return thread->updateProgress();
+}
+
 bool ProfilerThread::updateProgress()
 {
 	symbolsDone++;
@@ -30,9 +30,35 @@ http://www.gnu.org/copyleft/gpl.html..
 #include "../utils/mythread.h"
 #include "profiler.h"
 #include "symbolinfo.h"
+#include "shimreader.h"
+#include "systemsnapshot.h"
+#include "backgroundsymbolizer.h"
 
 // DE: 20090325 Profiler thread now has a vector of threads to profile
 #include <vector>
+#include <unordered_set>
+
+class wxZipOutputStream;
+class wxTextOutputStream;
+
+enum CaptureType
+{
+	CAPTURE_CPU,			// default: timer-based sampling of thread stacks
+	CAPTURE_ALLOCATIONS,	// sampled heap allocations reported by sleepyshim.h
+	CAPTURE_LOCKS,			// blocking lock waits reported by sleepyshim.h
+	CAPTURE_IO,				// blocking file/socket calls reported by sleepyshim.h
+};
+
+/// What a CPU capture's samples are weighted by. For the software events,
+/// each thread's stack is weighted by the number of events it had since
+/// the previous sample, and threads without any are not sampled at all.
+enum SampleEvent
+{
+	SAMPLE_TIME,				// seconds (default)
+	SAMPLE_CONTEXT_SWITCHES,	// per-thread context switch count
+	SAMPLE_PAGE_FAULTS,			// process page faults, split by thread CPU time
+	SAMPLE_HARD_FAULTS,			// process hard (major) faults, split by thread CPU time
+};
 
 /*=====================================================================
 ProfilerThread
@@ -74,23 +100,222 @@ public:
 	void setPaused(bool paused_) { paused = paused_; }
 	void cancel() { cancelled = true; }
 
+	/// Must be called before launch().
+	void setCaptureType(CaptureType type) { captureType = type; }
+	void setSampleEvent(SampleEvent event) { sampleEvent = event; }
+	/// Also record which processor and NUMA node each CPU sample ran on.
+	void setRecordPlacement(bool record);
+	/// Frames walked before a CPU sample is cut off and marked [truncated].
+	void setMaxDepth(size_t depth);
+	/// Most threads suspended per CPU sample (0 = all of them). Above this,
+	/// each sample takes a CPU-weighted subset; see chooseRotation().
+	void setThreadsPerTick(size_t threads) { threadsPerTick = threads; }
+	/// Caps the profiler's overhead on a CPU capture by slowing sampling
+	/// down when either budget is exceeded (0 = no limit): the sampler's
+	/// CPU time as a percentage of the target's, and the time each thread
+	/// is kept suspended, in microseconds per second.
+	void setOverheadBudget(double cpuPercent, double stallMicroseconds);
+	/// Samples only the N threads that used the most CPU time over the last
+	/// second (0 = the threads given to the constructor). The ranking is
+	/// redone every second and threads swapped in and out as load shifts.
+	void setTopThreads(size_t count) { topThreads = count; }
+	/// Samples per second while the target has a region marked with
+	/// sleepy_shim_region_begin/end open (0 = ignore marked regions).
+	/// An overhead budget slows burst sampling down too.
+	void setBurstRate(double hz) { burstRate = hz; burstIntervalMs = hz > 0 ? 1000 / hz : 0; }
+	/// Also record the tag each CPU sample's thread had set with
+	/// sleepy_shim_set_tag (see sleepyshim.h).
+	void setRecordTags(bool record);
+	/// Reports threads that sit in the same stack without using any CPU
+	/// time for at least this many seconds (0 = don't look for them).
+	void setStuckThreshold(double seconds) { stuckThreshold = seconds; }
+	/// Resolves symbols on a low-priority thread while a CPU capture runs,
+	/// so there's little left to do when it stops. The thread shares the
+	/// sampler's processors and counts against its overhead budget.
+	void setBackgroundSymbols(bool enable) { backgroundSymbols = enable; }
+
+	/// Parses an event name as used on the command line and in Stats.txt.
+	/// Returns false (with a reason) for unknown or unsupported events.
+	static bool parseSampleEvent(const std::wstring& name, SampleEvent *event, std::wstring *error);
+	static const wchar_t *getSampleEventName(SampleEvent event);
+
 	void sample(const SAMPLE_TYPE timeSpent);//for internal use.
 private:
 	//std::wstring demangleProcName(const std::wstring& mangled_name);
 	void error(const std::wstring& what);
 
 	void sampleLoop();
+	bool computeEventWeights();
+	bool chooseRotation();
+	void startSymbolizer();
+	void adjustRate(const LARGE_INTEGER &now, const LARGE_INTEGER &freq, const LARGE_INTEGER &start);
+	void rerankThreads(const LARGE_INTEGER &now, const LARGE_INTEGER &freq, const LARGE_INTEGER &start);
+	void updateRegion(const LARGE_INTEGER &now, const LARGE_INTEGER &freq);
+	void updateTags(const LARGE_INTEGER &now, const LARGE_INTEGER &freq);
+	void updateThreadSlots(const LARGE_INTEGER &now, const LARGE_INTEGER &freq);
+	const SleepyShimTagSlot *findThreadSlot(DWORD thread_id) const;
+	const volatile LONG *findTagSlot(HANDLE thread) const;
+	void checkStuck(const LARGE_INTEGER &now, const LARGE_INTEGER &freq, const LARGE_INTEGER &start);
+	DWORD getLockOwner(ULONG kind, ULONGLONG lock) const;
+	void saveStuckThreads(wxTextOutputStream &txt);
+	void openShim(const LARGE_INTEGER &now, const LARGE_INTEGER &freq);
+	void drainShim();
 	void saveData();
+	bool saveCallstacks(wxZipOutputStream &zip, wxTextOutputStream &txt, const wchar_t *name,
+		const std::map<CallStack, SAMPLE_TYPE> &stacks);
 
 	std::wstring symbolsStage;
 	int symbolsPermille, symbolsDone, symbolsTotal;
 	void beginProgress(std::wstring stage, int total=0);
 	bool updateProgress();
+	static bool symbolsProgress(void *context, size_t done);
 
 	// DE: 20090325 callstacks and flatcounts are shared for all threads to profile
 	std::map<CallStack, SAMPLE_TYPE> callstacks;
 	std::map<PROFILER_ADDR, SAMPLE_TYPE> flatcounts;
 
+	// Shim captures: callstacks holds sampled bytes or seconds blocked, and
+	// eventcounts the number of allocations, waits or I/O calls.
+	std::map<CallStack, SAMPLE_TYPE> eventcounts;
+
+	// Allocation captures: the sampled blocks not yet freed.
+	struct LiveBlock
+	{
+		CallStack stack;
+		SAMPLE_TYPE bytes;
+	};
+	std::map<ULONGLONG, LiveBlock> liveblocks;
+
+	// Lock captures: seconds blocked per stack with the lock address appended
+	// as the outermost frame, and the kind of each lock (SleepyShimWaitKind).
+	std::map<CallStack, SAMPLE_TYPE> lockstacks;
+	std::map<PROFILER_ADDR, ULONG> lockkinds;
+
+	// CPU captures with placement: callstacks with processor and NUMA node
+	// appended as outermost frames (see Profiler::setPlacementCallstacks).
+	std::map<CallStack, SAMPLE_TYPE> placementstacks;
+	bool recordPlacement;
+	size_t maxDepth;
+	ShimReader shim;
+	std::vector<SleepyShimEvent> shimEvents;	// read buffer for drainShim
+	CaptureType captureType;
+
+	// Software-event sampling: the event counters seen at the previous
+	// sample, and the weight of each profiler for the current one.
+	SampleEvent sampleEvent;
+	SystemSnapshot snapshot;
+	struct ThreadEvents
+	{
+		ULONGLONG contextSwitches;
+		ULONGLONG cpuTime;
+	};
+	std::map<DWORD, ThreadEvents> prevThreadEvents;
+	ULONGLONG prevProcessFaults;
+	bool haveEventBaseline;
+	std::vector<SAMPLE_TYPE> eventWeights;
+	double totalEvents;
+
+	// Thread rotation: the CPU time each thread had used at the previous
+	// sample, each profiler's chance of being picked for the current one
+	// (zero if it wasn't), and the profilers picked.
+	size_t threadsPerTick;
+	std::map<DWORD, size_t> threadIndex;
+	std::map<DWORD, ULONGLONG> rotationCpu;
+	std::vector<double> inclusion;
+	std::vector<size_t> rotationOrder;
+	size_t rotationAlive;
+	double rotationVariance;
+
+	// Rate control: the budgets, the current sampling intervals, and the
+	// counters at the start of the current measurement window.
+	double cpuBudget;			// fraction of the target's CPU time
+	double stallBudget;			// microseconds per thread per second
+	double intervalMs;
+	double burstIntervalMs;		// inside marked regions
+	LARGE_INTEGER windowStart;
+	ULONGLONG windowSamplerCpu, windowTargetCpu;
+	LONGLONG windowStall;
+	struct RateChange
+	{
+		double time;			// seconds into the capture
+		double intervalMs;
+		double burstIntervalMs;
+		double cpuOverhead;		// fraction of the target's CPU time
+		double stallMicroseconds;	// per thread per second
+	};
+	std::vector<RateChange> rateChanges;
+
+	// Top-N sampling: the CPU time each of the target's threads had used at
+	// the last ranking, the thread handles opened here (the constructor's
+	// belong to the caller), and every thread swapped in or out.
+	size_t topThreads;
+	LARGE_INTEGER lastRanking;
+	std::map<DWORD, ULONGLONG> rankingCpu;
+	std::map<DWORD, HANDLE> openedThreads;
+	LONGLONG retiredStall;		// stall time of profilers since removed
+	struct ThreadChange
+	{
+		double time;			// seconds into the capture
+		DWORD threadId;
+		bool added;
+		double cpu;				// CPUs' worth of time used over the last ranking
+	};
+	std::vector<ThreadChange> threadChanges;
+
+	// Marked regions: samples taken while one was open, with a
+	// '[marked region]' root frame (see Profiler::setRegionCallstacks).
+	std::map<CallStack, SAMPLE_TYPE> regionstacks;
+	double burstRate;
+	bool inRegion;
+	LARGE_INTEGER lastShimAttempt;
+	int regionSamples;
+	double regionTime;
+
+	// Tags: samples with the thread's tag id appended as the outermost
+	// frame (see Profiler::setTagCallstacks), and the shim slot of each
+	// thread that has claimed one so far.
+	std::map<CallStack, SAMPLE_TYPE> tagstacks;
+	bool recordTags;
+	std::map<DWORD, const SleepyShimTagSlot *> tagSlots;
+	LONG tagSlotCount;
+	bool tagSlotsComplete;
+	int tagSlotsVersion, tagSlotsAssigned;
+
+	// Stuck threads: when each thread's CPU time last moved, and the
+	// longest time each thread spent stuck, with what it was waiting on
+	// if the shim could tell.
+	double stuckThreshold;
+	LARGE_INTEGER lastStuckCheck;
+	struct ThreadProgress
+	{
+		ULONGLONG cpu;
+		LONGLONG since;			// QueryPerformanceCounter ticks
+	};
+	std::map<DWORD, ThreadProgress> threadProgress;
+	struct StuckThread
+	{
+		CallStack stack;
+		double start;			// seconds into the capture
+		double seconds;
+		bool current;			// still stuck at the last check
+		ULONG waitKind;			// SleepyShimWaitKind, 0 if not known
+		ULONGLONG waitKey;
+		DWORD owner;			// thread holding the lock, 0 if not known
+	};
+	std::map<DWORD, StuckThread> stuckThreads;
+
+	// Background symbols: every address seen so far, those seen since they
+	// were last handed to the symbolizer, and the symbolizer itself, which
+	// is started a second in so it can copy the sampler's pinning.
+	bool backgroundSymbols;
+	std::unordered_set<PROFILER_ADDR> seenAddresses;
+	std::vector<PROFILER_ADDR> newAddresses;
+	BackgroundSymbolizer *symbolizer;
+
+	// How late the sampling loop wakes from each Sleep, in seconds.
+	double wakeLatencyTotal, wakeLatencyMax;
+	int wakeCount;
+
 	// DE: 20090325 one Profiler instance per thread to profile
 	std::vector<Profiler> profilers;
 	double duration;
@@ -0,0 +1,140 @@
+/*=====================================================================
+shimreader.cpp
+--------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#include "shimreader.h"
+
+#include <stdio.h>
+#include <string.h>
+
+ShimReader::ShimReader()
+:	mapping(NULL),
+	header(NULL)
+{
+}
+
+ShimReader::~ShimReader()
+{
+	close();
+}
+
+bool ShimReader::open(DWORD process_id)
+{
+	if (header)
+		return true;
+
+	wchar_t name[64];
+	swprintf(name, 64, SLEEPY_SHIM_MAPPING_PREFIX L"%lu", process_id);
+
+	mapping = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if (!mapping)
+		return false;
+
+	header = (SleepyShimHeader *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SleepyShimHeader));
+	if (!header || header->magic != SLEEPY_SHIM_MAGIC || header->version != SLEEPY_SHIM_VERSION ||
+		header->ring_size != SLEEPY_SHIM_RING_SIZE)
+	{
+		// Either still initializing, or built from an incompatible header.
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void ShimReader::close()
+{
+	if (header)
+		UnmapViewOfFile(header);
+	if (mapping)
+		CloseHandle(mapping);
+	header = NULL;
+	mapping = NULL;
+}
+
+size_t ShimReader::read(SleepyShimEvent *out, size_t max_events)
+{
+	if (!header)
+		return 0;
+
+	// We are the only consumer, so read_pos needs no interlocking.
+	size_t count = 0;
+	LONG pos = header->read_pos;
+	while (count < max_events)
+	{
+		SleepyShimEvent *ev = &header->ring[pos & (SLEEPY_SHIM_RING_SIZE-1)];
+		if (ev->sequence != pos+1)
+			break;
+
+		MemoryBarrier();
+		memcpy(&out[count], ev, sizeof(SleepyShimEvent));
+		if (out[count].depth > SLEEPY_SHIM_MAX_FRAMES)
+			out[count].depth = SLEEPY_SHIM_MAX_FRAMES;
+		MemoryBarrier();
+
+		// Hand the slot back to the producers for the next lap.
+		ev->sequence = pos + SLEEPY_SHIM_RING_SIZE;
+		pos++;
+		count++;
+	}
+	header->read_pos = pos;
+	return count;
+}
+
+LONG ShimReader::getTagSlotCount() const
+{
+	if (!header)
+		return 0;
+
+	// Threads that found the table full still bumped the count.
+	LONG count = header->slot_count;
+	return count < SLEEPY_SHIM_TAG_SLOTS ? count : SLEEPY_SHIM_TAG_SLOTS;
+}
+
+bool ShimReader::getTagSlots(std::map<DWORD, const SleepyShimTagSlot *> &slots) const
+{
+	bool complete = true;
+	LONG count = getTagSlotCount();
+	for (LONG n=0;n<count;n++)
+	{
+		const SleepyShimTagSlot &slot = header->tag_slots[n];
+		if (slot.thread_id)
+			slots[slot.thread_id] = &slot;
+		else
+			complete = false;
+	}
+	return complete;
+}
+
+std::wstring ShimReader::getTagName(LONG tag) const
+{
+	if (!header || tag <= 0 || tag > header->tag_count || tag > SLEEPY_SHIM_MAX_TAGS)
+		return std::wstring();
+
+	MemoryBarrier();
+	char name[SLEEPY_SHIM_TAG_LENGTH];
+	memcpy(name, header->tag_names[tag-1], SLEEPY_SHIM_TAG_LENGTH);
+	name[SLEEPY_SHIM_TAG_LENGTH-1] = 0;
+
+	wchar_t wide[SLEEPY_SHIM_TAG_LENGTH];
+	int len = MultiByteToWideChar(CP_UTF8, 0, name, -1, wide, SLEEPY_SHIM_TAG_LENGTH);
+	return len > 0 ? std::wstring(wide, len-1) : std::wstring();
+}
@@ -0,0 +1,74 @@
+/*=====================================================================
+shimreader.h
+------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#ifndef __SHIMREADER_H_666_
+#define __SHIMREADER_H_666_
+
+#include <windows.h>
+#include <map>
+#include <string>
+#include "sleepyshim.h"
+
+/*=====================================================================
+ShimReader
+----------
+Profiler side of sleepyshim.h: maps the shared block published by a
+target that has the shim compiled in, and drains its event ring.
+=====================================================================*/
+class ShimReader
+{
+public:
+	ShimReader();
+	~ShimReader();
+
+	/// Try to map the shim block of the given process.
+	/// Returns false if the target doesn't have the shim (yet).
+	bool open(DWORD process_id);
+	void close();
+	bool isOpen() const { return header != NULL; }
+
+	/// Copies up to max_events pending events into out.
+	/// Returns the number of events copied.
+	size_t read(SleepyShimEvent *out, size_t max_events);
+
+	ULONGLONG getSamplePeriod() const { return header ? header->sample_period : 0; }
+	LONG getDropped() const { return header ? header->dropped : 0; }
+	bool inMarkedRegion() const { return header && header->regions > 0; }
+
+	/// Tag slots claimed so far; changes whenever a thread sets its first tag.
+	LONG getTagSlotCount() const;
+	/// Adds the slot of every thread that has set a tag or blocked on a
+	/// hooked lock to slots, by thread id. Returns false if a slot was still
+	/// being claimed, in which case it's worth looking again even if the
+	/// count hasn't changed.
+	bool getTagSlots(std::map<DWORD, const SleepyShimTagSlot *> &slots) const;
+	/// 4 or 8; the target's pointer size.
+	ULONG getPointerSize() const { return header ? header->pointer_size : 0; }
+	/// The name of a tag id, or an empty string for 0 and unknown ids.
+	std::wstring getTagName(LONG tag) const;
+
+private:
+	HANDLE mapping;
+	SleepyShimHeader *header;
+};
+
+#endif //__SHIMREADER_H_666_
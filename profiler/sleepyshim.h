@@ -0,0 +1,1122 @@
+/*=====================================================================
+sleepyshim.h
+------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+
+// This header is compiled into the *target* application, not into the
+// profiler. It sets up a small named shared-memory block that the profiler
+// maps (see ShimReader) and fills it with sampled events.
+//
+// Usage: include it anywhere, and in exactly one translation unit do
+//
+//     #define SLEEPY_SHIM_IMPLEMENTATION
+//     #include "sleepyshim.h"
+//
+// That TU then replaces the global operator new/delete family and provides
+// sleepy_malloc/sleepy_free/sleepy_realloc. Define SLEEPY_SHIM_HOOK_CRT as
+// well to also redirect the main module's malloc/free/realloc/calloc imports
+// (only has an effect with the DLL CRT). Define SLEEPY_SHIM_NO_HEAP to leave
+// operator new/delete alone.
+//
+// Allocations are sampled geometrically: on average one sample is taken
+// every SLEEPY_SHIM_SAMPLE_PERIOD bytes, and each sample carries the number
+// of bytes and allocations it stands for, so sums over samples are unbiased.
+//
+// Define SLEEPY_SHIM_HOOK_LOCKS to redirect the main module's imports of the
+// Win32 locking and waiting functions (critical sections, SRW locks,
+// condition variables, WaitOnAddress and WaitForSingleObject). Every wait
+// that actually blocks is reported with its duration and the address of the
+// lock it waited on; uncontended acquisitions cost one extra Try call.
+// Other modules can be hooked with sleepy_shim_hook_locks().
+//
+// Define SLEEPY_SHIM_HOOK_IO to do the same for blocking file and socket
+// I/O (ReadFile, WriteFile, FlushFileBuffers, GetQueuedCompletionStatus and
+// the Winsock receive/send/poll calls). Calls that return in less than
+// SLEEPY_SHIM_MIN_IO_MICROSECONDS are not reported, which keeps cached reads
+// from flooding the ring. Other modules: sleepy_shim_hook_io().
+//
+// Wrap interesting work in sleepy_shim_region_begin/end to have a CPU
+// capture started with -burst sample faster while it runs, and show those
+// samples in their own view. Regions nest and may overlap across threads.
+//
+// To see which request, endpoint or tenant a thread is working for, give
+// each one a tag with sleepy_shim_tag (once, it returns an id) and set the
+// thread's current tag with sleepy_shim_set_tag as it picks up work. A CPU
+// capture started with -tags reads each sampled thread's tag while it is
+// suspended, so the samples can be grouped and filtered by tag. Setting a
+// tag is a single store into the thread's slot in the shared block.
+//
+// With SLEEPY_SHIM_HOOK_LOCKS, a thread that blocks also publishes the lock
+// it is waiting on in its slot, which lets the profiler's stuck-thread
+// report (-stuck) show who is waiting for whom.
+
+#ifndef __SLEEPYSHIM_H_666_
+#define __SLEEPYSHIM_H_666_
+
+#include <windows.h>
+
+#define SLEEPY_SHIM_MAGIC			0x4D495853 // 'SXIM'
+#define SLEEPY_SHIM_VERSION			3
+#define SLEEPY_SHIM_MAPPING_PREFIX	L"Local\\SleepyShim-"
+#define SLEEPY_SHIM_MAX_FRAMES		62
+#define SLEEPY_SHIM_RING_SIZE		8192	// events, must be a power of two
+#define SLEEPY_SHIM_MAX_TAGS		1024
+#define SLEEPY_SHIM_TAG_LENGTH		64		// bytes of UTF-8, including the terminator
+#define SLEEPY_SHIM_TAG_SLOTS		4096	// threads that can carry a tag
+
+#ifndef SLEEPY_SHIM_SAMPLE_PERIOD
+#define SLEEPY_SHIM_SAMPLE_PERIOD	(512*1024)
+#endif
+
+#ifndef SLEEPY_SHIM_MIN_IO_MICROSECONDS
+#define SLEEPY_SHIM_MIN_IO_MICROSECONDS	20
+#endif
+
+enum SleepyShimEventKind
+{
+	SLEEPY_EVENT_ALLOC = 1,		// key = block address, value = size, weight = bytes represented
+	SLEEPY_EVENT_FREE  = 2,		// key = block address of a previously sampled ALLOC
+	SLEEPY_EVENT_WAIT  = 3,		// key = lock address, value = SleepyShimWaitKind, weight = seconds blocked
+	SLEEPY_EVENT_IO    = 4,		// key = handle, value = SleepyShimIoCall | SleepyShimHandleType<<8, weight = seconds blocked
+};
+
+enum SleepyShimWaitKind
+{
+	SLEEPY_WAIT_CRITICAL_SECTION = 1,
+	SLEEPY_WAIT_SRW_EXCLUSIVE,
+	SLEEPY_WAIT_SRW_SHARED,
+	SLEEPY_WAIT_CONDITION_VARIABLE,
+	SLEEPY_WAIT_ADDRESS,		// WaitOnAddress, the Win32 futex
+	SLEEPY_WAIT_OBJECT,			// WaitForSingleObject(Ex); key is the handle value
+};
+
+enum SleepyShimIoCall
+{
+	SLEEPY_IO_READFILE = 1,
+	SLEEPY_IO_WRITEFILE,
+	SLEEPY_IO_FLUSHFILEBUFFERS,
+	SLEEPY_IO_GETQUEUEDCOMPLETIONSTATUS,
+	SLEEPY_IO_GETQUEUEDCOMPLETIONSTATUSEX,
+	SLEEPY_IO_RECV,
+	SLEEPY_IO_SEND,
+	SLEEPY_IO_WSARECV,
+	SLEEPY_IO_WSASEND,
+	SLEEPY_IO_SELECT,
+	SLEEPY_IO_WSAPOLL,
+};
+
+enum SleepyShimHandleType
+{
+	SLEEPY_HANDLE_UNKNOWN = 0,
+	SLEEPY_HANDLE_DISK,
+	SLEEPY_HANDLE_CHAR,
+	SLEEPY_HANDLE_PIPE,
+	SLEEPY_HANDLE_REMOTE,
+	SLEEPY_HANDLE_SOCKET,
+	SLEEPY_HANDLE_IOCP,
+	SLEEPY_HANDLE_QUERY = 0xff,	// shim-internal: look it up with GetFileType
+};
+
+/// One ring slot. 'sequence' implements a bounded multi-producer queue:
+/// a slot is free for writing at position p when sequence == p, and ready
+/// for reading when sequence == p+1.
+struct SleepyShimEvent
+{
+	volatile LONG sequence;
+	ULONG kind;
+	ULONG thread_id;
+	ULONG depth;
+	ULONGLONG key;
+	ULONGLONG value;
+	double weight;		// primary weight (e.g. bytes)
+	double count;		// secondary weight (e.g. number of allocations)
+	ULONGLONG frames[SLEEPY_SHIM_MAX_FRAMES];
+};
+
+/// A thread's current tag, and the lock it is blocked on. Claimed by the
+/// thread the first time it sets a tag or blocks, and kept for its lifetime
+/// (or reused by a later thread that gets the same id).
+struct SleepyShimTagSlot
+{
+	volatile ULONG thread_id;	// 0 while the slot is being claimed
+	volatile LONG tag;			// 0 = none, otherwise index into tag_names + 1
+	volatile LONG wait_kind;	// SleepyShimWaitKind while blocked, otherwise 0
+	volatile ULONGLONG wait_key;	// the lock address or handle waited on
+};
+
+struct SleepyShimHeader
+{
+	ULONG magic;
+	ULONG version;
+	ULONG ring_size;
+	ULONG pointer_size;
+	ULONGLONG sample_period;
+	volatile LONG write_pos;
+	volatile LONG read_pos;
+	volatile LONG dropped;
+	volatile LONG regions;	// marked regions currently open
+	volatile LONG tag_count;	// entries of tag_names in use
+	volatile LONG tag_lock;		// held while adding a tag
+	volatile LONG slot_count;	// entries of tag_slots claimed
+	SleepyShimEvent ring[SLEEPY_SHIM_RING_SIZE];
+	char tag_names[SLEEPY_SHIM_MAX_TAGS][SLEEPY_SHIM_TAG_LENGTH];
+	SleepyShimTagSlot tag_slots[SLEEPY_SHIM_TAG_SLOTS];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *sleepy_malloc(size_t size);
+void *sleepy_calloc(size_t count, size_t size);
+void *sleepy_realloc(void *p, size_t size);
+void  sleepy_free(void *p);
+
+/// Redirects a module's imports of the locking functions. Returns false if
+/// none were found.
+BOOL  sleepy_shim_hook_locks(HMODULE module);
+
+/// Same for the blocking file and socket I/O functions.
+BOOL  sleepy_shim_hook_io(HMODULE module);
+
+/// Opens and closes a marked region (see above).
+void  sleepy_shim_region_begin(void);
+void  sleepy_shim_region_end(void);
+
+/// Returns the id of a tag (see above), adding it on first use. Ids stay
+/// valid for the life of the process, so look each name up once. Names
+/// longer than SLEEPY_SHIM_TAG_LENGTH-1 bytes are cut short. Returns 0 if
+/// the table is full or the shim couldn't start.
+LONG  sleepy_shim_tag(const char *name);
+
+/// Sets the calling thread's current tag (0 = none).
+void  sleepy_shim_set_tag(LONG tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef SLEEPY_SHIM_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <new>
+#include <intrin.h>
+
+#pragma intrinsic(_ReturnAddress)
+
+static SleepyShimHeader *sleepy_shim_header = NULL;
+static volatile LONG sleepy_shim_state = 0; // 0 = not started, 1 = starting, 2 = ready, 3 = failed
+static double sleepy_shim_tick_seconds;
+
+// Set while the shim itself is running on this thread, so that any
+// allocation made by Windows on our behalf doesn't recurse back in.
+static __declspec(thread) int sleepy_shim_busy;
+static __declspec(thread) LONGLONG sleepy_shim_bytes_left;
+static __declspec(thread) ULONG sleepy_shim_rng;
+static __declspec(thread) SleepyShimTagSlot *sleepy_shim_tag_slot;
+
+static bool sleepy_shim_init()
+{
+	LONG state = InterlockedCompareExchange(&sleepy_shim_state, 1, 0);
+	if (state == 0)
+	{
+		wchar_t name[64];
+		wsprintfW(name, SLEEPY_SHIM_MAPPING_PREFIX L"%lu", GetCurrentProcessId());
+
+		HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+			0, sizeof(SleepyShimHeader), name);
+		SleepyShimHeader *header = mapping ? (SleepyShimHeader *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL;
+		if (!header)
+		{
+			InterlockedExchange(&sleepy_shim_state, 3);
+			return false;
+		}
+
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		sleepy_shim_tick_seconds = 1.0 / (double)freq.QuadPart;
+
+		// The mapping handle is deliberately leaked; it must live as long as the process.
+		for (LONG n=0;n<SLEEPY_SHIM_RING_SIZE;n++)
+			header->ring[n].sequence = n;
+		header->ring_size = SLEEPY_SHIM_RING_SIZE;
+		header->pointer_size = sizeof(void*);
+		header->sample_period = SLEEPY_SHIM_SAMPLE_PERIOD;
+		header->version = SLEEPY_SHIM_VERSION;
+		MemoryBarrier();
+		header->magic = SLEEPY_SHIM_MAGIC;
+
+		sleepy_shim_header = header;
+		InterlockedExchange(&sleepy_shim_state, 2);
+		return true;
+	}
+
+	while (state == 1)
+	{
+		YieldProcessor();
+		state = sleepy_shim_state;
+	}
+	return state == 2;
+}
+
+/// Draws the number of bytes until the next sample from an exponential
+/// distribution with mean SLEEPY_SHIM_SAMPLE_PERIOD.
+static LONGLONG sleepy_shim_next_interval()
+{
+	if (!sleepy_shim_rng)
+		sleepy_shim_rng = GetCurrentThreadId() * 2654435761u | 1;
+
+	// xorshift32
+	ULONG x = sleepy_shim_rng;
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+	sleepy_shim_rng = x;
+
+	double u = (x + 1.0) / 4294967297.0; // (0,1)
+	return (LONGLONG)(-log(u) * SLEEPY_SHIM_SAMPLE_PERIOD) + 1;
+}
+
+static SleepyShimEvent *sleepy_shim_begin_event()
+{
+	SleepyShimHeader *header = sleepy_shim_header;
+	LONG pos = header->write_pos;
+	for (;;)
+	{
+		SleepyShimEvent *ev = &header->ring[pos & (SLEEPY_SHIM_RING_SIZE-1)];
+		LONG diff = ev->sequence - pos;
+		if (diff == 0)
+		{
+			LONG prev = InterlockedCompareExchange(&header->write_pos, pos+1, pos);
+			if (prev == pos)
+				return ev;
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			// Ring full - the profiler isn't draining it (or isn't attached).
+			InterlockedIncrement(&header->dropped);
+			return NULL;
+		}
+		else
+			pos = header->write_pos;
+	}
+}
+
+static void sleepy_shim_end_event(SleepyShimEvent *ev)
+{
+	MemoryBarrier();
+	ev->sequence = ev->sequence + 1;
+}
+
+// Most shim frames we expect to find above the entry point's caller.
+#define SLEEPY_SHIM_OWN_FRAMES		8
+
+/// Records the stack starting at caller, the return address taken by the
+/// shim entry point that was called (_ReturnAddress()). Searching for it
+/// rather than skipping a fixed number of frames keeps the stack right
+/// however much of the shim the optimizer inlined.
+static void sleepy_shim_capture(SleepyShimEvent *ev, const void *caller)
+{
+	PVOID frames[SLEEPY_SHIM_MAX_FRAMES + SLEEPY_SHIM_OWN_FRAMES];
+	USHORT depth = RtlCaptureStackBackTrace(1, SLEEPY_SHIM_MAX_FRAMES + SLEEPY_SHIM_OWN_FRAMES, frames, NULL);
+
+	USHORT first = 0;
+	while (first < depth && frames[first] != caller)
+		first++;
+	if (first == depth)
+		first = 0; // not found; better a shim frame too many than none at all
+
+	USHORT n = 0;
+	for (;first+n<depth && n<SLEEPY_SHIM_MAX_FRAMES;n++)
+		ev->frames[n] = (ULONGLONG)(ULONG_PTR)frames[first+n];
+	ev->depth = n;
+	ev->thread_id = GetCurrentThreadId();
+}
+
+//------------------------------------------------------------------------
+// Table of sampled blocks still alive, so frees can be matched up cheaply.
+// Open addressing, fixed size; if it fills up we simply stop reporting frees
+// for the overflow, which only affects the live-heap view.
+//------------------------------------------------------------------------
+#define SLEEPY_SHIM_LIVE_SLOTS	65536
+static void * volatile sleepy_shim_live[SLEEPY_SHIM_LIVE_SLOTS];
+#define SLEEPY_SHIM_TOMBSTONE	((void*)(ULONG_PTR)1)
+
+static ULONG sleepy_shim_hash(void *p)
+{
+	ULONG_PTR v = (ULONG_PTR)p >> 4;
+	return (ULONG)(v * 2654435761u) & (SLEEPY_SHIM_LIVE_SLOTS-1);
+}
+
+static void sleepy_shim_live_add(void *p)
+{
+	ULONG h = sleepy_shim_hash(p);
+
+	// A block resized in place can be sampled again; keep one entry for it.
+	for (ULONG n=0;n<64;n++)
+	{
+		void *cur = sleepy_shim_live[(h+n) & (SLEEPY_SHIM_LIVE_SLOTS-1)];
+		if (cur == p)
+			return;
+		if (cur == NULL)
+			break;
+	}
+
+	for (ULONG n=0;n<64;n++)
+	{
+		void * volatile *slot = &sleepy_shim_live[(h+n) & (SLEEPY_SHIM_LIVE_SLOTS-1)];
+		void *cur = *slot;
+		if ((cur == NULL || cur == SLEEPY_SHIM_TOMBSTONE) &&
+			InterlockedCompareExchangePointer((PVOID volatile*)slot, p, cur) == cur)
+			return;
+	}
+}
+
+static bool sleepy_shim_live_remove(void *p)
+{
+	ULONG h = sleepy_shim_hash(p);
+	for (ULONG n=0;n<64;n++)
+	{
+		void * volatile *slot = &sleepy_shim_live[(h+n) & (SLEEPY_SHIM_LIVE_SLOTS-1)];
+		void *cur = *slot;
+		if (cur == NULL)
+			return false;
+		if (cur == p)
+			return InterlockedCompareExchangePointer((PVOID volatile*)slot, SLEEPY_SHIM_TOMBSTONE, p) == p;
+	}
+	return false;
+}
+
+static void sleepy_shim_on_alloc(void *p, size_t size, const void *caller)
+{
+	if (!p || sleepy_shim_busy)
+		return;
+
+	if (sleepy_shim_bytes_left == 0)
+		sleepy_shim_bytes_left = sleepy_shim_next_interval();
+
+	sleepy_shim_bytes_left -= (LONGLONG)size;
+	if (sleepy_shim_bytes_left > 0)
+		return;
+
+	sleepy_shim_busy++;
+	sleepy_shim_bytes_left = sleepy_shim_next_interval();
+
+	if (sleepy_shim_state == 2 || sleepy_shim_init())
+	{
+		// Probability that an allocation of this size got sampled.
+		double p_sampled = 1.0 - exp(-(double)size / (double)SLEEPY_SHIM_SAMPLE_PERIOD);
+		if (p_sampled <= 0.0)
+			p_sampled = 1.0 / SLEEPY_SHIM_SAMPLE_PERIOD;
+
+		SleepyShimEvent *ev = sleepy_shim_begin_event();
+		if (ev)
+		{
+			ev->kind = SLEEPY_EVENT_ALLOC;
+			ev->key = (ULONGLONG)(ULONG_PTR)p;
+			ev->value = size;
+			ev->weight = (double)size / p_sampled;
+			ev->count = 1.0 / p_sampled;
+			sleepy_shim_capture(ev, caller);
+			sleepy_shim_end_event(ev);
+			sleepy_shim_live_add(p);
+		}
+	}
+
+	sleepy_shim_busy--;
+}
+
+static void sleepy_shim_on_free(void *p)
+{
+	if (!p || sleepy_shim_state != 2 || sleepy_shim_busy)
+		return;
+
+	if (!sleepy_shim_live_remove(p))
+		return;
+
+	sleepy_shim_busy++;
+	SleepyShimEvent *ev = sleepy_shim_begin_event();
+	if (ev)
+	{
+		ev->kind = SLEEPY_EVENT_FREE;
+		ev->key = (ULONGLONG)(ULONG_PTR)p;
+		ev->value = 0;
+		ev->weight = 0;
+		ev->count = 0;
+		ev->depth = 0;
+		ev->thread_id = GetCurrentThreadId();
+		sleepy_shim_end_event(ev);
+	}
+	sleepy_shim_busy--;
+}
+
+// The real CRT entry points. Only filled in when the imports get patched;
+// otherwise we call the CRT directly.
+static void *(__cdecl *sleepy_crt_malloc)(size_t);
+static void *(__cdecl *sleepy_crt_calloc)(size_t, size_t);
+static void *(__cdecl *sleepy_crt_realloc)(void *, size_t);
+static void  (__cdecl *sleepy_crt_free)(void *);
+
+// Each entry point into the allocator (sleepy_malloc and co., operator new,
+// the CRT hooks) passes down its own return address, which is where the
+// sampled stack starts. The entry points must never be inlined, or that
+// would be their caller's return address instead.
+static void *sleepy_shim_malloc(size_t size, const void *caller)
+{
+	void *p = sleepy_crt_malloc ? sleepy_crt_malloc(size) : malloc(size);
+	sleepy_shim_on_alloc(p, size, caller);
+	return p;
+}
+
+static void *sleepy_shim_calloc(size_t count, size_t size, const void *caller)
+{
+	void *p = sleepy_crt_calloc ? sleepy_crt_calloc(count, size) : calloc(count, size);
+	sleepy_shim_on_alloc(p, count * size, caller);
+	return p;
+}
+
+static void *sleepy_shim_realloc(void *p, size_t size, const void *caller)
+{
+	void *q = sleepy_crt_realloc ? sleepy_crt_realloc(p, size) : realloc(p, size);
+
+	// A block resized in place is still live at the same address. Reporting
+	// a free for it could be drained after the alloc of the same block and
+	// drop it from the live-heap view.
+	if ((q || size == 0) && q != p)
+		sleepy_shim_on_free(p);
+	sleepy_shim_on_alloc(q, size, caller);
+	return q;
+}
+
+extern "C" __declspec(noinline) void *sleepy_malloc(size_t size)
+{
+	return sleepy_shim_malloc(size, _ReturnAddress());
+}
+
+extern "C" __declspec(noinline) void *sleepy_calloc(size_t count, size_t size)
+{
+	return sleepy_shim_calloc(count, size, _ReturnAddress());
+}
+
+extern "C" __declspec(noinline) void *sleepy_realloc(void *p, size_t size)
+{
+	return sleepy_shim_realloc(p, size, _ReturnAddress());
+}
+
+extern "C" void sleepy_free(void *p)
+{
+	sleepy_shim_on_free(p);
+	if (sleepy_crt_free)
+		sleepy_crt_free(p);
+	else
+		free(p);
+}
+
+#ifndef SLEEPY_SHIM_NO_HEAP
+__declspec(noinline) void *operator new(size_t size)
+{
+	void *p = sleepy_shim_malloc(size ? size : 1, _ReturnAddress());
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+__declspec(noinline) void *operator new[](size_t size)
+{
+	void *p = sleepy_shim_malloc(size ? size : 1, _ReturnAddress());
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+__declspec(noinline) void *operator new(size_t size, const std::nothrow_t &) throw()
+{
+	return sleepy_shim_malloc(size ? size : 1, _ReturnAddress());
+}
+
+__declspec(noinline) void *operator new[](size_t size, const std::nothrow_t &) throw()
+{
+	return sleepy_shim_malloc(size ? size : 1, _ReturnAddress());
+}
+
+void operator delete(void *p) throw()							{ sleepy_free(p); }
+void operator delete[](void *p) throw()							{ sleepy_free(p); }
+void operator delete(void *p, const std::nothrow_t &) throw()	{ sleepy_free(p); }
+void operator delete[](void *p, const std::nothrow_t &) throw()	{ sleepy_free(p); }
+#endif // SLEEPY_SHIM_NO_HEAP
+
+//------------------------------------------------------------------------
+// Import address table patching. This is the Windows counterpart of symbol
+// interposition: we rewrite the main module's import slots so that calls
+// into the CRT DLL land in our wrappers instead.
+//------------------------------------------------------------------------
+static bool sleepy_shim_patch_import(HMODULE module, const char *dll_prefix, const char *func, void *replacement)
+{
+	BYTE *base = (BYTE *)module;
+	IMAGE_DOS_HEADER *dos = (IMAGE_DOS_HEADER *)base;
+	IMAGE_NT_HEADERS *nt = (IMAGE_NT_HEADERS *)(base + dos->e_lfanew);
+	IMAGE_DATA_DIRECTORY &dir = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	if (!dir.VirtualAddress)
+		return false;
+
+	bool patched = false;
+	size_t prefix_len = strlen(dll_prefix);
+	for (IMAGE_IMPORT_DESCRIPTOR *imp = (IMAGE_IMPORT_DESCRIPTOR *)(base + dir.VirtualAddress); imp->Name; imp++)
+	{
+		if (_strnicmp((const char *)(base + imp->Name), dll_prefix, prefix_len) != 0)
+			continue;
+		if (!imp->OriginalFirstThunk)
+			continue;
+
+		IMAGE_THUNK_DATA *names = (IMAGE_THUNK_DATA *)(base + imp->OriginalFirstThunk);
+		IMAGE_THUNK_DATA *slots = (IMAGE_THUNK_DATA *)(base + imp->FirstThunk);
+		for (; names->u1.AddressOfData; names++, slots++)
+		{
+			if (IMAGE_SNAP_BY_ORDINAL(names->u1.Ordinal))
+				continue;
+			IMAGE_IMPORT_BY_NAME *byname = (IMAGE_IMPORT_BY_NAME *)(base + names->u1.AddressOfData);
+			if (strcmp((const char *)byname->Name, func) != 0)
+				continue;
+
+			DWORD old;
+			if (VirtualProtect(&slots->u1.Function, sizeof(slots->u1.Function), PAGE_READWRITE, &old))
+			{
+				slots->u1.Function = (ULONG_PTR)replacement;
+				VirtualProtect(&slots->u1.Function, sizeof(slots->u1.Function), old, &old);
+				patched = true;
+			}
+		}
+	}
+	return patched;
+}
+
+#ifdef SLEEPY_SHIM_HOOK_CRT
+static void *__cdecl sleepy_hook_malloc(size_t size)				{ return sleepy_shim_malloc(size, _ReturnAddress()); }
+static void *__cdecl sleepy_hook_calloc(size_t count, size_t size)	{ return sleepy_shim_calloc(count, size, _ReturnAddress()); }
+static void *__cdecl sleepy_hook_realloc(void *p, size_t size)		{ return sleepy_shim_realloc(p, size, _ReturnAddress()); }
+static void  __cdecl sleepy_hook_free(void *p)						{ sleepy_free(p); }
+
+static struct SleepyShimCrtHooks
+{
+	SleepyShimCrtHooks()
+	{
+		HMODULE crt = GetModuleHandleW(L"ucrtbase.dll");
+		if (!crt)
+			crt = GetModuleHandleW(L"msvcrt.dll");
+		if (!crt)
+			return;
+
+		*(FARPROC *)&sleepy_crt_malloc  = GetProcAddress(crt, "malloc");
+		*(FARPROC *)&sleepy_crt_calloc  = GetProcAddress(crt, "calloc");
+		*(FARPROC *)&sleepy_crt_realloc = GetProcAddress(crt, "realloc");
+		*(FARPROC *)&sleepy_crt_free    = GetProcAddress(crt, "free");
+		if (!sleepy_crt_malloc || !sleepy_crt_calloc || !sleepy_crt_realloc || !sleepy_crt_free)
+			return;
+
+		HMODULE exe = GetModuleHandleW(NULL);
+		static const char *dlls[] = { "api-ms-win-crt-heap", "ucrtbase", "msvcrt" };
+		for (size_t n=0;n<sizeof(dlls)/sizeof(dlls[0]);n++)
+		{
+			sleepy_shim_patch_import(exe, dlls[n], "malloc",  (void *)sleepy_hook_malloc);
+			sleepy_shim_patch_import(exe, dlls[n], "calloc",  (void *)sleepy_hook_calloc);
+			sleepy_shim_patch_import(exe, dlls[n], "realloc", (void *)sleepy_hook_realloc);
+			sleepy_shim_patch_import(exe, dlls[n], "free",    (void *)sleepy_hook_free);
+		}
+	}
+} sleepy_shim_crt_hooks;
+#endif // SLEEPY_SHIM_HOOK_CRT
+
+//------------------------------------------------------------------------
+// Timed hooks (locks and I/O). Each hook passes its own return address to
+// sleepy_shim_on_blocked, so the stack starts at the hook's caller.
+//------------------------------------------------------------------------
+static ULONG sleepy_shim_handle_type(HANDLE h)
+{
+	switch (GetFileType(h))
+	{
+	case FILE_TYPE_DISK:	return SLEEPY_HANDLE_DISK;
+	case FILE_TYPE_CHAR:	return SLEEPY_HANDLE_CHAR;
+	case FILE_TYPE_PIPE:	return SLEEPY_HANDLE_PIPE;		// includes sockets used through ReadFile
+	case FILE_TYPE_REMOTE:	return SLEEPY_HANDLE_REMOTE;
+	default:				return SLEEPY_HANDLE_UNKNOWN;
+	}
+}
+
+/// Returns the calling thread's slot, claiming one if it hasn't yet.
+/// NULL if the shim couldn't start or every slot is taken.
+static SleepyShimTagSlot *sleepy_shim_thread_slot()
+{
+	SleepyShimTagSlot *slot = sleepy_shim_tag_slot;
+	if (slot || !(sleepy_shim_state == 2 || sleepy_shim_init()))
+		return slot;
+
+	// Take over the slot of an exited thread that had our id, if any,
+	// so the profiler never sees two slots for one thread.
+	SleepyShimHeader *header = sleepy_shim_header;
+	ULONG id = GetCurrentThreadId();
+	LONG count = header->slot_count;
+	for (LONG n=0;n<count && n<SLEEPY_SHIM_TAG_SLOTS && !slot;n++)
+		if (header->tag_slots[n].thread_id == id)
+			slot = &header->tag_slots[n];
+
+	if (!slot)
+	{
+		LONG n = InterlockedIncrement(&header->slot_count) - 1;
+		if (n >= SLEEPY_SHIM_TAG_SLOTS)
+			return NULL; // out of slots; this thread goes without
+		slot = &header->tag_slots[n];
+		slot->tag = 0;
+		slot->wait_kind = 0;
+		MemoryBarrier();
+		slot->thread_id = id;
+	}
+	sleepy_shim_tag_slot = slot;
+	return slot;
+}
+
+/// Publishes the lock the calling thread is about to block on
+/// (kind 0 once it's done waiting).
+static void sleepy_shim_set_waiting(ULONG kind, const void *key)
+{
+	if (sleepy_shim_busy)
+		return;
+
+	sleepy_shim_busy++;
+	SleepyShimTagSlot *slot = kind ? sleepy_shim_thread_slot() : sleepy_shim_tag_slot;
+	if (slot)
+	{
+		if (kind)
+			slot->wait_key = (ULONGLONG)(ULONG_PTR)key;
+		slot->wait_kind = kind;
+	}
+	sleepy_shim_busy--;
+}
+
+static void sleepy_shim_on_blocked(ULONG kind, ULONG value, const void *key, LONGLONG start, const void *caller)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	if (sleepy_shim_busy)
+		return;
+
+	sleepy_shim_busy++;
+	if (sleepy_shim_state == 2 || sleepy_shim_init())
+	{
+		double seconds = (double)(now.QuadPart - start) * sleepy_shim_tick_seconds;
+		bool report = kind != SLEEPY_EVENT_IO || seconds >= SLEEPY_SHIM_MIN_IO_MICROSECONDS * 1e-6;
+		if (report && kind == SLEEPY_EVENT_IO && (value >> 8) == SLEEPY_HANDLE_QUERY)
+			value = (value & 0xff) | (sleepy_shim_handle_type((HANDLE)key) << 8);
+
+		SleepyShimEvent *ev = report ? sleepy_shim_begin_event() : NULL;
+		if (ev)
+		{
+			ev->kind = kind;
+			ev->key = (ULONGLONG)(ULONG_PTR)key;
+			ev->value = value;
+			ev->weight = seconds;
+			ev->count = 1.0;
+			sleepy_shim_capture(ev, caller);
+			sleepy_shim_end_event(ev);
+		}
+	}
+	sleepy_shim_busy--;
+}
+
+//------------------------------------------------------------------------
+// Lock contention. Each hook first tries the non-blocking variant (where
+// there is one) so uncontended acquisitions are never timed or reported.
+//------------------------------------------------------------------------
+
+static LONGLONG sleepy_shim_now()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+// The real entry points, looked up before any import is patched, since the
+// shim's own calls may go through the very slots we're about to rewrite.
+static void (WINAPI *sleepy_real_EnterCriticalSection)(LPCRITICAL_SECTION);
+static void (WINAPI *sleepy_real_AcquireSRWLockExclusive)(PSRWLOCK);
+static void (WINAPI *sleepy_real_AcquireSRWLockShared)(PSRWLOCK);
+static BOOL (WINAPI *sleepy_real_SleepConditionVariableCS)(PCONDITION_VARIABLE, PCRITICAL_SECTION, DWORD);
+static BOOL (WINAPI *sleepy_real_SleepConditionVariableSRW)(PCONDITION_VARIABLE, PSRWLOCK, DWORD, ULONG);
+static BOOL (WINAPI *sleepy_real_WaitOnAddress)(volatile VOID *, PVOID, SIZE_T, DWORD);
+static DWORD (WINAPI *sleepy_real_WaitForSingleObject)(HANDLE, DWORD);
+static DWORD (WINAPI *sleepy_real_WaitForSingleObjectEx)(HANDLE, DWORD, BOOL);
+
+static void WINAPI sleepy_hook_EnterCriticalSection(LPCRITICAL_SECTION cs)
+{
+	if (TryEnterCriticalSection(cs))
+		return;
+	LONGLONG start = sleepy_shim_now();
+	sleepy_shim_set_waiting(SLEEPY_WAIT_CRITICAL_SECTION, cs);
+	sleepy_real_EnterCriticalSection(cs);
+	sleepy_shim_set_waiting(0, NULL);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_WAIT, SLEEPY_WAIT_CRITICAL_SECTION, cs, start, _ReturnAddress());
+}
+
+static void WINAPI sleepy_hook_AcquireSRWLockExclusive(PSRWLOCK lock)
+{
+	if (TryAcquireSRWLockExclusive(lock))
+		return;
+	LONGLONG start = sleepy_shim_now();
+	sleepy_shim_set_waiting(SLEEPY_WAIT_SRW_EXCLUSIVE, lock);
+	sleepy_real_AcquireSRWLockExclusive(lock);
+	sleepy_shim_set_waiting(0, NULL);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_WAIT, SLEEPY_WAIT_SRW_EXCLUSIVE, lock, start, _ReturnAddress());
+}
+
+static void WINAPI sleepy_hook_AcquireSRWLockShared(PSRWLOCK lock)
+{
+	if (TryAcquireSRWLockShared(lock))
+		return;
+	LONGLONG start = sleepy_shim_now();
+	sleepy_shim_set_waiting(SLEEPY_WAIT_SRW_SHARED, lock);
+	sleepy_real_AcquireSRWLockShared(lock);
+	sleepy_shim_set_waiting(0, NULL);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_WAIT, SLEEPY_WAIT_SRW_SHARED, lock, start, _ReturnAddress());
+}
+
+static BOOL WINAPI sleepy_hook_SleepConditionVariableCS(PCONDITION_VARIABLE cv, PCRITICAL_SECTION cs, DWORD ms)
+{
+	LONGLONG start = sleepy_shim_now();
+	sleepy_shim_set_waiting(SLEEPY_WAIT_CONDITION_VARIABLE, cv);
+	BOOL ret = sleepy_real_SleepConditionVariableCS(cv, cs, ms);
+	sleepy_shim_set_waiting(0, NULL);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_WAIT, SLEEPY_WAIT_CONDITION_VARIABLE, cv, start, _ReturnAddress());
+	return ret;
+}
+
+static BOOL WINAPI sleepy_hook_SleepConditionVariableSRW(PCONDITION_VARIABLE cv, PSRWLOCK lock, DWORD ms, ULONG flags)
+{
+	LONGLONG start = sleepy_shim_now();
+	sleepy_shim_set_waiting(SLEEPY_WAIT_CONDITION_VARIABLE, cv);
+	BOOL ret = sleepy_real_SleepConditionVariableSRW(cv, lock, ms, flags);
+	sleepy_shim_set_waiting(0, NULL);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_WAIT, SLEEPY_WAIT_CONDITION_VARIABLE, cv, start, _ReturnAddress());
+	return ret;
+}
+
+static BOOL WINAPI sleepy_hook_WaitOnAddress(volatile VOID *address, PVOID compare, SIZE_T size, DWORD ms)
+{
+	LONGLONG start = sleepy_shim_now();
+	sleepy_shim_set_waiting(SLEEPY_WAIT_ADDRESS, (const void *)address);
+	BOOL ret = sleepy_real_WaitOnAddress(address, compare, size, ms);
+	sleepy_shim_set_waiting(0, NULL);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_WAIT, SLEEPY_WAIT_ADDRESS, (const void *)address, start, _ReturnAddress());
+	return ret;
+}
+
+static DWORD WINAPI sleepy_hook_WaitForSingleObject(HANDLE h, DWORD ms)
+{
+	// Zero-timeout waits are polls and never block.
+	if (ms == 0)
+		return sleepy_real_WaitForSingleObject(h, ms);
+	LONGLONG start = sleepy_shim_now();
+	sleepy_shim_set_waiting(SLEEPY_WAIT_OBJECT, h);
+	DWORD ret = sleepy_real_WaitForSingleObject(h, ms);
+	sleepy_shim_set_waiting(0, NULL);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_WAIT, SLEEPY_WAIT_OBJECT, h, start, _ReturnAddress());
+	return ret;
+}
+
+static DWORD WINAPI sleepy_hook_WaitForSingleObjectEx(HANDLE h, DWORD ms, BOOL alertable)
+{
+	if (ms == 0)
+		return sleepy_real_WaitForSingleObjectEx(h, ms, alertable);
+	LONGLONG start = sleepy_shim_now();
+	sleepy_shim_set_waiting(SLEEPY_WAIT_OBJECT, h);
+	DWORD ret = sleepy_real_WaitForSingleObjectEx(h, ms, alertable);
+	sleepy_shim_set_waiting(0, NULL);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_WAIT, SLEEPY_WAIT_OBJECT, h, start, _ReturnAddress());
+	return ret;
+}
+
+extern "C" BOOL sleepy_shim_hook_locks(HMODULE module)
+{
+	static volatile LONG resolved = 0;
+	if (InterlockedCompareExchange(&resolved, 1, 0) == 0)
+	{
+		HMODULE k32 = GetModuleHandleW(L"kernel32.dll");
+		HMODULE kbase = GetModuleHandleW(L"kernelbase.dll");
+		*(FARPROC *)&sleepy_real_EnterCriticalSection       = GetProcAddress(k32, "EnterCriticalSection");
+		*(FARPROC *)&sleepy_real_AcquireSRWLockExclusive    = GetProcAddress(k32, "AcquireSRWLockExclusive");
+		*(FARPROC *)&sleepy_real_AcquireSRWLockShared       = GetProcAddress(k32, "AcquireSRWLockShared");
+		*(FARPROC *)&sleepy_real_SleepConditionVariableCS   = GetProcAddress(k32, "SleepConditionVariableCS");
+		*(FARPROC *)&sleepy_real_SleepConditionVariableSRW  = GetProcAddress(k32, "SleepConditionVariableSRW");
+		*(FARPROC *)&sleepy_real_WaitForSingleObject        = GetProcAddress(k32, "WaitForSingleObject");
+		*(FARPROC *)&sleepy_real_WaitForSingleObjectEx      = GetProcAddress(k32, "WaitForSingleObjectEx");
+		if (kbase)
+			*(FARPROC *)&sleepy_real_WaitOnAddress          = GetProcAddress(kbase, "WaitOnAddress");
+	}
+
+	static const char *dlls[] = { "kernel32", "api-ms-win-core-synch" };
+	BOOL patched = FALSE;
+	for (size_t n=0;n<sizeof(dlls)/sizeof(dlls[0]);n++)
+	{
+#define SLEEPY_SHIM_HOOK(func) \
+		if (sleepy_real_##func && sleepy_shim_patch_import(module, dlls[n], #func, (void *)sleepy_hook_##func)) \
+			patched = TRUE;
+		SLEEPY_SHIM_HOOK(EnterCriticalSection)
+		SLEEPY_SHIM_HOOK(AcquireSRWLockExclusive)
+		SLEEPY_SHIM_HOOK(AcquireSRWLockShared)
+		SLEEPY_SHIM_HOOK(SleepConditionVariableCS)
+		SLEEPY_SHIM_HOOK(SleepConditionVariableSRW)
+		SLEEPY_SHIM_HOOK(WaitOnAddress)
+		SLEEPY_SHIM_HOOK(WaitForSingleObject)
+		SLEEPY_SHIM_HOOK(WaitForSingleObjectEx)
+#undef SLEEPY_SHIM_HOOK
+	}
+	return patched;
+}
+
+#ifdef SLEEPY_SHIM_HOOK_LOCKS
+static struct SleepyShimLockHooks
+{
+	SleepyShimLockHooks()
+	{
+		sleepy_shim_hook_locks(GetModuleHandleW(NULL));
+	}
+} sleepy_shim_lock_hooks;
+#endif // SLEEPY_SHIM_HOOK_LOCKS
+
+//------------------------------------------------------------------------
+// Blocking I/O. The Winsock signatures are spelled out with plain types so
+// that the target doesn't need to include winsock2.h before this header.
+//------------------------------------------------------------------------
+#define SLEEPY_IO(call, type)	(SLEEPY_IO_##call | (SLEEPY_HANDLE_##type << 8))
+
+static BOOL (WINAPI *sleepy_real_ReadFile)(HANDLE, LPVOID, DWORD, LPDWORD, LPOVERLAPPED);
+static BOOL (WINAPI *sleepy_real_WriteFile)(HANDLE, LPCVOID, DWORD, LPDWORD, LPOVERLAPPED);
+static BOOL (WINAPI *sleepy_real_FlushFileBuffers)(HANDLE);
+static BOOL (WINAPI *sleepy_real_GetQueuedCompletionStatus)(HANDLE, LPDWORD, PULONG_PTR, LPOVERLAPPED *, DWORD);
+static BOOL (WINAPI *sleepy_real_GetQueuedCompletionStatusEx)(HANDLE, LPOVERLAPPED_ENTRY, ULONG, PULONG, DWORD, BOOL);
+static int (WINAPI *sleepy_real_recv)(UINT_PTR, char *, int, int);
+static int (WINAPI *sleepy_real_send)(UINT_PTR, const char *, int, int);
+static int (WINAPI *sleepy_real_WSARecv)(UINT_PTR, void *, DWORD, LPDWORD, LPDWORD, void *, void *);
+static int (WINAPI *sleepy_real_WSASend)(UINT_PTR, void *, DWORD, LPDWORD, DWORD, void *, void *);
+static int (WINAPI *sleepy_real_select)(int, void *, void *, void *, const void *);
+static int (WINAPI *sleepy_real_WSAPoll)(void *, ULONG, INT);
+
+static BOOL WINAPI sleepy_hook_ReadFile(HANDLE h, LPVOID buf, DWORD size, LPDWORD done, LPOVERLAPPED ov)
+{
+	LONGLONG start = sleepy_shim_now();
+	BOOL ret = sleepy_real_ReadFile(h, buf, size, done, ov);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(READFILE, QUERY), h, start, _ReturnAddress());
+	return ret;
+}
+
+static BOOL WINAPI sleepy_hook_WriteFile(HANDLE h, LPCVOID buf, DWORD size, LPDWORD done, LPOVERLAPPED ov)
+{
+	LONGLONG start = sleepy_shim_now();
+	BOOL ret = sleepy_real_WriteFile(h, buf, size, done, ov);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(WRITEFILE, QUERY), h, start, _ReturnAddress());
+	return ret;
+}
+
+static BOOL WINAPI sleepy_hook_FlushFileBuffers(HANDLE h)
+{
+	LONGLONG start = sleepy_shim_now();
+	BOOL ret = sleepy_real_FlushFileBuffers(h);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(FLUSHFILEBUFFERS, QUERY), h, start, _ReturnAddress());
+	return ret;
+}
+
+static BOOL WINAPI sleepy_hook_GetQueuedCompletionStatus(HANDLE port, LPDWORD bytes, PULONG_PTR key, LPOVERLAPPED *ov, DWORD ms)
+{
+	LONGLONG start = sleepy_shim_now();
+	BOOL ret = sleepy_real_GetQueuedCompletionStatus(port, bytes, key, ov, ms);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(GETQUEUEDCOMPLETIONSTATUS, IOCP), port, start, _ReturnAddress());
+	return ret;
+}
+
+static BOOL WINAPI sleepy_hook_GetQueuedCompletionStatusEx(HANDLE port, LPOVERLAPPED_ENTRY entries, ULONG count, PULONG removed, DWORD ms, BOOL alertable)
+{
+	LONGLONG start = sleepy_shim_now();
+	BOOL ret = sleepy_real_GetQueuedCompletionStatusEx(port, entries, count, removed, ms, alertable);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(GETQUEUEDCOMPLETIONSTATUSEX, IOCP), port, start, _ReturnAddress());
+	return ret;
+}
+
+static int WINAPI sleepy_hook_recv(UINT_PTR s, char *buf, int len, int flags)
+{
+	LONGLONG start = sleepy_shim_now();
+	int ret = sleepy_real_recv(s, buf, len, flags);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(RECV, SOCKET), (const void *)s, start, _ReturnAddress());
+	return ret;
+}
+
+static int WINAPI sleepy_hook_send(UINT_PTR s, const char *buf, int len, int flags)
+{
+	LONGLONG start = sleepy_shim_now();
+	int ret = sleepy_real_send(s, buf, len, flags);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(SEND, SOCKET), (const void *)s, start, _ReturnAddress());
+	return ret;
+}
+
+static int WINAPI sleepy_hook_WSARecv(UINT_PTR s, void *bufs, DWORD count, LPDWORD done, LPDWORD flags, void *ov, void *completion)
+{
+	LONGLONG start = sleepy_shim_now();
+	int ret = sleepy_real_WSARecv(s, bufs, count, done, flags, ov, completion);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(WSARECV, SOCKET), (const void *)s, start, _ReturnAddress());
+	return ret;
+}
+
+static int WINAPI sleepy_hook_WSASend(UINT_PTR s, void *bufs, DWORD count, LPDWORD done, DWORD flags, void *ov, void *completion)
+{
+	LONGLONG start = sleepy_shim_now();
+	int ret = sleepy_real_WSASend(s, bufs, count, done, flags, ov, completion);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(WSASEND, SOCKET), (const void *)s, start, _ReturnAddress());
+	return ret;
+}
+
+static int WINAPI sleepy_hook_select(int nfds, void *readfds, void *writefds, void *exceptfds, const void *timeout)
+{
+	LONGLONG start = sleepy_shim_now();
+	int ret = sleepy_real_select(nfds, readfds, writefds, exceptfds, timeout);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(SELECT, SOCKET), NULL, start, _ReturnAddress());
+	return ret;
+}
+
+static int WINAPI sleepy_hook_WSAPoll(void *fds, ULONG count, INT timeout)
+{
+	LONGLONG start = sleepy_shim_now();
+	int ret = sleepy_real_WSAPoll(fds, count, timeout);
+	sleepy_shim_on_blocked(SLEEPY_EVENT_IO, SLEEPY_IO(WSAPOLL, SOCKET), NULL, start, _ReturnAddress());
+	return ret;
+}
+
+#undef SLEEPY_IO
+
+extern "C" BOOL sleepy_shim_hook_io(HMODULE module)
+{
+	static volatile LONG resolved = 0;
+	if (InterlockedCompareExchange(&resolved, 1, 0) == 0)
+	{
+		HMODULE k32 = GetModuleHandleW(L"kernel32.dll");
+		HMODULE ws2 = GetModuleHandleW(L"ws2_32.dll");
+		*(FARPROC *)&sleepy_real_ReadFile                    = GetProcAddress(k32, "ReadFile");
+		*(FARPROC *)&sleepy_real_WriteFile                   = GetProcAddress(k32, "WriteFile");
+		*(FARPROC *)&sleepy_real_FlushFileBuffers            = GetProcAddress(k32, "FlushFileBuffers");
+		*(FARPROC *)&sleepy_real_GetQueuedCompletionStatus   = GetProcAddress(k32, "GetQueuedCompletionStatus");
+		*(FARPROC *)&sleepy_real_GetQueuedCompletionStatusEx = GetProcAddress(k32, "GetQueuedCompletionStatusEx");
+		if (ws2)
+		{
+			*(FARPROC *)&sleepy_real_recv    = GetProcAddress(ws2, "recv");
+			*(FARPROC *)&sleepy_real_send    = GetProcAddress(ws2, "send");
+			*(FARPROC *)&sleepy_real_WSARecv = GetProcAddress(ws2, "WSARecv");
+			*(FARPROC *)&sleepy_real_WSASend = GetProcAddress(ws2, "WSASend");
+			*(FARPROC *)&sleepy_real_select  = GetProcAddress(ws2, "select");
+			*(FARPROC *)&sleepy_real_WSAPoll = GetProcAddress(ws2, "WSAPoll");
+		}
+	}
+
+	static const char *dlls[] = { "kernel32", "api-ms-win-core-file", "api-ms-win-core-io", "ws2_32", "wsock32" };
+	BOOL patched = FALSE;
+	for (size_t n=0;n<sizeof(dlls)/sizeof(dlls[0]);n++)
+	{
+#define SLEEPY_SHIM_HOOK(func) \
+		if (sleepy_real_##func && sleepy_shim_patch_import(module, dlls[n], #func, (void *)sleepy_hook_##func)) \
+			patched = TRUE;
+		SLEEPY_SHIM_HOOK(ReadFile)
+		SLEEPY_SHIM_HOOK(WriteFile)
+		SLEEPY_SHIM_HOOK(FlushFileBuffers)
+		SLEEPY_SHIM_HOOK(GetQueuedCompletionStatus)
+		SLEEPY_SHIM_HOOK(GetQueuedCompletionStatusEx)
+		SLEEPY_SHIM_HOOK(recv)
+		SLEEPY_SHIM_HOOK(send)
+		SLEEPY_SHIM_HOOK(WSARecv)
+		SLEEPY_SHIM_HOOK(WSASend)
+		SLEEPY_SHIM_HOOK(select)
+		SLEEPY_SHIM_HOOK(WSAPoll)
+#undef SLEEPY_SHIM_HOOK
+	}
+	return patched;
+}
+
+extern "C" void sleepy_shim_region_begin(void)
+{
+	if (sleepy_shim_state == 2 || sleepy_shim_init())
+		InterlockedIncrement(&sleepy_shim_header->regions);
+}
+
+extern "C" void sleepy_shim_region_end(void)
+{
+	if (sleepy_shim_state == 2)
+		InterlockedDecrement(&sleepy_shim_header->regions);
+}
+
+extern "C" LONG sleepy_shim_tag(const char *name)
+{
+	if (!name || !name[0] || !(sleepy_shim_state == 2 || sleepy_shim_init()))
+		return 0;
+
+	SleepyShimHeader *header = sleepy_shim_header;
+	while (InterlockedCompareExchange(&header->tag_lock, 1, 0) != 0)
+		YieldProcessor();
+
+	// Tags are few and looked up once each, so a linear search will do.
+	LONG tag = 0;
+	LONG count = header->tag_count;
+	for (LONG n=0;n<count && !tag;n++)
+		if (strncmp(header->tag_names[n], name, SLEEPY_SHIM_TAG_LENGTH-1) == 0)
+			tag = n+1;
+
+	if (!tag && count < SLEEPY_SHIM_MAX_TAGS)
+	{
+		strncpy(header->tag_names[count], name, SLEEPY_SHIM_TAG_LENGTH-1);
+		header->tag_names[count][SLEEPY_SHIM_TAG_LENGTH-1] = 0;
+
+		// The profiler reads names without taking the lock.
+		MemoryBarrier();
+		header->tag_count = count+1;
+		tag = count+1;
+	}
+
+	InterlockedExchange(&header->tag_lock, 0);
+	return tag;
+}
+
+extern "C" void sleepy_shim_set_tag(LONG tag)
+{
+	SleepyShimTagSlot *slot = sleepy_shim_tag_slot;
+	if (!slot && tag)
+		slot = sleepy_shim_thread_slot();
+	if (slot)
+		slot->tag = tag;
+}
+
+#ifdef SLEEPY_SHIM_HOOK_IO
+static struct SleepyShimIoHooks
+{
+	SleepyShimIoHooks()
+	{
+		sleepy_shim_hook_io(GetModuleHandleW(NULL));
+	}
+} sleepy_shim_io_hooks;
+#endif // SLEEPY_SHIM_HOOK_IO
+
+#endif // SLEEPY_SHIM_IMPLEMENTATION
+
+#endif //__SLEEPYSHIM_H_666_
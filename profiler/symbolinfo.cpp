@@ -46,12 +46,20 @@ http://www.gnu.org/copyleft/gpl.html..
 #include <windows.h>
 #include <psapi.h>
 #include "../utils/dbginterface.h"
+#include "nativesymbols.h"
+#include "jitsymbols.h"
+#include "../utils/mythread.h"
 #include <iostream>
 #include <algorithm>
 #include <shlwapi.h>
+#include <shlobj.h>
 #include "../utils/except.h"
 #include "../appinfo.h"
 
+#ifndef SYMOPT_IGNORE_IMAGEDIR
+#define SYMOPT_IGNORE_IMAGEDIR 0x00200000
+#endif
+
 // tanjl:
 enum AttachMode
 {
@@ -158,7 +166,29 @@ BOOL CALLBACK EnumModules(
 	HMODULE hMod;
 	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, ModuleName, &hMod);
 
-	Module mod((PROFILER_ADDR)BaseOfDll, ModuleName, context->dbgHelp);
+	// Ask dbghelp how big the image is and where it came from, or failing
+	// that the loader.
+	PROFILER_ADDR size = 0;
+	std::wstring path;
+	IMAGEHLP_MODULEW64 info;
+	info.SizeOfStruct = sizeof(info);
+	MODULEINFO modinfo;
+	wchar_t filename[MAX_PATH];
+	if (context->dbgHelp->SymGetModuleInfoW64(context->syminfo->process_handle, BaseOfDll, &info))
+	{
+		size = info.ImageSize;
+		path = info.ImageName;
+	}
+	else
+	{
+		if (GetModuleInformation(context->syminfo->process_handle, (HMODULE)BaseOfDll, &modinfo, sizeof(modinfo)))
+			size = modinfo.SizeOfImage;
+		if (GetModuleFileNameExW(context->syminfo->process_handle, (HMODULE)BaseOfDll, filename, MAX_PATH))
+			path = filename;
+	}
+
+	Module mod((PROFILER_ADDR)BaseOfDll, size, ModuleName, context->dbgHelp);
+	mod.path = path;
 	context->syminfo->addModule(mod);
 
 	return TRUE;
@@ -166,8 +196,16 @@ BOOL CALLBACK EnumModules(
 
 
 SymbolInfo::SymbolInfo()
-:	process_handle(NULL)
+:	process_handle(NULL),
+	is64BitProcess(false),
+	addressOnly(false),
+	jit(NULL),
+	lastJitRefresh(0),
+	symcacheHits(0),
+	symcacheMisses(0)
 {
+	InitializeCriticalSection(&symcacheLock);
+	InitializeCriticalSection(&dbghelpLock);
 }
 
 BOOL CALLBACK symCallback(HANDLE WXUNUSED(hProcess), ULONG ActionCode, ULONG64 CallbackData, ULONG64 WXUNUSED(UserContext))
@@ -228,6 +266,13 @@ void SymbolInfo::loadSymbolsUsing(DbgHelp* dbgHelp, const std::wstring& sympath)
 
 	options |= SYMOPT_LOAD_LINES | SYMOPT_DEBUG;
 
+	// With an empty search path, this leaves dbghelp only the exports to
+	// read, which is as little as it will do.
+	if (addressOnly)
+		options |= SYMOPT_IGNORE_CVREC | SYMOPT_IGNORE_IMAGEDIR;
+	else
+		options &= ~(SYMOPT_IGNORE_CVREC | SYMOPT_IGNORE_IMAGEDIR);
+
 	dbgHelp->SymSetOptions(options);
 
 	if (dbgHelp->SymSetDbgPrint)
@@ -304,8 +349,6 @@ void SymbolInfo::loadSymbols(HANDLE process_handle_, bool download)
 {
 	process_handle = process_handle_;
 
-	wxBusyCursor busy;
-
 	is64BitProcess = Is64BitProcess(process_handle);
 
 	std::wstring sympath;
@@ -346,14 +389,186 @@ void SymbolInfo::loadSymbols(HANDLE process_handle_, bool download)
 		prefs.AdjustSymbolPath(sympath, download);
 	}
 
-	loadSymbolsUsing(&dbgHelpMs, sympath);
-	loadSymbolsUsing(getGccDbgHelp(), sympath);
+	if (addressOnly)
+	{
+		// Just the module list; symbols are for whoever opens the capture.
+		loadSymbolsUsing(&dbgHelpMs, std::wstring());
+	}
+	else
+	{
+		loadSymbolsUsing(&dbgHelpMs, sympath);
+		loadSymbolsUsing(getGccDbgHelp(), sympath);
+		loadNativeSymbols(sympath);
+
+		jit = new JitSymbols(GetProcessId(process_handle));
+		refreshJitSymbols();
+		if (g_symLog && jit->getCount())
+		{
+			wchar_t buf[64];
+			swprintf(buf, sizeof(buf)/sizeof(buf[0]), L"Read %u JIT symbols\n", (unsigned)jit->getCount());
+			g_symLog(buf);
+		}
+	}
 
 	if (g_symLog)
 		g_symLog(L"\nFinished.\n");
 	sortModules();
 }
 
+void SymbolInfo::getModuleRecords(std::vector<ModuleRecord>& out) const
+{
+	out.resize(modules.size());
+	for (size_t n=0;n<modules.size();n++)
+	{
+		const Module &mod = modules[n];
+		ModuleRecord &record = out[n];
+		record.base = mod.base_addr;
+		record.size = mod.end_addr - mod.base_addr;
+		record.name = mod.name;
+		record.path = mod.path;
+		record.identity = mod.path.empty() ? std::wstring() : NativeSymbols::getIdentity(mod.path);
+	}
+}
+
+void SymbolInfo::beginOffline(const std::wstring& sympath)
+{
+	// dbghelp only uses the handle as a key when it isn't asked to invade
+	// the process, so anything unique will do.
+	process_handle = (HANDLE)this;
+#ifdef _WIN64
+	is64BitProcess = true;
+#endif
+
+	if (!dbgHelpMs.Loaded)
+		return;
+
+	DWORD options = dbgHelpMs.SymGetOptions();
+	options |= SYMOPT_LOAD_LINES | SYMOPT_DEBUG;
+	options &= ~(SYMOPT_IGNORE_CVREC | SYMOPT_IGNORE_IMAGEDIR);
+	dbgHelpMs.SymSetOptions(options);
+
+	wenforce(dbgHelpMs.SymInitializeW(process_handle, sympath.c_str(), FALSE), "SymInitialize");
+	dbgHelpMs.SymRegisterCallbackW64(process_handle, symCallback, NULL);
+}
+
+bool SymbolInfo::addOfflineModule(const ModuleRecord& record, const std::vector<std::wstring>& searchDirs)
+{
+	if (!dbgHelpMs.Loaded || record.identity.empty())
+		return false;
+
+	std::wstring filename = record.path.substr(record.path.find_last_of(L"\\/") + 1);
+	std::vector<std::wstring> candidates;
+	candidates.push_back(record.path);
+	for (size_t n=0;n<searchDirs.size();n++)
+		candidates.push_back(searchDirs[n] + L"\\" + filename);
+
+	std::wstring image;
+	for (size_t n=0;n<candidates.size() && image.empty();n++)
+		if (NativeSymbols::getIdentity(candidates[n]) == record.identity)
+			image = candidates[n];
+
+	if (image.empty())
+	{
+		if (g_symLog)
+		{
+			g_symLog(L"No image of the same build found for ");
+			g_symLog(record.path.c_str());
+			g_symLog(L"\n");
+		}
+		return false;
+	}
+
+	SetLastError(0);
+	DWORD64 loaded = dbgHelpMs.SymLoadModuleExW(process_handle, NULL, image.c_str(), record.name.c_str(),
+		record.base, (DWORD)record.size, NULL, 0);
+	if (!loaded && GetLastError() != ERROR_SUCCESS)
+		return false;
+
+	Module mod(record.base, record.size, record.name, &dbgHelpMs);
+	mod.path = image;
+	loadNativeSymbols(mod, searchDirs, getSymbolIndexDir());
+	addModule(mod);
+	sortModules();
+
+	// Anything looked up in its range so far was unresolved.
+	symcache.clear();
+	symcacheOld.clear();
+	return true;
+}
+
+std::vector<std::wstring> SymbolInfo::getSearchDirs(const std::wstring& sympath)
+{
+	std::vector<std::wstring> searchDirs;
+	for (size_t start=0;start<sympath.size();)
+	{
+		size_t end = sympath.find(L';', start);
+		if (end == std::wstring::npos)
+			end = sympath.size();
+		std::wstring dir = sympath.substr(start, end - start);
+		if (!dir.empty() && dir.find(L'*') == std::wstring::npos)
+			searchDirs.push_back(dir);
+		start = end + 1;
+	}
+	return searchDirs;
+}
+
+std::wstring SymbolInfo::getSymbolIndexDir()
+{
+	wchar_t appdata[MAX_PATH];
+	if (FAILED(SHGetFolderPathW(NULL, CSIDL_LOCAL_APPDATA, NULL, SHGFP_TYPE_CURRENT, appdata)))
+		return std::wstring();
+
+	std::wstring dir = std::wstring(appdata) + L"\\" _T(APPNAME) L"\\SymbolIndex";
+	int err = SHCreateDirectoryExW(NULL, dir.c_str(), NULL);
+	if (err != ERROR_SUCCESS && err != ERROR_ALREADY_EXISTS)
+		return std::wstring();
+	return dir;
+}
+
+// Modules the MS dbghelp found no PDB for were most likely built with GCC
+// or Clang for MinGW. Read their COFF symbols and DWARF line tables
+// ourselves; that's quicker than going through the secondary dbghelp for
+// every lookup, and also works when it isn't installed.
+void SymbolInfo::loadNativeSymbols(const std::wstring& sympath)
+{
+	if (!dbgHelpMs.Loaded)
+		return;
+
+	// Decoded tables are kept in the symbol index for next time. Plain
+	// folders on the symbol path are searched for .gnu_debuglink files.
+	std::wstring indexDir = getSymbolIndexDir();
+	std::vector<std::wstring> searchDirs = getSearchDirs(sympath);
+
+	for (size_t n=0;n<modules.size();n++)
+		loadNativeSymbols(modules[n], searchDirs, indexDir);
+}
+
+void SymbolInfo::loadNativeSymbols(Module& mod, const std::vector<std::wstring>& searchDirs, const std::wstring& indexDir)
+{
+	IMAGEHLP_MODULEW64 info;
+	info.SizeOfStruct = sizeof(info);
+	if (!dbgHelpMs.SymGetModuleInfoW64(process_handle, mod.base_addr, &info))
+		return;
+	if (info.SymType == SymPdb || info.SymType == SymCv || info.SymType == SymDia || info.SymType == SymSym)
+		return;
+
+	NativeSymbols *native = NativeSymbols::load(info.LoadedImageName[0] ? info.LoadedImageName : info.ImageName,
+		searchDirs, indexDir);
+	if (!native)
+		return;
+	nativeSymbols.push_back(native);
+	mod.native = native;
+
+	if (g_symLog)
+	{
+		wchar_t buf[MAX_PATH + 64];
+		swprintf(buf, sizeof(buf)/sizeof(buf[0]), L"Read %u functions and %u lines from %s%s\n",
+			(unsigned)native->getFunctionCount(), (unsigned)native->getLineCount(), mod.name.c_str(),
+			native->isFromIndex() ? L" (indexed)" : L"");
+		g_symLog(buf);
+	}
+}
+
 DbgHelp* SymbolInfo::getGccDbgHelp()
 {
 	if (prefs.UseWine())
@@ -393,32 +608,52 @@ SymbolInfo::~SymbolInfo()
 
 		process_handle = NULL;
 	}
+
+	for (size_t n=0;n<nativeSymbols.size();n++)
+		delete nativeSymbols[n];
+	delete jit;
+
+	DeleteCriticalSection(&dbghelpLock);
+	DeleteCriticalSection(&symcacheLock);
 }
 
 Module *SymbolInfo::getModuleForAddr(PROFILER_ADDR addr)
 {
-	if(modules.empty())
+	if (moduleStarts.empty())
 		return NULL;
 
-	if(addr < modules[0].base_addr)
-		return NULL;
+	ptrdiff_t i = findInterval(&moduleStarts[0], moduleStarts.size(), addr);
+	return i >= 0 && addr < moduleEnds[i] ? &modules[i] : NULL;
+}
 
-	for(unsigned int i=1; i<modules.size(); ++i)
-		if(addr < modules[i].base_addr)
-			return &modules[i-1];
+Module *SymbolInfo::getModuleForAddr(PROFILER_ADDR addr, Module *&lastHit)
+{
+	if (lastHit && addr >= lastHit->base_addr && addr < lastHit->end_addr)
+		return lastHit;
 
-	//assign any addresses past the base of the last module to the last module.
-	//NOTE: this is not strictly correct, but without the sizes of the modules, a decent way of doing things.
-	return &modules[modules.size() - 1];
+	Module *mod = getModuleForAddr(addr);
+	if (mod)
+		lastHit = mod;
+	return mod;
 }
 
 const std::wstring SymbolInfo::getModuleNameForAddr(PROFILER_ADDR addr)
 {
+	if (isSyntheticAddr(addr))
+		return synthetics.at(addr - SYNTHETIC_ADDR_BASE).first;
+
 	Module *mod = getModuleForAddr(addr);
 	if (mod)
 		return mod->name;
-	else
-		return L"";
+
+	bool inJit = false;
+	if (jit)
+	{
+		EnterCriticalSection(&symcacheLock);
+		inJit = jit->contains(addr);
+		LeaveCriticalSection(&symcacheLock);
+	}
+	return inJit ? L"[jit]" : L"";
 }
 
 void SymbolInfo::addModule(const Module& module)
@@ -434,6 +669,21 @@ void SymbolInfo::sortModules()
 		}
 	};
 	std::sort(modules.begin(), modules.end(), Sorter());
+
+	// Images don't overlap, but don't let a bad size claim the next module.
+	// If we never found out how big a module is, it's assumed to run up to
+	// the next one, as it always was before we knew the sizes.
+	moduleStarts.resize(modules.size());
+	moduleEnds.resize(modules.size());
+	for (size_t n=0;n<modules.size();n++)
+	{
+		Module &mod = modules[n];
+		PROFILER_ADDR next = n+1 < modules.size() ? modules[n+1].base_addr : (PROFILER_ADDR)-1;
+		if (mod.end_addr <= mod.base_addr || mod.end_addr > next)
+			mod.end_addr = next;
+		moduleStarts[n] = mod.base_addr;
+		moduleEnds[n] = mod.end_addr;
+	}
 }
 
 const std::wstring SymbolInfo::getProcForAddr(PROFILER_ADDR addr,
@@ -442,9 +692,39 @@ const std::wstring SymbolInfo::getProcForAddr(PROFILER_ADDR addr,
 	procfilepath_out = L"";
 	proclinenum_out = 0;
 
+	if (isSyntheticAddr(addr))
+		return synthetics.at(addr - SYNTHETIC_ADDR_BASE).second;
+
+	// (Which also means no [kernel] frames, as there's no telling a
+	// system call stub from anything else.)
+	if (addressOnly)
+		return getUnresolvedName(addr);
+
 	Module *mod = getModuleForAddr(addr);
 	DbgHelp *dbgHelp = mod ? mod->dbghelp : &dbgHelpMs;
 
+	// Outside every module, it may be code a JIT wrote out a map for. If
+	// it's not in the map (yet), the JIT may have added it since we last
+	// looked. The map is shared with getTableSymbol, which only holds
+	// symcacheLock.
+	std::wstring jitName;
+	if (!mod && jit)
+	{
+		EnterCriticalSection(&symcacheLock);
+		bool found = jit->getProc(addr, jitName) ||
+			(GetTickCount() - lastJitRefresh >= JIT_REFRESH_MS && refreshJitSymbols() && jit->getProc(addr, jitName));
+		LeaveCriticalSection(&symcacheLock);
+		if (found)
+			return jitName;
+	}
+
+	std::wstring nativeName;
+	if (mod && mod->native && mod->native->getProc((DWORD)(addr - mod->base_addr), nativeName))
+	{
+		getLineForAddr(addr, procfilepath_out, proclinenum_out);
+		return nativeName;
+	}
+
 	unsigned char buffer[1024];
 
 	//blame MS for this abomination of a coding technique
@@ -456,18 +736,7 @@ const std::wstring SymbolInfo::getProcForAddr(PROFILER_ADDR addr,
 	BOOL result = dbgHelp->SymFromAddrW(process_handle, (DWORD64)addr, &displacement, symbol_info);
 
 	if(!result)
-	{
-		wchar_t buf[256];
-#if defined(_WIN64)
-		if(is64BitProcess)
-			swprintf(buf, 256, L"[%016llX]", addr);
-		else
-			swprintf(buf, 256, L"[%08X]", unsigned __int32(addr));
-#else
-		swprintf(buf, 256, L"[%08X]", addr);
-#endif
-		return buf;
-	}
+		return getUnresolvedName(addr);
 
 	//------------------------------------------------------------------------
 	//lookup proc file and line num
@@ -477,11 +746,38 @@ const std::wstring SymbolInfo::getProcForAddr(PROFILER_ADDR addr,
 	return symbol_info->Name;
 }
 
+std::wstring SymbolInfo::getUnresolvedName(PROFILER_ADDR addr) const
+{
+	wchar_t buf[256];
+#if defined(_WIN64)
+	if(is64BitProcess)
+		swprintf(buf, 256, L"[%016llX]", addr);
+	else
+		swprintf(buf, 256, L"[%08X]", unsigned __int32(addr));
+#else
+	swprintf(buf, 256, L"[%08X]", addr);
+#endif
+	return buf;
+}
+
+bool SymbolInfo::isUnresolvedName(const std::wstring& name)
+{
+	if (name.size() < 3 || name[0] != '[' || name[name.size()-1] != ']')
+		return false;
+	for (size_t n=1;n+1<name.size();n++)
+		if (!iswxdigit(name[n]))
+			return false;
+	return true;
+}
+
 void SymbolInfo::getLineForAddr(PROFILER_ADDR addr, std::wstring& filepath_out, int& linenum_out)
 {
 	Module *mod = getModuleForAddr(addr);
 	DbgHelp *dbgHelp = mod ? mod->dbghelp : &dbgHelpMs;
 
+	if (mod && mod->native && mod->native->getLine((DWORD)(addr - mod->base_addr), filepath_out, linenum_out))
+		return;
+
 	DWORD displacement;
 	IMAGEHLP_LINEW64 lineinfo;
 	ZeroMemory(&lineinfo, sizeof(lineinfo));
@@ -500,6 +796,415 @@ void SymbolInfo::getLineForAddr(PROFILER_ADDR addr, std::wstring& filepath_out,
 	}
 }
 
+void SymbolInfo::getSymbol(PROFILER_ADDR addr, ResolvedSymbol& out)
+{
+	EnterCriticalSection(&symcacheLock);
+
+	bool hit = true;
+	auto i = symcache.find(addr);
+	if (i != symcache.end())
+	{
+		out = i->second;
+		symcacheHits++;
+	}
+	else if ((i = symcacheOld.find(addr)) != symcacheOld.end())
+	{
+		out = i->second;
+		symcacheHits++;
+		cacheSymbol(addr, out);
+	}
+	else
+		hit = false;
+
+	LeaveCriticalSection(&symcacheLock);
+	if (hit)
+		return;
+
+	// A lookup can take seconds if symbols are being downloaded, so other
+	// threads carry on using the cache meanwhile. Two threads missing on
+	// the same address both resolve it, to the same answer.
+	EnterCriticalSection(&dbghelpLock);
+	out.proc = getProcForAddr(addr, out.file, out.line);
+	out.module = getModuleNameForAddr(addr);
+	LeaveCriticalSection(&dbghelpLock);
+
+	EnterCriticalSection(&symcacheLock);
+	symcacheMisses++;
+	cacheSymbol(addr, out);
+	LeaveCriticalSection(&symcacheLock);
+}
+
+bool SymbolInfo::getTableSymbol(PROFILER_ADDR addr, ResolvedSymbol& out)
+{
+	if (isSyntheticAddr(addr) || addressOnly)
+		return false;
+
+	EnterCriticalSection(&symcacheLock);
+
+	bool found = true;
+	auto i = symcache.find(addr);
+	if (i != symcache.end())
+	{
+		out = i->second;
+		symcacheHits++;
+	}
+	else if ((i = symcacheOld.find(addr)) != symcacheOld.end())
+	{
+		out = i->second;
+		symcacheHits++;
+		cacheSymbol(addr, out);
+	}
+	else
+	{
+		// Same answers, and the same test for a complete one, as the
+		// native and JIT paths of getProcForAddr and getSymbols.
+		found = false;
+		Module *mod = getModuleForAddr(addr);
+		if (mod && mod->native)
+		{
+			DWORD rva = (DWORD)(addr - mod->base_addr);
+			std::wstring name, file;
+			int line;
+			mod->native->getSymbols(&rva, 1, &name, &file, &line);
+			if (!name.empty() && !file.empty())
+			{
+				out.module = mod->name;
+				out.proc.swap(name);
+				out.file.swap(file);
+				out.line = line;
+				found = true;
+			}
+		}
+		else if (!mod && jit)
+		{
+			std::wstring name;
+			if (jit->getProc(addr, name) ||
+				(GetTickCount() - lastJitRefresh >= JIT_REFRESH_MS && refreshJitSymbols() && jit->getProc(addr, name)))
+			{
+				out.module = L"[jit]";
+				out.proc.swap(name);
+				out.file.clear();
+				out.line = 0;
+				found = true;
+			}
+		}
+
+		if (found)
+		{
+			symcacheMisses++;
+			cacheSymbol(addr, out);
+		}
+	}
+
+	LeaveCriticalSection(&symcacheLock);
+	return found;
+}
+
+namespace
+{
+	// One module's share of a getSymbols batch: indices into the batch,
+	// sorted by address. Anything its native symbols don't fully answer
+	// is left in 'retry' for the dbghelp pass.
+	struct SymbolJob
+	{
+		Module *mod;
+		std::vector<size_t> indices;
+		std::vector<size_t> retry;
+	};
+
+	struct SymbolBatch
+	{
+		const std::vector<PROFILER_ADDR> *addrs;
+		std::vector<ResolvedSymbol> *out;
+		std::vector<SymbolJob> jobs;
+		volatile LONG nextJob;
+		volatile LONG done;
+		volatile LONG workersLeft;
+		volatile bool cancelled;
+		HANDLE finished;
+
+		void work()
+		{
+			std::vector<DWORD> rvas;
+			std::vector<std::wstring> names, files;
+			std::vector<int> lines;
+
+			for (;;)
+			{
+				LONG n = InterlockedIncrement(&nextJob) - 1;
+				if (n >= (LONG)jobs.size() || cancelled)
+					break;
+
+				SymbolJob &job = jobs[n];
+				size_t count = job.indices.size();
+				rvas.resize(count);
+				names.resize(count);
+				files.resize(count);
+				lines.resize(count);
+				for (size_t i=0;i<count;i++)
+					rvas[i] = (DWORD)((*addrs)[job.indices[i]] - job.mod->base_addr);
+
+				job.mod->native->getSymbols(&rvas[0], count, &names[0], &files[0], &lines[0]);
+
+				LONG resolved = 0;
+				for (size_t i=0;i<count;i++)
+				{
+					if (names[i].empty() || files[i].empty())
+					{
+						job.retry.push_back(job.indices[i]);
+						continue;
+					}
+					ResolvedSymbol &sym = (*out)[job.indices[i]];
+					sym.module = job.mod->name;
+					sym.proc.swap(names[i]);
+					sym.file.swap(files[i]);
+					sym.line = lines[i];
+					resolved++;
+				}
+				InterlockedExchangeAdd(&done, resolved);
+			}
+		}
+	};
+
+	class SymbolWorker : public MyThread
+	{
+	public:
+		SymbolWorker(SymbolBatch *batch_) : batch(batch_) {}
+
+		virtual void run()
+		{
+			batch->work();
+			if (InterlockedDecrement(&batch->workersLeft) == 0)
+				SetEvent(batch->finished);
+		}
+
+	private:
+		SymbolBatch *batch;
+	};
+}
+
+bool SymbolInfo::getSymbols(const std::vector<PROFILER_ADDR>& addrs, std::vector<ResolvedSymbol>& out,
+	SymbolProgressFn *progress, void *context)
+{
+	out.resize(addrs.size());
+
+	SymbolBatch batch;
+	batch.addrs = &addrs;
+	batch.out = &out;
+	batch.nextJob = 0;
+	batch.done = 0;
+	batch.workersLeft = 0;
+	batch.cancelled = false;
+	batch.finished = NULL;
+
+	// Answer what we can from the cache, and split the rest into a job per
+	// module with native symbols plus a list for dbghelp.
+	std::vector<size_t> serial;
+	std::vector<bool> cached(addrs.size(), false);
+	size_t hits = 0;
+	{
+		std::map<Module *, size_t> jobIndex;
+		EnterCriticalSection(&symcacheLock);
+
+		// Pick up whatever JIT code was written out since.
+		if (jit)
+			refreshJitSymbols();
+		for (size_t n=0;n<addrs.size();n++)
+		{
+			PROFILER_ADDR addr = addrs[n];
+			auto i = symcache.find(addr);
+			if (i != symcache.end() || (i = symcacheOld.find(addr)) != symcacheOld.end())
+			{
+				out[n] = i->second;
+				cached[n] = true;
+				hits++;
+				continue;
+			}
+
+			Module *mod = getModuleForAddr(addr);
+			if (!mod || !mod->native)
+			{
+				serial.push_back(n);
+				continue;
+			}
+
+			auto j = jobIndex.find(mod);
+			if (j == jobIndex.end())
+			{
+				j = jobIndex.insert(std::make_pair(mod, batch.jobs.size())).first;
+				batch.jobs.push_back(SymbolJob());
+				batch.jobs.back().mod = mod;
+			}
+			batch.jobs[j->second].indices.push_back(n);
+		}
+		symcacheHits += hits;
+		LeaveCriticalSection(&symcacheLock);
+	}
+
+	for (size_t n=0;n<batch.jobs.size();n++)
+	{
+		std::vector<size_t> &indices = batch.jobs[n].indices;
+		std::sort(indices.begin(), indices.end(), [&addrs](size_t a, size_t b) { return addrs[a] < addrs[b]; });
+	}
+
+	// Leave a core for this thread, which is busy with dbghelp meanwhile.
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+	size_t numWorkers = std::min<size_t>(batch.jobs.size(), std::max<DWORD>(sysinfo.dwNumberOfProcessors, 2) - 1);
+	if (numWorkers)
+	{
+		batch.finished = CreateEvent(NULL, TRUE, FALSE, NULL);
+		batch.workersLeft = (LONG)numWorkers;
+		for (size_t n=0;n<numWorkers;n++)
+			(new SymbolWorker(&batch))->launch(true, THREAD_PRIORITY_NORMAL);
+	}
+
+	// Waits for the workers, and says whether the batch was abandoned.
+	bool cancelled = false;
+	size_t serialDone = hits;
+	auto finishWorkers = [&]() {
+		while (batch.finished && WaitForSingleObject(batch.finished, 50) == WAIT_TIMEOUT)
+		{
+			if (!batch.cancelled && progress && progress(context, serialDone + batch.done))
+				batch.cancelled = true;
+		}
+		if (batch.finished)
+		{
+			CloseHandle(batch.finished);
+			batch.finished = NULL;
+		}
+		cancelled = cancelled || batch.cancelled;
+	};
+
+	for (size_t n=0;n<serial.size() && !cancelled;n++)
+	{
+		getSymbol(addrs[serial[n]], out[serial[n]]);
+		cached[serial[n]] = true;
+		serialDone++;
+		if (progress && progress(context, serialDone + batch.done))
+			cancelled = batch.cancelled = true;
+	}
+	finishWorkers();
+
+	// Then whatever the native symbols couldn't answer.
+	for (size_t j=0;j<batch.jobs.size() && !cancelled;j++)
+	{
+		const std::vector<size_t> &retry = batch.jobs[j].retry;
+		for (size_t n=0;n<retry.size() && !cancelled;n++)
+		{
+			getSymbol(addrs[retry[n]], out[retry[n]]);
+			cached[retry[n]] = true;
+			serialDone++;
+			if (progress && progress(context, serialDone + batch.done))
+				cancelled = true;
+		}
+	}
+	if (cancelled)
+		return false;
+
+	EnterCriticalSection(&symcacheLock);
+	for (size_t n=0;n<addrs.size();n++)
+	{
+		if (!cached[n])
+		{
+			cacheSymbol(addrs[n], out[n]);
+			symcacheMisses++;
+		}
+	}
+	LeaveCriticalSection(&symcacheLock);
+	return true;
+}
+
+bool SymbolInfo::refreshJitSymbols()
+{
+	lastJitRefresh = GetTickCount();
+	bool replaced;
+	if (!jit->refresh(&replaced))
+		return false;
+
+	// Addresses the new entries cover may have been cached unresolved, or,
+	// if they replaced code, under the old code's name. Nothing inside a
+	// module is affected.
+	uncacheSymbols(jitMisses);
+	if (replaced)
+		uncacheSymbols(jitHits);
+	return true;
+}
+
+void SymbolInfo::cacheSymbol(PROFILER_ADDR addr, const ResolvedSymbol& sym)
+{
+	if (symcache.size() >= SYMCACHE_GENERATION)
+	{
+		symcacheOld.swap(symcache);
+		symcache.clear();
+
+		// Stop tracking the addresses that generation took with it.
+		std::unordered_set<PROFILER_ADDR> *tracked[] = { &jitMisses, &jitHits };
+		for (size_t t=0;t<_countof(tracked);t++)
+		{
+			for (auto i = tracked[t]->begin(); i != tracked[t]->end(); )
+				i = symcacheOld.count(*i) ? std::next(i) : tracked[t]->erase(i);
+		}
+	}
+	symcache[addr] = sym;
+
+	if (jit && !isSyntheticAddr(addr))
+	{
+		if (sym.module.empty())
+			jitMisses.insert(addr);
+		else if (sym.module == L"[jit]")
+			jitHits.insert(addr);
+	}
+}
+
+void SymbolInfo::uncacheSymbols(std::unordered_set<PROFILER_ADDR>& addrs)
+{
+	for (auto i = addrs.begin(); i != addrs.end(); ++i)
+	{
+		symcache.erase(*i);
+		symcacheOld.erase(*i);
+	}
+	addrs.clear();
+}
+
+PROFILER_ADDR SymbolInfo::getSyntheticAddr(const std::wstring& module, const std::wstring& name)
+{
+	std::pair<std::wstring, std::wstring> key(module, name);
+	auto i = syntheticmap.find(key);
+	if (i != syntheticmap.end())
+		return i->second;
+
+	if (synthetics.size() > 0xFFFF)
+		throw ProfilerExcep(L"Too many synthetic frames");
+
+	PROFILER_ADDR addr = SYNTHETIC_ADDR_BASE + (PROFILER_ADDR)synthetics.size();
+	synthetics.push_back(key);
+	syntheticmap[key] = addr;
+	return addr;
+}
+
+PROFILER_ADDR SymbolInfo::getKernelFrameAddr(PROFILER_ADDR ip)
+{
+	auto i = kernelframes.find(ip);
+	if (i != kernelframes.end())
+		return i->second;
+
+	// Stubs are always in a module. Not looking any further also keeps the
+	// sampler off the JIT maps, which the background symbolizer reads.
+	PROFILER_ADDR addr = 0;
+	if (getModuleForAddr(ip))
+	{
+		std::wstring file;
+		int line;
+		std::wstring name = getProcForAddr(ip, file, line);
+
+		if (name.compare(0, 2, L"Nt") == 0 || name.compare(0, 2, L"Zw") == 0)
+			addr = getSyntheticAddr(L"[kernel]", name);
+	}
+	kernelframes[ip] = addr;
+	return addr;
+}
+
 std::wstring SymbolInfo::saveMinidump()
 {
 #ifdef _WIN64
@@ -28,24 +28,74 @@ http://www.gnu.org/copyleft/gpl.html..
 #include <string>
 #include <windows.h>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include "profiler.h"
 
 typedef void SymLogFn(const wchar_t *text);
 
 struct DbgHelp;
+class NativeSymbols;
+class JitSymbols;
+
+/// Index of the last of count sorted interval starts at or below addr, or
+/// -1 if there is none; whether addr is also before that interval's end is
+/// for the caller to check. The loop always runs log2(count) times and the
+/// select compiles to a conditional move, so there's nothing for the branch
+/// predictor to get wrong.
+inline ptrdiff_t findInterval(const PROFILER_ADDR *starts, size_t count, PROFILER_ADDR addr)
+{
+	if (!count || addr < starts[0])
+		return -1;
+
+	const PROFILER_ADDR *first = starts;
+	while (count > 1)
+	{
+		size_t half = count / 2;
+		first = first[half] <= addr ? first + half : first;
+		count -= half;
+	}
+	return first - starts;
+}
 
 class Module
 {
 public:
-	Module(PROFILER_ADDR base_addr_, const std::wstring& name_, DbgHelp *dbghelp_)
+	Module(PROFILER_ADDR base_addr_, PROFILER_ADDR size_, const std::wstring& name_, DbgHelp *dbghelp_)
 	{
 		base_addr = base_addr_;
+		end_addr = base_addr_ + size_;
 		name = name_;
 		dbghelp = dbghelp_;
+		native = NULL;
 	}
 	PROFILER_ADDR base_addr;
+	PROFILER_ADDR end_addr;		// one past the image; base_addr if the size wasn't known
 	std::wstring name;
+	std::wstring path;			// of the image, if known
 	DbgHelp *dbghelp;
+	NativeSymbols *native;		// names/lines we read ourselves, tried before dbghelp
+};
+
+/// What an address resolves to.
+struct ResolvedSymbol
+{
+	std::wstring module;
+	std::wstring proc;
+	std::wstring file;
+	int line;
+};
+
+/// A module as a capture records it (in Modules.txt), so its addresses can
+/// be resolved later, possibly on another machine. identity is as given by
+/// NativeSymbols::getIdentity.
+struct ModuleRecord
+{
+	PROFILER_ADDR base, size;
+	std::wstring identity;
+	std::wstring name;
+	std::wstring path;
 };
 
 /*=====================================================================
@@ -60,19 +110,136 @@ public:
 	~SymbolInfo();
 
 	void loadSymbols(HANDLE process_handle, bool download);//throws SymbolInfoExcep
+
+	/// In address-only mode, loadSymbols only lists the modules and no
+	/// symbols are read: every address comes back unresolved, as
+	/// getUnresolvedName, for the capture's Modules.txt to be resolved
+	/// against later. Set before loadSymbols.
+	void setAddressOnly(bool addressOnly_) { addressOnly = addressOnly_; }
+	bool isAddressOnly() const { return addressOnly; }
+
+	/// The loaded modules, as a capture records them.
+	void getModuleRecords(std::vector<ModuleRecord>& out) const;
+
+	/// For resolving a capture's addresses rather than a live process's:
+	/// beginOffline instead of loadSymbols, then addOfflineModule for each
+	/// module wanted. The image is looked for at the recorded path and then
+	/// in searchDirs, and only used if it is the same build; its symbols
+	/// are then found as loadSymbols would. Returns false if it wasn't.
+	void beginOffline(const std::wstring& sympath);//throws SymbolInfoExcep
+	bool addOfflineModule(const ModuleRecord& record, const std::vector<std::wstring>& searchDirs);
+
+	/// What getProcForAddr gives for an address it can't resolve.
+	std::wstring getUnresolvedName(PROFILER_ADDR addr) const;
+	static bool isUnresolvedName(const std::wstring& name);
+
+	/// The plain folders in a symbol path; symbol server and cache entries
+	/// are skipped.
+	static std::vector<std::wstring> getSearchDirs(const std::wstring& sympath);
 	std::wstring saveMinidump();
 
+	/// The module addr is in, or NULL if it's in none (JIT code, other
+	/// anonymous memory). The second form first tries lastHit, the module
+	/// the caller's previous lookup found, and updates it; neighbouring
+	/// frames are usually in the same module. Each sampler keeps its own,
+	/// so it needs no locking.
 	Module *getModuleForAddr(PROFILER_ADDR addr);
+	Module *getModuleForAddr(PROFILER_ADDR addr, Module *&lastHit);
 	const std::wstring getModuleNameForAddr(PROFILER_ADDR addr);
 	const std::wstring getProcForAddr(PROFILER_ADDR addr, std::wstring& procfilepath_out, int& proclinenum_out);
 
 	void getLineForAddr(PROFILER_ADDR addr, std::wstring& filepath_out, int& linenum_out);
 
+	/// Resolves addr through a cache shared by everything symbolizing this
+	/// process (the capture, the thread list, ...), so frames that keep
+	/// turning up only go to dbghelp once. Safe to call from any thread,
+	/// though dbghelp isn't, so not while a capture is walking stacks.
+	void getSymbol(PROFILER_ADDR addr, ResolvedSymbol& out);
+
+	/// Resolves addrs[n] into out[n] as getSymbol would, but in bulk: the
+	/// addresses are grouped by module and sorted, and modules we have
+	/// native symbols for are each resolved in one sweep over their tables,
+	/// several at a time on worker threads. dbghelp isn't thread safe, so
+	/// everything else goes through it one at a time on this thread.
+	/// progress is called on this thread now and then with the number of
+	/// addresses done; if it returns true the batch is abandoned and
+	/// getSymbols returns false.
+	typedef bool SymbolProgressFn(void *context, size_t done);
+	bool getSymbols(const std::vector<PROFILER_ADDR>& addrs, std::vector<ResolvedSymbol>& out,
+		SymbolProgressFn *progress, void *context);
+
+	/// Resolves addr as getSymbol would, but only from the cache, native
+	/// symbols and JIT maps. It never calls dbghelp, so a stack walk can
+	/// use dbghelp meanwhile without a lock, and it never holds the cache
+	/// lock for long. Returns false if addr needs dbghelp (or is synthetic).
+	bool getTableSymbol(PROFILER_ADDR addr, ResolvedSymbol& out);
+
+	/// getSymbol calls answered from the cache, and those that weren't.
+	LONGLONG getSymbolCacheHits() const { return symcacheHits; }
+	LONGLONG getSymbolCacheMisses() const { return symcacheMisses; }
+
+	/// Synthetic frames stand for things that aren't code (a syscall, the
+	/// kernel, a truncated stack...) but are put in callstacks so the usual
+	/// views attribute time to them. They are handed out from the top 64K of
+	/// the address space, which is never mapped in user mode.
+	static const PROFILER_ADDR SYNTHETIC_ADDR_BASE = (PROFILER_ADDR)-1 - 0xFFFF;
+	PROFILER_ADDR getSyntheticAddr(const std::wstring& module, const std::wstring& name);
+	static bool isSyntheticAddr(PROFILER_ADDR addr) { return addr >= SYNTHETIC_ADDR_BASE; }
+
+	/// Synthetic '[kernel]' frame for a thread stopped in a system call stub,
+	/// named after the stub (e.g. NtWaitForSingleObject). Returns 0 if ip
+	/// isn't in an Nt/Zw stub. Cached per ip.
+	PROFILER_ADDR getKernelFrameAddr(PROFILER_ADDR ip);
+
+	/// Where decoded native symbols are cached between runs, keyed by
+	/// module build (see NativeSymbols). Created if need be; empty if it
+	/// can't be.
+	static std::wstring getSymbolIndexDir();
+
 	HANDLE process_handle;
 
 private:
 	std::vector<Module> modules;
 	bool is64BitProcess;
+	bool addressOnly;
+
+	// [start, end) of each module, in the same (sorted) order as modules;
+	// kept apart so the search only touches these.
+	std::vector<PROFILER_ADDR> moduleStarts, moduleEnds;
+
+	// module/name of each synthetic frame, indexed by addr - SYNTHETIC_ADDR_BASE
+	std::vector<std::pair<std::wstring, std::wstring> > synthetics;
+	std::map<std::pair<std::wstring, std::wstring>, PROFILER_ADDR> syntheticmap;
+	std::map<PROFILER_ADDR, PROFILER_ADDR> kernelframes;
+
+	// owned; modules point into this
+	std::vector<NativeSymbols *> nativeSymbols;
+
+	// Code the target's JIT(s) described in perf map or jitdump files.
+	// Re-read when an address outside the modules isn't found in it, at
+	// most every JIT_REFRESH_MS, and before each getSymbols batch. Only
+	// used under symcacheLock, as a refresh uncaches what it changes.
+	static const DWORD JIT_REFRESH_MS = 1000;
+	JitSymbols *jit;
+	DWORD lastJitRefresh;
+	bool refreshJitSymbols();
+
+	// The symbol cache keeps two generations. A hit in the old one moves
+	// the entry to the new one, and when the new one is full the old one is
+	// dropped; so it stays bounded and whatever is still being looked up
+	// survives. symcacheLock is only held to look up and insert; the
+	// dbghelp calls behind a miss are serialized by dbghelpLock instead.
+	static const size_t SYMCACHE_GENERATION = 32768;
+	std::unordered_map<PROFILER_ADDR, ResolvedSymbol> symcache, symcacheOld;
+	CRITICAL_SECTION symcacheLock, dbghelpLock;
+	LONGLONG symcacheHits, symcacheMisses;
+
+	// Cached addresses outside every module, which are all new JIT entries
+	// can change: those left unresolved, and those named by the JIT.
+	std::unordered_set<PROFILER_ADDR> jitMisses, jitHits;
+
+	void cacheSymbol(PROFILER_ADDR addr, const ResolvedSymbol& sym);
+	void uncacheSymbols(std::unordered_set<PROFILER_ADDR>& addrs);
 
 	void addModule(const Module& module);
 	void sortModules();
@@ -80,6 +247,8 @@ private:
 	friend BOOL CALLBACK EnumModules(PCWSTR ModuleName, DWORD64 BaseOfDll, PVOID UserContext);
 	void loadSymbolsUsing(DbgHelp* dbgHelp, const std::wstring& sympath);//throws SymbolInfoExcep
 	DbgHelp* getGccDbgHelp();
+	void loadNativeSymbols(const std::wstring& sympath);
+	void loadNativeSymbols(Module& mod, const std::vector<std::wstring>& searchDirs, const std::wstring& indexDir);
 };
 
 extern SymLogFn *g_symLog;
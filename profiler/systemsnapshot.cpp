@@ -0,0 +1,186 @@
+/*=====================================================================
+systemsnapshot.cpp
+------------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#include "systemsnapshot.h"
+
+#include <winternl.h>
+#include <algorithm>
+
+// The public winternl.h only declares a cut-down version of these,
+// so spell out the parts we need.
+namespace
+{
+	struct SYSTEM_THREAD_INFO
+	{
+		LARGE_INTEGER KernelTime;
+		LARGE_INTEGER UserTime;
+		LARGE_INTEGER CreateTime;
+		ULONG WaitTime;
+		PVOID StartAddress;
+		CLIENT_ID ClientId;
+		LONG Priority;
+		LONG BasePriority;
+		ULONG ContextSwitches;
+		ULONG ThreadState;
+		ULONG WaitReason;
+	};
+
+	struct SYSTEM_PROCESS_INFO
+	{
+		ULONG NextEntryOffset;
+		ULONG NumberOfThreads;
+		LARGE_INTEGER WorkingSetPrivateSize;
+		ULONG HardFaultCount;
+		ULONG NumberOfThreadsHighWatermark;
+		ULONGLONG CycleTime;
+		LARGE_INTEGER CreateTime;
+		LARGE_INTEGER UserTime;
+		LARGE_INTEGER KernelTime;
+		UNICODE_STRING ImageName;
+		LONG BasePriority;
+		HANDLE UniqueProcessId;
+		HANDLE InheritedFromUniqueProcessId;
+		ULONG HandleCount;
+		ULONG SessionId;
+		ULONG_PTR UniqueProcessKey;
+		SIZE_T PeakVirtualSize;
+		SIZE_T VirtualSize;
+		ULONG PageFaultCount;
+		SIZE_T PeakWorkingSetSize;
+		SIZE_T WorkingSetSize;
+		SIZE_T QuotaPeakPagedPoolUsage;
+		SIZE_T QuotaPagedPoolUsage;
+		SIZE_T QuotaPeakNonPagedPoolUsage;
+		SIZE_T QuotaNonPagedPoolUsage;
+		SIZE_T PagefileUsage;
+		SIZE_T PeakPagefileUsage;
+		SIZE_T PrivatePageCount;
+		LARGE_INTEGER ReadOperationCount;
+		LARGE_INTEGER WriteOperationCount;
+		LARGE_INTEGER OtherOperationCount;
+		LARGE_INTEGER ReadTransferCount;
+		LARGE_INTEGER WriteTransferCount;
+		LARGE_INTEGER OtherTransferCount;
+		SYSTEM_THREAD_INFO Threads[1];
+	};
+
+	typedef LONG (WINAPI *NtQuerySystemInformationFn)(ULONG, PVOID, ULONG, PULONG);
+
+	const ULONG SystemProcessInformationClass = 5;
+	const LONG STATUS_INFO_LENGTH_MISMATCH_ = (LONG)0xC0000004;
+}
+
+static NtQuerySystemInformationFn NtQuerySystemInformationPtr = (NtQuerySystemInformationFn)
+	GetProcAddress(GetModuleHandle(L"ntdll.dll"), "NtQuerySystemInformation");
+
+const ThreadCounters *ProcessCounters::findThread(DWORD thread_id) const
+{
+	for (size_t n=0;n<threads.size();n++)
+		if (threads[n].id == thread_id)
+			return &threads[n];
+	return NULL;
+}
+
+SystemSnapshot::SystemSnapshot()
+:	buffer(256*1024)
+{
+}
+
+SystemSnapshot::~SystemSnapshot()
+{
+}
+
+bool SystemSnapshot::take()
+{
+	if (!NtQuerySystemInformationPtr)
+	{
+		processes.clear();
+		return false;
+	}
+
+	for (;;)
+	{
+		ULONG needed = 0;
+		LONG status = NtQuerySystemInformationPtr(SystemProcessInformationClass, &buffer[0], (ULONG)buffer.size(), &needed);
+		if (status == STATUS_INFO_LENGTH_MISMATCH_)
+		{
+			// Leave some headroom, the process list can grow between calls.
+			buffer.resize(std::max<size_t>(needed, buffer.size()) * 3 / 2);
+			continue;
+		}
+		if (status < 0)
+		{
+			processes.clear();
+			return false;
+		}
+		break;
+	}
+
+	// Reuse the ProcessCounters (and their thread vectors) from the
+	// previous snapshot where possible.
+	size_t numProcesses = 0;
+	const BYTE *p = &buffer[0];
+	for (;;)
+	{
+		const SYSTEM_PROCESS_INFO *info = (const SYSTEM_PROCESS_INFO *)p;
+
+		if (numProcesses == processes.size())
+			processes.push_back(ProcessCounters());
+		ProcessCounters &proc = processes[numProcesses++];
+
+		proc.id = (DWORD)(ULONG_PTR)info->UniqueProcessId;
+		proc.imageName.assign(info->ImageName.Buffer ? info->ImageName.Buffer : L"",
+			info->ImageName.Length / sizeof(wchar_t));
+		proc.pageFaultCount = info->PageFaultCount;
+		proc.hardFaultCount = info->HardFaultCount;
+		proc.kernelTime = info->KernelTime.QuadPart;
+		proc.userTime = info->UserTime.QuadPart;
+
+		proc.threads.resize(info->NumberOfThreads);
+		for (ULONG n=0;n<info->NumberOfThreads;n++)
+		{
+			const SYSTEM_THREAD_INFO &src = info->Threads[n];
+			ThreadCounters &dst = proc.threads[n];
+			dst.id = (DWORD)(ULONG_PTR)src.ClientId.UniqueThread;
+			dst.kernelTime = src.KernelTime.QuadPart;
+			dst.userTime = src.UserTime.QuadPart;
+			dst.contextSwitches = src.ContextSwitches;
+			dst.state = src.ThreadState;
+			dst.waitReason = src.WaitReason;
+		}
+
+		if (!info->NextEntryOffset)
+			break;
+		p += info->NextEntryOffset;
+	}
+
+	processes.resize(numProcesses);
+	return true;
+}
+
+const ProcessCounters *SystemSnapshot::findProcess(DWORD process_id) const
+{
+	for (size_t n=0;n<processes.size();n++)
+		if (processes[n].id == process_id)
+			return &processes[n];
+	return NULL;
+}
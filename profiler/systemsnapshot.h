@@ -0,0 +1,79 @@
+/*=====================================================================
+systemsnapshot.h
+----------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#ifndef __SYSTEMSNAPSHOT_H_666_
+#define __SYSTEMSNAPSHOT_H_666_
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+/// Per-thread counters, as reported by the kernel.
+struct ThreadCounters
+{
+	DWORD id;
+	ULONGLONG kernelTime, userTime;	// 100ns units
+	ULONG contextSwitches;
+	ULONG state;					// KTHREAD_STATE; 5 = waiting
+	ULONG waitReason;				// KWAIT_REASON, when waiting
+};
+
+/// Per-process counters, as reported by the kernel.
+struct ProcessCounters
+{
+	DWORD id;
+	std::wstring imageName;
+	ULONG pageFaultCount;
+	ULONG hardFaultCount;			// zero before Windows 7
+	ULONGLONG kernelTime, userTime;	// 100ns units
+	std::vector<ThreadCounters> threads;
+
+	const ThreadCounters *findThread(DWORD thread_id) const;
+};
+
+/*=====================================================================
+SystemSnapshot
+--------------
+Counters for every process and thread on the system, read with a single
+NtQuerySystemInformation(SystemProcessInformation) call rather than one
+handle and query per thread. The buffers are kept between calls to take(),
+so taking a snapshot every sample doesn't allocate once warmed up.
+=====================================================================*/
+class SystemSnapshot
+{
+public:
+	SystemSnapshot();
+	~SystemSnapshot();
+
+	/// Refreshes the snapshot. Returns false if the query failed,
+	/// in which case the previous contents are discarded.
+	bool take();
+
+	const std::vector<ProcessCounters> &getProcesses() const { return processes; }
+	const ProcessCounters *findProcess(DWORD process_id) const;
+
+private:
+	std::vector<BYTE> buffer;
+	std::vector<ProcessCounters> processes;
+};
+
+#endif //__SYSTEMSNAPSHOT_H_666_
@@ -54,6 +54,7 @@ static bool dbgHelpTryLoad(LPCWSTR name, DbgHelp* dest)
 	IMPORT(SymLoadModuleExW);
 	IMPORT(SymSetDbgPrint); // Custom Wine extension
 	IMPORT(MiniDumpWriteDump);
+	IMPORT(UnDecorateSymbolNameW);
 	dest->Loaded = true;
 	return true;
 }
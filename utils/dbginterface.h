@@ -155,6 +155,14 @@ struct DbgHelp
 		__in_opt PMINIDUMP_CALLBACK_INFORMATION CallbackParam
 		);
 
+	DWORD
+	(WINAPI *UnDecorateSymbolNameW)(
+		__in PCWSTR name,
+		__out_ecount(maxStringLength) PWSTR outputString,
+		__in DWORD maxStringLength,
+		__in DWORD flags
+		);
+
 	LPCWSTR Name;
 	bool Loaded;
 	DbgHelp() : Loaded(false) {}
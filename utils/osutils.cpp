@@ -24,6 +24,7 @@ http://www.gnu.org/copyleft/gpl.html.
 
 #include "osutils.h"
 #include "WoW64.h"
+#include <stdio.h>
 
 static bool is64BitOS = false;
 static bool is64BitProfiler = false;
@@ -125,6 +126,67 @@ bool CanProfileProcess(HANDLE hProcess)
 	return true;
 }
 
+bool ParseProcessorList(const std::wstring &cpus, GROUP_AFFINITY *affinity, std::wstring *error)
+{
+	ZeroMemory(affinity, sizeof(*affinity));
+	bool haveGroup = false;
+
+	size_t pos = 0;
+	while (pos <= cpus.size())
+	{
+		size_t end = cpus.find(L',', pos);
+		if (end == std::wstring::npos)
+			end = cpus.size();
+		std::wstring range = cpus.substr(pos, end - pos);
+		pos = end + 1;
+
+		unsigned first, last;
+		wchar_t extra;
+		if (swscanf(range.c_str(), L"%u-%u%c", &first, &last, &extra) != 2)
+		{
+			if (swscanf(range.c_str(), L"%u%c", &first, &extra) != 1)
+			{
+				*error = L"Bad processor list '" + cpus + L"'. Use a list like 0-3,8.";
+				return false;
+			}
+			last = first;
+		}
+
+		for (unsigned cpu = first; cpu <= last; cpu++)
+		{
+			// Find the group this processor is in.
+			WORD group = 0;
+			unsigned index = cpu;
+			WORD groups = GetActiveProcessorGroupCount();
+			while (group < groups && index >= GetActiveProcessorCount(group))
+				index -= GetActiveProcessorCount(group++);
+
+			if (group == groups)
+			{
+				*error = L"There is no processor " + std::to_wstring(cpu) + L".";
+				return false;
+			}
+			if (haveGroup && group != affinity->Group)
+			{
+				*error = L"Processors " + cpus + L" span more than one processor group.";
+				return false;
+			}
+
+			haveGroup = true;
+			affinity->Group = group;
+			affinity->Mask |= (KAFFINITY)1 << index;
+		}
+	}
+	return true;
+}
+
+bool IsValidThreadPriority(int priority)
+{
+	return priority == THREAD_PRIORITY_IDLE
+		|| priority == THREAD_PRIORITY_TIME_CRITICAL
+		|| (priority >= THREAD_PRIORITY_LOWEST && priority <= THREAD_PRIORITY_HIGHEST);
+}
+
 bool Is64BitProcess(HANDLE hProcess)
 {
 	// If the process is running under 32-bit Windows, the value is set to FALSE.
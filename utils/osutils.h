@@ -27,6 +27,7 @@ http://www.gnu.org/copyleft/gpl.html.
 #define __OSUTILS_H__
 
 #include <windows.h>
+#include <string>
 
 void InitSysInfo();
 int GetCPUCores();
@@ -36,4 +37,13 @@ bool Is64BitProcess(HANDLE hProcess);
 
 bool CanProfileProcess(HANDLE hProcess);
 
+// Parses a list of logical processors such as "0-3,8", numbered across
+// processor groups, into an affinity for SetThreadGroupAffinity. They
+// must all be in one group.
+bool ParseProcessorList(const std::wstring &cpus, GROUP_AFFINITY *affinity, std::wstring *error);
+
+// True for the levels SetThreadPriority accepts outside the realtime class:
+// idle (-15), lowest to highest (-2 to 2) and time critical (15).
+bool IsValidThreadPriority(int priority);
+
 #endif // __OSUTILS_H__
@@ -182,8 +182,8 @@ void CallstackView::updateList()
 		now = callstacks[callstackActive];
 	if(now) {
 		double totalcount = database->getMainList().totalcount;
-		callstackStats = wxString::Format("Call stack %d of %d | Accounted for %0.2fs (%0.2f%%)",
-			(int)(callstackActive+1),(int)callstacks.size(),now->samplecount,now->samplecount*100/totalcount);
+		callstackStats = wxString::Format("Call stack %d of %d | Accounted for %s (%0.2f%%)",
+			(int)(callstackActive+1),(int)callstacks.size(),database->formatWeight(now->samplecount),now->samplecount*100/totalcount);
 	} else {
 		callstackStats = wxString("");
 	}
@@ -202,9 +202,9 @@ void CallstackView::updateList()
 		const Database::AddrInfo *addrinfo = database->getAddrInfo(addr);
 
 		if (i == (size_t)listCtrl->GetItemCount())
-			listCtrl->InsertItem(i,snow->procname.c_str());
+			listCtrl->InsertItem(i,database->getProcName(snow).c_str());
 		else
-			listCtrl->SetItem(i,COL_NAME,snow->procname.c_str());
+			listCtrl->SetItem(i,COL_NAME,database->getProcName(snow).c_str());
 
 		if (snow->isCollapseFunction || snow->isCollapseModule)
 			listCtrl->SetItemTextColour(i,wxColor(0,128,0));
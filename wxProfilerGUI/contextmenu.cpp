@@ -142,7 +142,9 @@ void FunctionMenu(wxListCtrl *list, Database *database)
 		return;
 
 	// Focused symbol properties
-	wxString procname       = sym->procname;
+	wxString procname       = database->getProcName(sym);
+	// The OS function list holds names as captured.
+	wxString mangledname    = database->getMangledName(sym->name);
 	wxString sourcefilename = database->getFileName  (sym->sourcefile);
 	wxString modulename     = database->getModuleName(sym->module    );
 
@@ -157,7 +159,7 @@ void FunctionMenu(wxListCtrl *list, Database *database)
 		menu->AppendCheckItem(ID_COLLAPSE_FUNC,
 			"Collapse child calls",
 			"Present all CPU time in functions called by this function as if inside this function")
-			->Check(IsOsFunction(procname));
+			->Check(IsOsFunction(mangledname));
 		menu->AppendCheckItem(ID_COLLAPSE_MOD,
 			wxString::Format("Collapse all %s calls", modUpper),
 			"Present all CPU time in functions called by functions in this module as if inside functions in this module")
@@ -180,7 +182,7 @@ void FunctionMenu(wxListCtrl *list, Database *database)
 		menu->AppendSeparator();
 	}
 
-	wxString highlightTarget = selection.size()==1 ? sym->procname : L"selected";
+	wxString highlightTarget = selection.size()==1 ? procname : wxString(L"selected");
 	if (set_get(theMainWin->getViewState()->highlighted, addr))
 		menu->AppendCheckItem(ID_UNHIGHLIGHT, wxString::Format("Unhighlight %s", highlightTarget));
 	else
@@ -214,10 +216,10 @@ void FunctionMenu(wxListCtrl *list, Database *database)
 	}
 
 	case ID_COLLAPSE_FUNC:
-		if (IsOsFunction(procname))
-			RemoveOsFunction(procname);
+		if (IsOsFunction(mangledname))
+			RemoveOsFunction(mangledname);
 		else
-			AddOsFunction(procname);
+			AddOsFunction(mangledname);
 		theMainWin->refresh();
 		break;
 
@@ -35,6 +35,8 @@ http://www.gnu.org/copyleft/gpl.html.
 #include "../appinfo.h"
 #include "../utils/except.h"
 #include "latesymbolinfo.h"
+#include "../utils/dbginterface.h"
+#include <tuple>
 
 Database *theDatabase;
 
@@ -76,6 +78,7 @@ void RemoveOsModule(wxString mod)
 }
 
 Database::Database()
+:	seenNames(0), rankedSeenNames(0)
 {
 	assert(!theDatabase);
 	theDatabase = this;
@@ -97,10 +100,24 @@ void Database::clear()
 	symbols.clear();
 	files.clear();
 	filemap.clear();
+	names.clear();
+	namemap.clear();
+	demangled.clear();
+	demangleState.clear();
+	nameRanks.clear();
+	seenNames = rankedSeenNames = 0;
 	addrinfo.clear();
 	callstacks.clear();
+	for (int n=0;n<VIEW_MAX;n++)
+		views[n].clear();
+	currentView = VIEW_PRIMARY;
+	tagFilter.clear();
+	sampleType = L"cpu";
+	units = L"seconds";
+	duration = 0;
 	mainList.items.clear();
 	mainList.totalcount = 0;
+	stuckThreads.clear();
 	has_minidump = false;
 }
 
@@ -115,6 +132,9 @@ void Database::loadFromPath(const std::wstring& _profilepath, bool collapseOSCal
 		profilepath = _profilepath;
 	clear();
 
+	// Captures without a Modules.txt mustn't resolve against the last one's.
+	late_sym_info->unloadModules();
+
 	wxFFileInputStream input(profilepath);
 	enforce(input.IsOk(), "Input stream error opening profile data.");
 
@@ -147,10 +167,21 @@ void Database::loadFromPath(const std::wstring& _profilepath, bool collapseOSCal
 		wxString name = entry->GetInternalName();
 
 			 if (name == "Symbols.txt")		loadSymbols(zip);
-		else if (name == "Callstacks.txt")	loadCallstacks(zip,collapseOSCalls);
+		else if (name == "Modules.txt")		loadModules(zip);
+		else if (name == "Callstacks.txt")	loadCallstacks(zip,collapseOSCalls,callstacks);
+		else if (name == "AllocCallstacks.txt")	loadCallstacks(zip,collapseOSCalls,views[VIEW_COUNT]);
+		else if (name == "LiveCallstacks.txt")	loadCallstacks(zip,collapseOSCalls,views[VIEW_LIVE_HEAP]);
+		else if (name == "WaitCallstacks.txt")	loadCallstacks(zip,collapseOSCalls,views[VIEW_COUNT]);
+		else if (name == "LockCallstacks.txt")	loadCallstacks(zip,collapseOSCalls,views[VIEW_BY_LOCK]);
+		else if (name == "PlacementCallstacks.txt")	loadCallstacks(zip,collapseOSCalls,views[VIEW_BY_PLACEMENT]);
+		else if (name == "RegionCallstacks.txt")	loadCallstacks(zip,collapseOSCalls,views[VIEW_MARKED_REGION]);
+		else if (name == "TaggedCallstacks.txt")	loadCallstacks(zip,collapseOSCalls,views[VIEW_BY_TAG]);
 		else if (name == "IPCounts.txt")	loadIpCounts(zip);
 		else if (name == "Stats.txt")		loadStats(zip);
 		else if (name == "minidump.dmp")	{ has_minidump = true; if(loadMinidump) this->loadMinidump(zip); }
+		else if (name == "RateChanges.txt") {} // summarised in Stats.txt
+		else if (name == "ThreadChanges.txt") {} // summarised in Stats.txt
+		else if (name == "StuckThreads.txt")	loadStuckThreads(zip);
 		else if (name.Left(8) == "Version ") {}
 		else
 			wxLogWarning("Other fluff found in capture file (%s)\n", name.c_str());
@@ -172,7 +203,8 @@ void Database::loadSymbols(wxInputStream &file)
 		kMaxProgress+1, theMainWin,
 		wxPD_APP_MODAL|wxPD_AUTO_HIDE);
 
-	std::unordered_map<std::wstring, const Symbol*> locsymbols;
+	// Addresses belonging to the same symbol, by module, file and name.
+	std::map<std::tuple<ModuleID, FileID, NameID>, const Symbol*> locsymbols;
 
 	bool warnedDupAddress = false;
 	while (!file.Eof())
@@ -207,27 +239,25 @@ void Database::loadSymbols(wxInputStream &file)
 		// Late symbol lookup
 		late_sym_info->filterSymbol(addr, modulename, procname, sourcefilename, info.sourceline);
 
-		// Convert filename and module strings to a numeric IDs
+		// Convert filename, module and function name strings to a numeric IDs
 		FileID   fileid   = map_string(files  , filemap  , sourcefilename);
 		ModuleID moduleid = map_string(modules, modulemap, modulename    );
+		NameID   nameid   = map_string(names  , namemap  , procname      );
 
-		// Build a key string for grouping addresses belonging to the same symbol
-		std::wostringstream locstream;
-		locstream << modulename << '/' << sourcefilename << '/' << procname;
-		std::wstring loc = locstream.str();
-
-		// Create a new symbol entry, or lookup the existing one, based on the key
-		const Symbol *&sym = map_emplace(locsymbols, loc, &inserted);
+		// Create a new symbol entry, or lookup the existing one, based on its location
+		const Symbol *&sym = map_emplace(locsymbols, std::make_tuple(moduleid, fileid, nameid), &inserted);
 		if (inserted) // new symbol, judging by its location?
 		{
 			Symbol *newsym = new Symbol;
 			newsym->id                 = symbols.size();
 			newsym->address            = addr;
-			newsym->procname           = procname;
+			newsym->name               = nameid;
 			newsym->sourcefile         = fileid;
 			newsym->module             = moduleid;
 			newsym->isCollapseFunction = osFunctions.Contains(procname  .c_str());
-			newsym->isCollapseModule   = osModules  .Contains(modulename.c_str());
+			// Kernel frames (see SymbolInfo::getKernelFrameAddr) always count as OS code,
+			// so they fold into the syscall stub unless collapsing is turned off.
+			newsym->isCollapseModule   = osModules  .Contains(modulename.c_str()) || modulename == L"[kernel]";
 			symbols.push_back(newsym);
 			sym = newsym;
 		}
@@ -239,12 +269,49 @@ void Database::loadSymbols(wxInputStream &file)
 			progressdlg.Update(kMaxProgress * offset / filesize);
 	}
 
-	// The unordered_map destructor takes a very long time to run.
+	// Every name is interned now; keeping the map would hold each twice.
+	std::unordered_map<std::wstring, NameID>().swap(namemap);
+
+	// The map destructors take a very long time to run.
 	progressdlg.Update(kMaxProgress, "Tidying things up...");
 }
 
+// Comes before Symbols.txt, for resolving what it left unresolved.
+void Database::loadModules(wxInputStream &file)
+{
+	wxTextInputStream str(file, wxT(" \t"), wxConvAuto(wxFONTENCODING_UTF8));
+
+	std::vector<ModuleRecord> records;
+	while (!file.Eof())
+	{
+		wxString line = str.ReadLine();
+		if (line.IsEmpty())
+			break;
+
+		records.push_back(ModuleRecord());
+		parseModuleRecord(line.c_str().AsWChar(), records.back());
+	}
+
+	late_sym_info->loadModules(records, profilepath);
+}
+
+// base size identity "name" "path"; see ProfilerThread::saveData
+void Database::parseModuleRecord(const std::wstring &line, ModuleRecord &out)
+{
+	std::wistringstream stream(line);
+
+	std::wstring basestr, sizestr;
+	stream >> basestr >> sizestr >> out.identity;
+	out.base = (PROFILER_ADDR)hexStringTo64UInt(basestr);
+	out.size = (PROFILER_ADDR)hexStringTo64UInt(sizestr);
+	if (out.identity == L"-")
+		out.identity.clear();
+	::readQuote(stream, out.name);
+	::readQuote(stream, out.path);
+}
+
 // read callstacks
-void Database::loadCallstacks(wxInputStream &file,bool collapseKernelCalls)
+void Database::loadCallstacks(wxInputStream &file,bool collapseKernelCalls,std::vector<CallStack> &out)
 {
 	wxTextInputStream str(file);
 
@@ -296,7 +363,7 @@ void Database::loadCallstacks(wxInputStream &file,bool collapseKernelCalls)
 		for (size_t i=0; i<callstack.addresses.size(); i++)
 			callstack.symbols[i] = addrinfo.at(callstack.addresses[i]).symbol;
 
-		callstacks.emplace_back(std::move(callstack));
+		out.emplace_back(std::move(callstack));
 
 		wxFileOffset offset = file.TellI();
 		if (offset != wxInvalidOffset && offset != (wxFileOffset)filesize)
@@ -317,25 +384,25 @@ void Database::loadCallstacks(wxInputStream &file,bool collapseKernelCalls)
 		progressdlg.Update(0, "Sorting...");
 		progressdlg.Pulse();
 
-		std::stable_sort(callstacks.begin(), callstacks.end(), Pred());
+		std::stable_sort(out.begin(), out.end(), Pred());
 
 		progressdlg.Update(0, "Filtering...");
 
 		std::vector<CallStack> filtered;
-		const auto total = callstacks.size();
+		const auto total = out.size();
 		for (size_t i = 0; i < total; ++i)
 		{
 			if (i % 256 == 0)
 				progressdlg.Update(kMaxProgress * i / total);
 
-			auto& item = callstacks[i];
+			auto& item = out[i];
 			if (!filtered.empty() && filtered.back().addresses == item.addresses)
 				filtered.back().samplecount += item.samplecount;
 			else
 				filtered.emplace_back(std::move(item));
 		}
 
-		std::swap(filtered, callstacks);
+		std::swap(filtered, out);
 	}
 }
 
@@ -380,17 +447,81 @@ void Database::loadStats(wxInputStream &file)
 			break;
 
 		stats.push_back(line.c_str().AsWChar());
+
+		if (line.StartsWith("Sample type: "))
+			sampleType = line.Mid(13).c_str().AsWChar();
+		else if (line.StartsWith("Units: "))
+			units = line.Mid(7).c_str().AsWChar();
+		else if (line.StartsWith("Duration: "))
+			std::wistringstream(line.Mid(10).c_str().AsWChar()) >> duration;
+	}
+}
+
+void Database::loadStuckThreads(wxInputStream &file)
+{
+	wxTextInputStream str(file);
+
+	while(!file.Eof())
+	{
+		wxString line = str.ReadLine();
+		if (line.IsEmpty() && file.Eof())
+			break;
+		stuckThreads.push_back(line.c_str().AsWChar());
 	}
 }
 
+void Database::setView(View view)
+{
+	if (view == currentView || views[view].empty())
+		return;
+
+	std::swap(callstacks, views[currentView]);
+	std::swap(callstacks, views[view]);
+	currentView = view;
+	setRoot(NULL);
+}
+
+wxString Database::formatWeight(double value) const
+{
+	if (currentView == VIEW_COUNT)
+		return wxString::Format("%0.0f", value);
+	if (units == L"bytes")
+	{
+		if (value >= 1024.0*1024.0)
+			return wxString::Format("%0.2f MB", value / (1024.0*1024.0));
+		return wxString::Format("%0.1f KB", value / 1024.0);
+	}
+	if (units != L"seconds")
+		return wxString::Format("%0.0f", value); // event counts
+	return wxString::Format("%0.2fs", value);
+}
+
 void Database::setRoot(const Database::Symbol *root)
 {
 	currentRoot = root;
 	scanMainList();
 }
 
+void Database::setTagFilter(const std::wstring &tag)
+{
+	if (tag == tagFilter)
+		return;
+
+	tagFilter = tag;
+	if (!tag.empty() && currentView != VIEW_BY_TAG && !views[VIEW_BY_TAG].empty())
+		setView(VIEW_BY_TAG);
+	else
+		scanMainList();
+}
+
 bool Database::includeCallstack(const CallStack &callstack) const
 {
+	if (!tagFilter.empty() && currentView == VIEW_BY_TAG)
+	{
+		const Symbol *tag = callstack.symbols.back();
+		if (modules[tag->module] != L"[tag]" || names[tag->name].find(tagFilter) == std::wstring::npos)
+			return false;
+	}
 	if (currentRoot)
 		return std::find(callstack.symbols.begin(), callstack.symbols.end(), currentRoot) != callstack.symbols.end();
 	return true;
@@ -566,6 +697,76 @@ void Database::loadMinidump(wxInputStream &file)
 	}
 }
 
+// MSVC decorates names starting with '?', GCC and Clang with _Z (__Z where
+// C names get a leading underscore). The MS dbghelp undoes the former; the
+// Dr. MinGW one also the latter.
+static bool demangleName(const std::wstring &mangled, std::wstring &out)
+{
+	DbgHelp *dbgHelp;
+	if (mangled.compare(0, 1, L"?") == 0)
+		dbgHelp = &dbgHelpMs;
+	else if (mangled.compare(0, 2, L"_Z") == 0 || mangled.compare(0, 3, L"__Z") == 0)
+		dbgHelp = &dbgHelpDrMingw;
+	else
+		return false;
+	if (!dbgHelp->Loaded || !dbgHelp->UnDecorateSymbolNameW)
+		return false;
+
+	static wchar_t buffer[16384];
+	DWORD len = dbgHelp->UnDecorateSymbolNameW(mangled.c_str(), buffer, _countof(buffer), UNDNAME_NAME_ONLY);
+	if (!len || len >= _countof(buffer) - 1)
+		return false;
+	out.assign(buffer, len);
+	return out != mangled;
+}
+
+const std::wstring &Database::getProcName(NameID id) const
+{
+	if (demangleState.size() != names.size())
+		demangleState.resize(names.size(), NAME_UNSEEN);
+
+	if (demangleState[id] == NAME_UNSEEN)
+	{
+		seenNames++;
+		std::wstring name;
+		if (demangleName(names[id], name))
+		{
+			demangled[id].swap(name);
+			demangleState[id] = NAME_DEMANGLED;
+		}
+		else
+			demangleState[id] = NAME_PLAIN;
+	}
+
+	return demangleState[id] == NAME_DEMANGLED ? demangled[id] : names[id];
+}
+
+size_t Database::getNameRank(NameID id) const
+{
+	// Names that haven't been shown yet are ranked as captured, rather
+	// than demangling them all; so the ranks are redone once more have been.
+	if (nameRanks.size() != names.size() || rankedSeenNames != seenNames)
+	{
+		if (demangleState.size() != names.size())
+			demangleState.resize(names.size(), NAME_UNSEEN);
+
+		std::vector<NameID> order(names.size());
+		for (NameID n=0;n<order.size();n++)
+			order[n] = n;
+		auto sortName = [this](NameID id) -> const std::wstring & {
+			return demangleState[id] == NAME_DEMANGLED ? demangled[id] : names[id];
+		};
+		std::sort(order.begin(), order.end(),
+			[&sortName](NameID a, NameID b) { return sortName(a) < sortName(b); });
+
+		nameRanks.resize(names.size());
+		for (size_t n=0;n<order.size();n++)
+			nameRanks[order[n]] = n;
+		rankedSeenNames = seenNames;
+	}
+	return nameRanks[id];
+}
+
 std::vector<double> Database::getLineCounts(FileID sourcefile)
 {
 	std::vector<double> linecounts;
@@ -51,6 +51,8 @@ bool IsOsModule(wxString mod);
 void AddOsModule(wxString mod);
 void RemoveOsModule(wxString mod);
 
+struct ModuleRecord;
+
 /*=====================================================================
 Database
 --------
@@ -62,6 +64,7 @@ public:
 	typedef unsigned long long Address;
 	typedef size_t FileID;
 	typedef size_t ModuleID;
+	typedef size_t NameID;
 
 	/// Represents one function (as it appears in function lists).
 	struct Symbol
@@ -77,7 +80,7 @@ public:
 		/// Multiple addresses may belong to the same symbol.
 		Address  address;
 
-		std::wstring procname;
+		NameID       name;
 		FileID       sourcefile;
 		ModuleID     module;
 
@@ -128,6 +131,20 @@ public:
 		double samplecount;
 	};
 
+	/// Alternative weightings of the same capture.
+	/// Allocation and lock captures carry more than one; CPU captures only VIEW_PRIMARY.
+	enum View
+	{
+		VIEW_PRIMARY,		// seconds for CPU captures, sampled bytes for allocation captures, seconds blocked for lock captures
+		VIEW_COUNT,			// number of allocations, waits or I/O calls
+		VIEW_LIVE_HEAP,		// bytes still allocated when the capture ended
+		VIEW_BY_LOCK,		// seconds blocked, with the lock as the outermost frame
+		VIEW_BY_PLACEMENT,	// primary weight, with processor and NUMA node as the outermost frames
+		VIEW_MARKED_REGION,	// primary weight of samples taken inside sleepyshim marked regions
+		VIEW_BY_TAG,		// primary weight, with the thread's sleepyshim tag as the outermost frame
+		VIEW_MAX
+	};
+
 	Database();
 	virtual ~Database();
 	void clear();
@@ -142,6 +159,19 @@ public:
 	const std::wstring &getModuleName(ModuleID id) const { return modules[id]; }
 	ModuleID getModuleCount() const { return modules.size(); }
 
+	/// A function's name for display. Names are kept once each, as they
+	/// were captured, which for C++ may be mangled; they are demangled the
+	/// first time they are asked for, and the result kept.
+	const std::wstring &getProcName(NameID id) const;
+	const std::wstring &getProcName(const Symbol *symbol) const { return getProcName(symbol->name); }
+	/// The name as captured, e.g. for matching against the OS function list.
+	const std::wstring &getMangledName(NameID id) const { return names[id]; }
+	NameID getNameCount() const { return names.size(); }
+	/// Where getProcName(id) comes in alphabetical order, so lists can be
+	/// sorted by name comparing integers. Only names that getProcName has
+	/// been asked for are ranked demangled; the rest as captured.
+	size_t getNameRank(NameID id) const;
+
 	const AddrInfo *getAddrInfo(Address addr) { return &addrinfo.at(addr); }
 
 	void setRoot(const Symbol *root);
@@ -154,11 +184,33 @@ public:
 	std::vector<double> getLineCounts(FileID sourcefile);
 
 	std::vector<std::wstring> stats;
+	/// StuckThreads.txt, if the capture looked for stuck threads and found any.
+	std::vector<std::wstring> stuckThreads;
 
 	std::wstring getProfilePath() const { return profilepath; }
 
+	/// From Stats.txt. Older captures have neither, and are CPU captures.
+	/// Units are "seconds", "bytes", or the name of the sampled event.
+	const std::wstring &getSampleType() const { return sampleType; }
+	const std::wstring &getUnits() const { return units; }
+	double getDuration() const { return duration; }
+
+	bool hasView(View view) const { return view == currentView || !views[view].empty(); }
+	View getView() const { return currentView; }
+	/// Switches the weighting used by all lists. Resets the root.
+	void setView(View view);
+	/// Only shows stacks whose tag contains the given text (empty = all).
+	/// Only VIEW_BY_TAG's stacks carry tags, so this switches to it.
+	void setTagFilter(const std::wstring &tag);
+	const std::wstring &getTagFilter() const { return tagFilter; }
+	/// Formats a sample weight of the current view for display.
+	wxString formatWeight(double value) const;
+
 	bool has_minidump;
 
+	/// Reads one line of a capture's Modules.txt.
+	static void parseModuleRecord(const std::wstring &line, ModuleRecord &out);
+
 private:
 	/// Symbol::ID -> Symbol*
 	std::vector<Symbol *> symbols;
@@ -171,18 +223,43 @@ private:
 	std::vector<std::wstring> modules;
 	std::unordered_map<std::wstring, ModuleID> modulemap;
 
+	/// function name <-> NameID. The map is only needed while loading
+	/// symbols, and is dropped after, so each name is only held once.
+	std::vector<std::wstring> names;
+	std::unordered_map<std::wstring, NameID> namemap;
+
+	/// Demangled names by NameID, filled in by getProcName; and for each
+	/// name, whether it has been looked at yet and was mangled.
+	enum DemangleState { NAME_UNSEEN, NAME_PLAIN, NAME_DEMANGLED };
+	mutable std::unordered_map<NameID, std::wstring> demangled;
+	mutable std::vector<unsigned char> demangleState;
+	mutable std::vector<size_t> nameRanks;
+	/// How many names getProcName has looked at, now and when nameRanks
+	/// was worked out.
+	mutable size_t seenNames, rankedSeenNames;
+
 	/// Address -> module/procname/sourcefile/sourceline
 	std::unordered_map<Address, AddrInfo> addrinfo;
 
+	/// Callstacks of the current view. The other views are parked in views[];
+	/// views[currentView] is always empty.
 	std::vector<CallStack> callstacks;
+	std::vector<CallStack> views[VIEW_MAX];
+	View currentView;
+	std::wstring sampleType, units;
+	double duration;
+
 	List mainList;
 	std::wstring profilepath;
 	const Symbol *currentRoot;
+	std::wstring tagFilter;
 
 	void loadSymbols(wxInputStream &file);
-	void loadCallstacks(wxInputStream &file,bool collapseKernelCalls);
+	void loadModules(wxInputStream &file);
+	void loadCallstacks(wxInputStream &file,bool collapseKernelCalls,std::vector<CallStack> &out);
 	void loadIpCounts(wxInputStream &file);
 	void loadStats(wxInputStream &file);
+	void loadStuckThreads(wxInputStream &file);
 	void loadMinidump(wxInputStream &file);
 	void scanMainList();
 
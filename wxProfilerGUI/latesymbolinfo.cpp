@@ -25,6 +25,7 @@ http://www.gnu.org/copyleft/gpl.html..
 #include "../utils/dbginterface.h"
 #include <comdef.h>
 #include <sstream>
+#include <algorithm>
 #include "../utils/except.h"
 
 #include "profilergui.h"
@@ -47,13 +48,14 @@ void comenforce(HRESULT result, const char* where = NULL)
 
 
 LateSymbolInfo::LateSymbolInfo()
-	:	debugClient5(NULL), debugControl4(NULL), debugSymbols3(NULL)
+	:	debugClient5(NULL), debugControl4(NULL), debugSymbols3(NULL), offline(NULL)
 {
 }
 
 LateSymbolInfo::~LateSymbolInfo()
 {
 	unloadMinidump();
+	delete offline;
 }
 
 // Send debugger output to the wxWidgets current logging facility.
@@ -140,6 +142,79 @@ void LateSymbolInfo::unloadMinidump()
 	}
 }
 
+void LateSymbolInfo::unloadModules()
+{
+	delete offline;
+	offline = NULL;
+
+	moduleRecords.clear();
+	moduleTried.clear();
+	searchDirs.clear();
+}
+
+void LateSymbolInfo::loadModules(const std::vector<ModuleRecord> &records, const std::wstring &capturepath)
+{
+	unloadModules();
+
+	moduleRecords = records;
+	std::sort(moduleRecords.begin(), moduleRecords.end(),
+		[](const ModuleRecord &a, const ModuleRecord &b) { return a.base < b.base; });
+	moduleTried.assign(moduleRecords.size(), false);
+
+	// Whoever sent the capture may have put the modules next to it.
+	offlineSympath = capturepath.substr(0, capturepath.find_last_of(L"\\/"));
+	prefs.AdjustSymbolPath(offlineSympath, true);
+	searchDirs = SymbolInfo::getSearchDirs(offlineSympath);
+}
+
+bool LateSymbolInfo::resolveOffline(Database::Address address, std::wstring &procname, std::wstring &sourcefile, unsigned &sourceline)
+{
+	auto i = std::upper_bound(moduleRecords.begin(), moduleRecords.end(), address,
+		[](Database::Address addr, const ModuleRecord &mod) { return addr < mod.base; });
+	if (i == moduleRecords.begin())
+		return false;
+	--i;
+	if (address >= i->base + i->size)
+		return false;
+
+	size_t n = i - moduleRecords.begin();
+	if (!moduleTried[n])
+	{
+		moduleTried[n] = true;
+		if (!offline)
+		{
+			offline = new SymbolInfo();
+			try
+			{
+				offline->beginOffline(offlineSympath);
+			}
+			catch (SleepyException &e)
+			{
+				// Not worth failing the whole capture over.
+				wxLogWarning("Can't resolve the capture's remaining addresses: %ls", e.wwhat());
+				delete offline;
+				offline = NULL;
+				moduleRecords.clear();
+				return false;
+			}
+		}
+		offline->addOfflineModule(*i, searchDirs);
+	}
+
+	ResolvedSymbol sym;
+	offline->getSymbol((PROFILER_ADDR)address, sym);
+	if (SymbolInfo::isUnresolvedName(sym.proc))
+		return false;
+
+	procname = sym.proc;
+	if (!sym.file.empty())
+	{
+		sourcefile = sym.file;
+		sourceline = sym.line;
+	}
+	return true;
+}
+
 wchar_t LateSymbolInfo::buffer[4096];
 
 void LateSymbolInfo::filterSymbol(Database::Address address, std::wstring &module, std::wstring &procname, std::wstring &sourcefile, unsigned &sourceline)
@@ -171,4 +246,8 @@ void LateSymbolInfo::filterSymbol(Database::Address address, std::wstring &modul
 			sourceline = line;
 		}
 	}
+
+	// Left unresolved when it was captured (or by the minidump).
+	if (!moduleRecords.empty() && SymbolInfo::isUnresolvedName(procname))
+		resolveOffline(address, procname, sourcefile, sourceline);
 }
@@ -24,13 +24,16 @@ http://www.gnu.org/copyleft/gpl.html..
 
 #include <string>
 #include <windows.h>
+#include <vector>
 #include "database.h"
+#include "../profiler/symbolinfo.h"
 
 /*=====================================================================
 LateSymbolInfo
 ----------
 Handles symbols we load after loading a profile capture,
-e.g. symbols loaded from included minidumps.
+e.g. symbols loaded from included minidumps, or from the modules the
+capture lists when it left addresses unresolved.
 =====================================================================*/
 class LateSymbolInfo
 {
@@ -41,6 +44,13 @@ public:
 	void loadMinidump(std::wstring &dumppath, bool delete_when_done);
 	void unloadMinidump();
 
+	/// The capture's Modules.txt. Each module's symbols are only loaded
+	/// when an address in it turns up unresolved; its image is looked for
+	/// at the recorded path, next to the capture, and on the symbol path.
+	void loadModules(const std::vector<ModuleRecord> &records, const std::wstring &capturepath);
+	/// Forgets the modules of the previous capture, if any.
+	void unloadModules();
+
 	void filterSymbol(Database::Address address, std::wstring &module, std::wstring &procname, std::wstring &sourcefile, unsigned &sourceline);
 
 private:
@@ -52,5 +62,15 @@ private:
 	struct IDebugControl4 *debugControl4;
 	struct IDebugSymbols3 *debugSymbols3;
 
+	// Modules from Modules.txt, sorted by base, and whether we've tried
+	// loading each yet. The offline SymbolInfo is made on first use.
+	std::vector<ModuleRecord> moduleRecords;
+	std::vector<bool> moduleTried;
+	std::wstring offlineSympath;
+	std::vector<std::wstring> searchDirs;
+	SymbolInfo *offline;
+
+	bool resolveOffline(Database::Address address, std::wstring &procname, std::wstring &sourcefile, unsigned &sourceline);
+
 
 };
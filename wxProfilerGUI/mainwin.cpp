@@ -52,6 +52,13 @@ enum
 	MainWin_View_Forward,
 	MainWin_View_Collapse_OS,
 	MainWin_View_Stats,
+	MainWin_View_Primary,
+	MainWin_View_Count,
+	MainWin_View_LiveHeap,
+	MainWin_View_ByLock,
+	MainWin_View_ByPlacement,
+	MainWin_View_MarkedRegion,
+	MainWin_View_ByTag,
 	MainWin_ResetToRoot,
 	MainWin_Filters,
 	MainWin_ResetFilters,
@@ -90,6 +97,7 @@ MainWin::MainWin(const wxString& title,
 	panel = NULL;
 	proclist = NULL;
 	sourceview = NULL;
+	procnameAutocompleteBuilt = false;
 	this->profilepath = profilepath;
 	this->database = database;
 
@@ -120,6 +128,14 @@ MainWin::MainWin(const wxString& title,
 	collapseOSCalls->Check(config.Read("MainWinCollapseOS",1)!=0);
 	menuView->Append(MainWin_ResetToRoot , _T("Reset Profile &Root"), _T("Resets the root so that the entire profile is shown"));
 	menuView->Append(MainWin_ResetFilters, _T("Reset Filters"), _T("Resets all the view filters"));
+	menuView->AppendSeparator();
+	menuView->AppendRadioItem(MainWin_View_Primary, _T("Sampled &Time / Bytes"), _T("Weight by CPU time, by allocated bytes for allocation captures, or by time blocked for lock and I/O captures"));
+	menuView->AppendRadioItem(MainWin_View_Count, _T("Allocation / Wait &Count"), _T("Weight by number of allocations, lock waits or I/O calls (shim captures only)"));
+	menuView->AppendRadioItem(MainWin_View_LiveHeap, _T("&Live Heap"), _T("Weight by bytes still allocated at the end of the capture (allocation captures only)"));
+	menuView->AppendRadioItem(MainWin_View_ByLock, _T("Time Waiting by &Lock"), _T("Time waiting, with each lock shown as the outermost caller (lock captures only)"));
+	menuView->AppendRadioItem(MainWin_View_ByPlacement, _T("By &Processor / NUMA Node"), _T("Samples with the processor and NUMA node they ran on shown as the outermost callers (captures with -placement only)"));
+	menuView->AppendRadioItem(MainWin_View_MarkedRegion, _T("&Marked Regions"), _T("Only samples taken inside regions marked with sleepyshim (captures with -burst only)"));
+	menuView->AppendRadioItem(MainWin_View_ByTag, _T("By T&ag"), _T("Samples with the sleepyshim tag their thread had set shown as the outermost caller (captures with -tags only)"));
 
 	// the "About" item should be in the help menu
 	wxMenu *helpMenu = new wxMenu;
@@ -182,6 +198,7 @@ MainWin::MainWin(const wxString& title,
 	filters->Append( new wxStringProperty( "Function Name", "procname", "" ) );
 	filters->Append( new wxStringProperty( "Module", "module", "" ) );
 	filters->Append( new wxStringProperty( "Source File", "sourcefile", "" ) );
+	filters->Append( new wxStringProperty( "Tag", "tag", "" ) );
 
 	sourceAndLog->AddPage(sourceview,wxT("Source"));
 	log = new LogView(sourceAndLog);
@@ -270,18 +287,20 @@ static wxArrayString arrayFromSet( const wxStringHashSet& set )
 
 void MainWin::buildFilterAutocomplete()
 {
-	wxStringHashSet procnameAutocomplete;
 	wxStringHashSet moduleAutocomplete;
 	wxStringHashSet sourcefileAutocomplete;
+	wxStringHashSet tagAutocomplete;
 
 	setProgress(L"Collecting autocomplete data...", database->getSymbolCount());
 
+	// Function names are left until the filter is used (see
+	// buildProcnameAutocomplete), as listing them demangles every one.
+	// Tag names are never mangled.
 	for (Database::Symbol::ID id = 0; id < database->getSymbolCount(); id++)
 	{
 		const Database::Symbol *symbol = database->getSymbol(id);
-		procnameAutocomplete.insert(symbol->procname);
-
-		addSplitValues(procnameAutocomplete, symbol->procname, ':');
+		if (database->getModuleName(symbol->module) == L"[tag]")
+			tagAutocomplete.insert(database->getMangledName(symbol->name));
 
 		updateProgress(id);
 	}
@@ -298,9 +317,36 @@ void MainWin::buildFilterAutocomplete()
 
 	setProgress(L"Applying autocomplete data...");
 
-	filters->SetPropertyAttribute("procname"  , "AutoComplete", arrayFromSet(procnameAutocomplete));
 	filters->SetPropertyAttribute("module"    , "AutoComplete", arrayFromSet(moduleAutocomplete));
 	filters->SetPropertyAttribute("sourcefile", "AutoComplete", arrayFromSet(sourcefileAutocomplete));
+	filters->SetPropertyAttribute("tag"       , "AutoComplete", arrayFromSet(tagAutocomplete));
+
+	setProgress(NULL);
+
+	filters->SetPropertyAttribute("procname", "AutoComplete", wxArrayString());
+	procnameAutocompleteBuilt = false;
+}
+
+void MainWin::buildProcnameAutocomplete()
+{
+	wxStringHashSet procnameAutocomplete;
+
+	setProgress(L"Collecting autocomplete data...", database->getNameCount());
+
+	for (Database::NameID id = 0; id < database->getNameCount(); id++)
+	{
+		const std::wstring &procname = database->getProcName(id);
+		procnameAutocomplete.insert(procname);
+
+		addSplitValues(procnameAutocomplete, procname, ':');
+
+		updateProgress(id);
+	}
+
+	setProgress(L"Applying autocomplete data...");
+
+	filters->SetPropertyAttribute("procname", "AutoComplete", arrayFromSet(procnameAutocomplete));
+	procnameAutocompleteBuilt = true;
 
 	setProgress(NULL);
 }
@@ -336,10 +382,13 @@ EVT_UPDATE_UI(MainWin_ResetToRoot, MainWin::OnResetToRootUpdate)
 EVT_MENU(MainWin_ResetFilters, MainWin::OnResetFilters)
 EVT_MENU(MainWin_View_Collapse_OS,  MainWin::OnCollapseOS)
 EVT_MENU(MainWin_View_Stats,  MainWin::OnStats)
+EVT_MENU_RANGE(MainWin_View_Primary, MainWin_View_ByTag, MainWin::OnSampleView)
+EVT_UPDATE_UI_RANGE(MainWin_View_Primary, MainWin_View_ByTag, MainWin::OnSampleViewUpdate)
 EVT_MENU(MainWin_Help_Documentation, MainWin::OnDocumentation)
 EVT_MENU(MainWin_Help_Support, MainWin::OnSupport)
 EVT_MENU(MainWin_Help_About, MainWin::OnAbout)
 EVT_PG_CHANGED(MainWin_Filters, MainWin::OnFiltersChanged)
+EVT_PG_SELECTED(MainWin_Filters, MainWin::OnFilterSelected)
 END_EVENT_TABLE()
 
 void MainWin::OnClose(wxCloseEvent& WXUNUSED(event))
@@ -426,7 +475,7 @@ void MainWin::OnExportAsCsv(wxCommandEvent& WXUNUSED(event))
 		wxTextOutputStream txt(file);
 		for each (const Database::Item &item in database->getMainList().items)
 		{
-			writeQuote(txt, item.symbol->procname, '"'); txt << ",";
+			writeQuote(txt, database->getProcName(item.symbol), '"'); txt << ",";
 			txt << item.exclusive << ",";
 			txt << item.inclusive << ",";
 			txt << (item.exclusive*100.0f/database->getMainList().totalcount) << ",";
@@ -549,7 +598,7 @@ void MainWin::OnExportAsCallgrind(wxCommandEvent& WXUNUSED(event))
 			txt << "\n";
 			CallgrindHelper::WriteName(txt, mapOb, "ob", database->getModuleName(symbol->module));
 			CallgrindHelper::WriteName(txt, mapFl, "fl", database->getFileName(symbol->sourcefile), true);
-			CallgrindHelper::WriteName(txt, mapFn, "fn", symbol->procname);
+			CallgrindHelper::WriteName(txt, mapFn, "fn", database->getProcName(symbol));
 
 			for each (const auto &pair in selfCostLines)
 				CallgrindHelper::WriteEvents(txt, pair.first, pair.second, statsDuration);
@@ -559,7 +608,7 @@ void MainWin::OnExportAsCallgrind(wxCommandEvent& WXUNUSED(event))
 				const LineChildPair& key = childcall_samplecount.first;
 				CallgrindHelper::WriteName(txt, mapOb, "cob", database->getModuleName(key.second->module));
 				CallgrindHelper::WriteName(txt, mapFl, "cfl", database->getFileName(key.second->sourcefile), true);
-				CallgrindHelper::WriteName(txt, mapFn, "cfn", key.second->procname);
+				CallgrindHelper::WriteName(txt, mapFn, "cfn", database->getProcName(key.second));
 				txt << "calls=" << childCost_CallCounts[key] << " " << database->getAddrInfo(key.second->address)->sourceline << "\n";
 				CallgrindHelper::WriteEvents(txt, key.first, childcall_samplecount.second, statsDuration);
 			}
@@ -619,6 +668,7 @@ void MainWin::OnResetFilters(wxCommandEvent& WXUNUSED(event))
 	filters->GetProperty("procname"  )->SetValueFromString("");
 	filters->GetProperty("module"    )->SetValueFromString("");
 	filters->GetProperty("sourcefile")->SetValueFromString("");
+	filters->GetProperty("tag"       )->SetValueFromString("");
 	applyFilters();
 	refresh();
 }
@@ -629,6 +679,19 @@ void MainWin::OnCollapseOS(wxCommandEvent& WXUNUSED(event))
 	refresh();
 }
 
+void MainWin::OnSampleView(wxCommandEvent& event)
+{
+	database->setView((Database::View)(event.GetId() - MainWin_View_Primary));
+	refresh();
+}
+
+void MainWin::OnSampleViewUpdate(wxUpdateUIEvent& event)
+{
+	Database::View view = (Database::View)(event.GetId() - MainWin_View_Primary);
+	event.Enable(database->hasView(view));
+	event.Check(database->getView() == view);
+}
+
 void MainWin::OnStats(wxCommandEvent& WXUNUSED(event))
 {
 	wxDialog dlg(this, -1, wxString("Statistics"), wxDefaultPosition, wxDefaultSize, wxRESIZE_BORDER|wxDEFAULT_DIALOG_STYLE);
@@ -645,8 +708,22 @@ void MainWin::OnStats(wxCommandEvent& WXUNUSED(event))
 		string += "\n";
 	}
 
-	wxTextCtrl *text = new wxTextCtrl(&dlg, wxID_ANY, string, wxDefaultPosition, wxDefaultSize,
-		wxBORDER_NONE|wxTE_READONLY|wxTE_MULTILINE|wxTE_NO_VSCROLL);
+	if (!database->stuckThreads.empty())
+	{
+		string += "\n";
+		for (size_t n=0;n<database->stuckThreads.size();n++)
+		{
+			string += database->stuckThreads[n];
+			string += "\n";
+		}
+	}
+
+	// The stuck thread report can run long, so let it scroll.
+	long style = wxBORDER_NONE|wxTE_READONLY|wxTE_MULTILINE;
+	if (database->stuckThreads.empty())
+		style |= wxTE_NO_VSCROLL;
+
+	wxTextCtrl *text = new wxTextCtrl(&dlg, wxID_ANY, string, wxDefaultPosition, wxDefaultSize, style);
 	text->SetBackgroundColour(dlg.GetBackgroundColour());
 	sizer->Add(text, wxSizerFlags().Expand().Proportion(1).Border(wxALL, 10));
 
@@ -657,7 +734,10 @@ void MainWin::OnStats(wxCommandEvent& WXUNUSED(event))
 	}
 
 	dlg.SetSizerAndFit(sizer);
-	dlg.SetSize(300, 200);
+	if (database->stuckThreads.empty())
+		dlg.SetSize(300, 200);
+	else
+		dlg.SetSize(640, 480);
 	dlg.CentreOnScreen();
 	dlg.ShowModal();
 }
@@ -683,6 +763,12 @@ void MainWin::OnFiltersChanged(wxPropertyGridEvent& WXUNUSED(event))
 	refresh();
 }
 
+void MainWin::OnFilterSelected(wxPropertyGridEvent& event)
+{
+	if (!procnameAutocompleteBuilt && event.GetPropertyName() == "procname")
+		buildProcnameAutocomplete();
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 void MainWin::clear()
@@ -712,7 +798,7 @@ void MainWin::showSource( const Database::AddrInfo *addrinfo )
 	const Database::Symbol *symbol = (addrinfo ? addrinfo->symbol : NULL);
 	std::vector<double> linecounts = database->getLineCounts(symbol->sourcefile);
 
-	if (symbol->procname == L"KiFastSystemCallRet")
+	if (database->getMangledName(symbol->name) == L"KiFastSystemCallRet")
 		sourceview->showFile(L"[hint KiFastSystemCallRet]", 0, std::vector<double>());
 	else
 		sourceview->showFile(database->getFileName(symbol->sourcefile), addrinfo->sourceline, linecounts);
@@ -800,19 +886,33 @@ void MainWin::applyFilters()
 	std::wstring filter_procname   = filters->GetProperty("procname"  )->GetValueAsString();
 	std::wstring filter_module     = filters->GetProperty("module"    )->GetValueAsString();
 	std::wstring filter_sourcefile = filters->GetProperty("sourcefile")->GetValueAsString();
+	std::wstring filter_tag        = filters->GetProperty("tag"       )->GetValueAsString();
+
+	// Each name, module and file is only matched once, the first time a
+	// symbol has it: -1 not yet, else whether it is filtered out.
+	std::vector<signed char> nameOut(database->getNameCount(), -1);
+	std::vector<signed char> moduleOut(database->getModuleCount(), -1);
+	std::vector<signed char> fileOut(database->getFileCount(), -1);
 
 	for (Database::Symbol::ID id = 0; id < database->getSymbolCount(); id++)
 	{
 		const Database::Symbol *symbol = database->getSymbol(id);
 
-		// TODO: Filter module and file names only once
-		bool filtered =
-			( !filter_procname  .empty() &&                         symbol->procname   .find(filter_procname  ) == std::wstring::npos ) ||
-			( !filter_module    .empty() && database->getModuleName(symbol->module    ).find(filter_module    ) == std::wstring::npos ) ||
-			( !filter_sourcefile.empty() && database->getFileName  (symbol->sourcefile).find(filter_sourcefile) == std::wstring::npos );
-
-		set_set(viewstate.filtered, symbol->address, filtered);
+		signed char &name = nameOut[symbol->name];
+		if (name < 0)
+			name = !filter_procname.empty() && database->getProcName(symbol->name).find(filter_procname) == std::wstring::npos;
+		signed char &module = moduleOut[symbol->module];
+		if (module < 0)
+			module = !filter_module.empty() && database->getModuleName(symbol->module).find(filter_module) == std::wstring::npos;
+		signed char &file = fileOut[symbol->sourcefile];
+		if (file < 0)
+			file = !filter_sourcefile.empty() && database->getFileName(symbol->sourcefile).find(filter_sourcefile) == std::wstring::npos;
+
+		set_set(viewstate.filtered, symbol->address, name || module || file);
 	}
+
+	// Tags filter whole samples rather than symbols.
+	database->setTagFilter(filter_tag);
 }
 
 void MainWin::setFilter(const wxString &name, const wxString &value)
@@ -69,6 +69,8 @@ public:
 	void OnLoadMinidumpSymbols(wxCommandEvent& event);
 	void OnCollapseOS(wxCommandEvent& event);
 	void OnStats(wxCommandEvent& event);
+	void OnSampleView(wxCommandEvent& event);
+	void OnSampleViewUpdate(wxUpdateUIEvent& event);
 	void OnBack(wxCommandEvent& event);
 	void OnBackUpdate(wxUpdateUIEvent& event);
 	void OnForward(wxCommandEvent& event);
@@ -77,6 +79,7 @@ public:
 	void OnResetToRootUpdate(wxUpdateUIEvent& event);
 	void OnResetFilters(wxCommandEvent& event);
 	void OnFiltersChanged(wxPropertyGridEvent& event);
+	void OnFilterSelected(wxPropertyGridEvent& event);
 
 	void OnDocumentation(wxCommandEvent& event);
 	void OnSupport(wxCommandEvent& event);
@@ -163,6 +166,11 @@ private:
 
 	void buildFilterAutocomplete();
 
+	/// Function names for the filter's autocomplete. Only built once the
+	/// filter is selected, since it demangles every name.
+	void buildProcnameAutocomplete();
+	bool procnameAutocompleteBuilt;
+
 	/// Apply the filter settings in the wxPropertyGrid to viewstate.
 	void applyFilters();
 
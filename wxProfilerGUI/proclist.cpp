@@ -132,7 +132,8 @@ void ProcList::OnContextMenu(wxContextMenuEvent& WXUNUSED(event))
 	FunctionMenu(this, database);
 }
 
-struct NamePred       { bool operator () (const Database::Item &a, const Database::Item &b) { return a.symbol->procname   < b.symbol->procname  ; } };
+struct NamePred       { const Database *db; NamePred(const Database *db) : db(db) {}
+                        bool operator () (const Database::Item &a, const Database::Item &b) { return db->getNameRank(a.symbol->name) < db->getNameRank(b.symbol->name); } };
 struct ExclusivePred  { bool operator () (const Database::Item &a, const Database::Item &b) { return a.exclusive          < b.exclusive         ; } };
 struct InclusivePred  { bool operator () (const Database::Item &a, const Database::Item &b) { return a.inclusive          < b.inclusive         ; } };
 struct ModulePred     { bool operator () (const Database::Item &a, const Database::Item &b) { return a.symbol->module     < b.symbol->module    ; } };
@@ -141,8 +142,14 @@ struct AddressPred    { bool operator () (const Database::Item &a, const Databas
 
 void ProcList::sortList()
 {
+	// Every item is about to be shown, so have their names demangled
+	// before ranking them.
+	if (sort_column == COL_NAME)
+		for (auto i = list.items.begin(); i != list.items.end(); ++i)
+			database->getProcName(i->symbol);
+
 	switch(sort_column) {
-	case COL_NAME:         std::stable_sort(list.items.begin(), list.items.end(), NamePred      ()); break;
+	case COL_NAME:         std::stable_sort(list.items.begin(), list.items.end(), NamePred      (database)); break;
 	case COL_EXCLUSIVE:
 	case COL_EXCLUSIVEPCT:
 	case COL_SAMPLES:
@@ -194,7 +201,7 @@ void ProcList::displayList()
 
 		wxListItem item;
 		item.SetId(c);
-		item.SetText(sym->procname);
+		item.SetText(database->getProcName(sym));
 
 		if (sym->isCollapseFunction || sym->isCollapseModule)
 			item.SetTextColour(wxColor(0,128,0));
@@ -213,8 +220,8 @@ void ProcList::displayList()
 
 		InsertItem(item);
 
-		wxString inclusive = wxString::Format("%0.2fs", i->inclusive);
-		wxString exclusive = wxString::Format("%0.2fs", i->exclusive);
+		wxString inclusive = database->formatWeight(i->inclusive);
+		wxString exclusive = database->formatWeight(i->exclusive);
 		wxString inclusivepercent = wxString::Format("%0.2f%%", i->inclusive * 100.0f / list.totalcount);
 		wxString exclusivepercent = wxString::Format("%0.2f%%", i->exclusive * 100.0f / list.totalcount);
 
@@ -27,12 +27,15 @@ http://www.gnu.org/copyleft/gpl.html.
 #include <wx/apptrait.h>
 #include <wx/msw/apptrait.h>
 #include <memory>
+#include <algorithm>
 
 #include "threadpicker.h"
 #include "capturewin.h"
 #include "mainwin.h"
+#include "resymbolize.h"
 #include "../utils/dbginterface.h"
 #include "../profiler/profilerthread.h"
+#include "../profiler/processgroup.h"
 #include "../utils/stringutils.h"
 #include "../utils/osutils.h"
 #include <wx/stdpaths.h>
@@ -60,14 +63,36 @@ static const wxCmdLineEntryDesc g_cmdLineDesc[] =
 	{ wxCMD_LINE_SWITCH, "h", "", "Displays help on the command line parameters.",			wxCMD_LINE_VAL_NONE, wxCMD_LINE_OPTION_HELP },
 	{ wxCMD_LINE_OPTION, "r", "", "Runs an executable and profiles it.",					wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
 	{ wxCMD_LINE_OPTION, "a", "", "Attaches to a process (by its PID) and profiles it.",	wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "name", "", "Profiles every process whose executable name matches a regex, including ones started later.",	wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "job", "", "Profiles every process in a named job object, including ones started later.",	wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "user", "", "Profiles every process running as a user (name, DOMAIN\\name or SID), including ones started later.",	wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
 	{ wxCMD_LINE_OPTION, "i", "", "Loads an existing profile from a file.",					wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
 	{ wxCMD_LINE_OPTION, "o", "", "Saves the captured profile to the given file.",			wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "resymbolize", "", "Resolves whatever the profile left unresolved again, against the modules and debug files in a folder (and the symbol path), and rewrites it.",	wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
 	{ wxCMD_LINE_OPTION, "t", "", "Stops capturing automatically after N seconds time.",	wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL },
 	{ wxCMD_LINE_SWITCH, "q", "", "Quiet mode (no error messages will be shown).",			wxCMD_LINE_VAL_NONE },
 	{ wxCMD_LINE_SWITCH, "", "wine", "Use Wine DbgHelp.",									wxCMD_LINE_VAL_NONE },
 	{ wxCMD_LINE_SWITCH, "", "mingw", "Use Dr. MinGW DbgHelp.",							wxCMD_LINE_VAL_NONE },
 	{ wxCMD_LINE_SWITCH, "mt", "", "When attaching a process, profiles only main thread.",			wxCMD_LINE_VAL_NONE },
 	{ wxCMD_LINE_SWITCH, "mbt", "", "When attaching a process, profiles only most busy thread.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_OPTION, "top", "", "When attaching a process, profiles only the N busiest threads, re-ranked every second.",	wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_SWITCH, "alloc", "", "Records heap allocations reported by sleepyshim.h instead of CPU samples.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_SWITCH, "locks", "", "Records blocking lock waits reported by sleepyshim.h instead of CPU samples.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_SWITCH, "io", "", "Records blocking file and socket I/O reported by sleepyshim.h instead of CPU samples.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_OPTION, "depth", "", "Cuts off CPU sample stacks deeper than N frames (default 1024).",	wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "threads", "", "Samples at most N threads per tick, picked by recent CPU use (default all).",	wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "overhead", "", "Slows CPU sampling down to use at most this % of the target's CPU time.",	wxCMD_LINE_VAL_DOUBLE, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "stall", "", "Slows CPU sampling down to suspend each thread at most N microseconds per second.",	wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "cpus", "", "Pins the sampler to a set of processors, e.g. 0-3,8.",	wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_OPTION, "priority", "", "Sampler thread priority: -15 (idle), -2 to 2, or 15 (time critical, the default).",	wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_SWITCH, "realtime", "", "Runs the profiler in the realtime priority class while capturing.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_OPTION, "burst", "", "Samples N times a second while the target has a sleepyshim marked region open.",	wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_SWITCH, "placement", "", "Also records the processor and NUMA node of each CPU sample.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_OPTION, "stuck", "", "Reports threads stuck in the same stack without using CPU for N seconds.",	wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
+	{ wxCMD_LINE_SWITCH, "tags", "", "Also records the sleepyshim tag each CPU sample's thread had set.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_SWITCH, "bgsymbols", "", "Resolves symbols in the background while a CPU capture runs.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_SWITCH, "deferred", "", "Saves only addresses and the module list; symbols are resolved when the capture is opened.",	wxCMD_LINE_VAL_NONE },
+	{ wxCMD_LINE_OPTION, "event", "", "Weights samples by a software event: time (default), context-switches, page-faults or major-faults.",	wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_NEEDS_SEPARATOR },
 	{ wxCMD_LINE_PARAM, NULL, NULL, "Loads an existing profile from a file.",				wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL},
 
 	{ wxCMD_LINE_NONE }
@@ -75,6 +100,8 @@ static const wxCmdLineEntryDesc g_cmdLineDesc[] =
 
 wxIcon sleepy_icon;
 std::wstring cmdline_load, cmdline_save, cmdline_run, cmdline_attach;
+std::wstring cmdline_resymbolize;
+ProcessSelector cmdline_group;
 long cmdline_timeout = -1;  // -1 means profile until cancelled
 std::vector<std::wstring> tmp_files;
 Prefs prefs;
@@ -170,7 +197,54 @@ std::wstring ProfilerGUI::LaunchProfiler(const AttachInfo *info)
 		info->sym_info
 		);
 
+	if (prefs.captureAllocations)
+		profilerthread->setCaptureType(CAPTURE_ALLOCATIONS);
+	else if (prefs.captureLocks)
+		profilerthread->setCaptureType(CAPTURE_LOCKS);
+	else if (prefs.captureIo)
+		profilerthread->setCaptureType(CAPTURE_IO);
+
+	SampleEvent event;
+	std::wstring eventError;
+	if (ProfilerThread::parseSampleEvent(prefs.sampleEvent.c_str().AsWChar(), &event, &eventError))
+		profilerthread->setSampleEvent(event);
+	if (prefs.recordPlacement)
+		profilerthread->setRecordPlacement(true);
+	if (prefs.recordTags)
+		profilerthread->setRecordTags(true);
+	profilerthread->setStuckThreshold(prefs.stuckSeconds);
+	profilerthread->setBackgroundSymbols(prefs.backgroundSymbols && !prefs.addressOnly);
+	profilerthread->setMaxDepth(prefs.maxDepth);
+	profilerthread->setThreadsPerTick(prefs.threadsPerTick);
+	profilerthread->setOverheadBudget(prefs.overheadPercent, prefs.stallMicroseconds);
+	if (prefs.attachMode == ATTACH_TOP_THREADS)
+		profilerthread->setTopThreads(prefs.topThreads);
+	profilerthread->setBurstRate(prefs.burstRate);
+
+	return RunCapture(profilerthread, info->limit_profile_time, true);
+}
+
+/// Profiles every process matching the selector until cancelled or timed
+/// out. Returns the path to the profile archive as LaunchProfiler does.
+std::wstring ProfilerGUI::LaunchProcessGroup(const ProcessSelector &selector)
+{
+	ProcessGroupThread* profilerthread = new ProcessGroupThread(selector);
+	profilerthread->setMaxDepth(prefs.maxDepth);
+
+	// The speed throttle stretches the interval; 100% is the normal rate.
+	profilerthread->setSampleInterval(100.0 * 100 / prefs.throttle);
 
+	// Matching processes can come and go, so keep going while there are none.
+	return RunCapture(profilerthread, cmdline_timeout, false);
+}
+
+/// Runs a capture thread (ProfilerThread or ProcessGroupThread) with the
+/// progress window up, then waits for it to save. Takes ownership of the
+/// thread. Returns the path to the profile archive, or an empty string if
+/// profiling was aborted by the user.
+template <class T>
+std::wstring ProfilerGUI::RunCapture(T *profilerthread, int limit_profile_time, bool stopWhenIdle)
+{
 	//------------------------------------------------------------------------
 	//start the profiler thread
 	//------------------------------------------------------------------------
@@ -179,7 +253,40 @@ std::wstring ProfilerGUI::LaunchProfiler(const AttachInfo *info)
 		if (!captureWin)
 			CreateProgressWindow();
 
-		profilerthread->launch(false, THREAD_PRIORITY_TIME_CRITICAL);
+		// Windows will quietly use the high class instead of realtime
+		// without SeIncreaseBasePriorityPrivilege.
+		DWORD prevClass = GetPriorityClass(GetCurrentProcess());
+		if (prefs.realtimeSampler)
+		{
+			if (!SetPriorityClass(GetCurrentProcess(), REALTIME_PRIORITY_CLASS))
+				wxLogWarning("Couldn't use the realtime priority class: %s", wxSysErrorMsg());
+			else if (GetPriorityClass(GetCurrentProcess()) != REALTIME_PRIORITY_CLASS)
+				wxLogWarning("Couldn't use the realtime priority class, using %s instead.",
+					GetPriorityClass(GetCurrentProcess()) == HIGH_PRIORITY_CLASS ? "high" : "normal");
+		}
+		wxScopeGuard sgClass = wxMakeGuard(SetPriorityClass, GetCurrentProcess(), prevClass); wxUnusedVar(sgClass);
+
+		HANDLE thread = profilerthread->launch(false, prefs.samplerPriority);
+		if (thread == NULL || thread == INVALID_HANDLE_VALUE)
+		{
+			wxLogError("Couldn't start the sampler thread.");
+			DestroyProgressWindow();
+			delete profilerthread;
+			return std::wstring();
+		}
+
+		// MyThread::launch doesn't report whether the priority took.
+		int priority = GetThreadPriority(thread);
+		if (priority != prefs.samplerPriority)
+			wxLogWarning("Couldn't set the sampler thread priority to %ld, it runs at %d.", prefs.samplerPriority, priority);
+
+		GROUP_AFFINITY affinity;
+		std::wstring error;
+		if (!prefs.samplerCpus.empty() && ParseProcessorList(prefs.samplerCpus.c_str().AsWChar(), &affinity, &error))
+		{
+			if (!SetThreadGroupAffinity(thread, &affinity, NULL))
+				wxLogWarning("Couldn't pin the sampler to processors %s.", prefs.samplerCpus);
+		}
 
 		wxStopWatch stopwatch;
 		stopwatch.Start();
@@ -200,16 +307,16 @@ std::wstring ProfilerGUI::LaunchProfiler(const AttachInfo *info)
 			if (timer.fired)
 			{
 				timer.fired = false;
-				if (!captureWin->UpdateProgress(profilerthread->getStatus(), profilerthread->getSampleProgress(), profilerthread->getNumThreadsRunning(), info->limit_profile_time))
+				if (!captureWin->UpdateProgress(profilerthread->getStatus(), profilerthread->getSampleProgress(), profilerthread->getNumThreadsRunning(), limit_profile_time))
 					break;
 			}
 
 			profilerthread->setPaused(captureWin->Paused());
 
-			if (profilerthread->getNumThreadsRunning() <= 0)
+			if (stopWhenIdle && profilerthread->getNumThreadsRunning() <= 0)
 				break;
 
-			if (info->limit_profile_time >= 0 && stopwatch.Time() >= info->limit_profile_time*1000)
+			if (limit_profile_time >= 0 && stopwatch.Time() >= limit_profile_time*1000)
 				break;
 
 			WaitMessage(); // in lieu of a wxWaitForEvent
@@ -319,6 +426,24 @@ static HANDLE getMostBusyThread(ProcessInfo& process_info)
 	return mostBusy;
 }
 
+// Only a starting point: the profiler thread re-ranks them as it goes.
+static std::vector<HANDLE> getBusiestThreads(ProcessInfo& process_info, size_t count)
+{
+	std::vector<std::pair<int, HANDLE> > usage;
+	for (auto thread_info = process_info.threads.begin(); thread_info != process_info.threads.end(); ++thread_info)
+	{
+		thread_info->recalcUsage(0);
+		usage.push_back(std::make_pair(thread_info->totalCpuTimeMs, thread_info->getThreadHandle()));
+	}
+	std::stable_sort(usage.begin(), usage.end(),
+		[](const std::pair<int, HANDLE> &a, const std::pair<int, HANDLE> &b) { return a.first > b.first; });
+
+	std::vector<HANDLE> threadHandles;
+	for (size_t n=0;n<usage.size() && n<count;n++)
+		threadHandles.push_back(usage[n].second);
+	return threadHandles;
+}
+
 static std::vector<HANDLE> getThreadsByAttachMode(ProcessInfo& process_info)
 {
 	std::vector<HANDLE> threadHandles;
@@ -337,6 +462,9 @@ static std::vector<HANDLE> getThreadsByAttachMode(ProcessInfo& process_info)
 			threadHandles.push_back(mostBusy);
 		return threadHandles;
 
+	case ATTACH_TOP_THREADS:
+		return getBusiestThreads(process_info, prefs.topThreads);
+
 	default: // all thread
 		threadHandles.reserve(process_info.threads.size());
 		for (auto thread_info = process_info.threads.begin(); thread_info != process_info.threads.end(); ++thread_info)
@@ -375,6 +503,8 @@ void ProfilerGUI::TryLoadSymbols(AttachInfo* output)
 	// about a process until that process has registered itself fully with CSRSS.
 	// So we wait a little and try again. I'm not sure what the correct solution is,
 	// I think possibly monitoring for debug events might be the way to go.
+	wxBusyCursor busy;
+	output->sym_info->setAddressOnly(prefs.addressOnly);
 	int retry = 100;
 	while (retry--)
 	{
@@ -528,6 +658,40 @@ void ProfilerGUI::HandleInit()
 	wxEventLoop::GetActive()->Exit(status);
 }
 
+// We're a GUI program, so there's only a stdout if it was redirected
+// or we borrow our parent's console.
+static void AttachStdout()
+{
+	if (GetFileType(GetStdHandle(STD_OUTPUT_HANDLE)) == FILE_TYPE_UNKNOWN && AttachConsole(ATTACH_PARENT_PROCESS))
+		freopen("CONOUT$", "w", stdout);
+}
+
+/// Copies a capture's stuck thread report to stdout, so it shows up
+/// in the console (or wherever output is redirected) after a
+/// command-line capture.
+static void PrintStuckThreads(const std::wstring &filename)
+{
+	wxFFileInputStream input(filename);
+	wxZipInputStream zip(input);
+	while (wxZipEntry *entry = zip.GetNextEntry())
+	{
+		if (entry->GetInternalName() != "StuckThreads.txt")
+			continue;
+
+		AttachStdout();
+
+		wxTextInputStream str(zip);
+		while (!zip.Eof())
+		{
+			wxString line = str.ReadLine();
+			if (line.IsEmpty() && zip.Eof())
+				break;
+			fwprintf(stdout, L"%ls\n", line.wc_str());
+		}
+		fflush(stdout);
+	}
+}
+
 /// Returns true if a frame is still active.
 bool ProfilerGUI::Run()
 {
@@ -553,6 +717,8 @@ bool ProfilerGUI::Run()
 		std::unique_ptr<AttachInfo> info(AttachToProcess(cmdline_attach));
 		filename = LaunchProfiler(info.get());
 	}
+	else if (!cmdline_group.empty())
+		filename = LaunchProcessGroup(cmdline_group);
 	else if (!cmdline_load.empty())
 		filename = cmdline_load;
 	else
@@ -562,9 +728,28 @@ bool ProfilerGUI::Run()
 			return false; // Profiling was aborted
 	}
 
+	if (!cmdline_resymbolize.empty())
+	{
+		std::wstring sympath = cmdline_resymbolize;
+		prefs.AdjustSymbolPath(sympath, true);
+
+		ResymbolizeStats stats;
+		ResymbolizeCapture(filename, sympath, stats);
+
+		AttachStdout();
+		fwprintf(stdout, L"Resolved %u of %u unresolved symbols (found %u of %u modules)\n",
+			(unsigned)stats.resolved, (unsigned)stats.candidates,
+			(unsigned)stats.modulesFound, (unsigned)stats.modulesWanted);
+		fflush(stdout);
+
+		if (cmdline_save.empty())
+			return false;	// No GUI, just resymbolize and exit
+	}
+
 	if (!cmdline_save.empty())
 	{
 		wenforce(CopyFile(filename.c_str(), cmdline_save.c_str(), FALSE), "Saving profile data");
+		PrintStuckThreads(filename);
 		return false;	// No GUI, just save and exit
 	}
 
@@ -611,12 +796,31 @@ bool ProfilerGUI::OnCmdLineParsed(wxCmdLineParser& parser)
 		cmdline_load = parser.GetParam(0);
 	if (parser.Found("o", &param))
 		cmdline_save = param.c_str();
+	if (parser.Found("resymbolize", &param))
+		cmdline_resymbolize = param.c_str();
 	if (!parser.Found("t", &cmdline_timeout))
 		cmdline_timeout = -1;
 	if (parser.Found("r", &param))
 		cmdline_run = param.c_str();
 	if (parser.Found("a", &param))
 		cmdline_attach = param.c_str();
+	if (parser.Found("name", &param))
+	{
+		cmdline_group.imagePattern = param.c_str();
+		try
+		{
+			std::wregex check(cmdline_group.imagePattern);
+		}
+		catch (const std::regex_error &)
+		{
+			wxLogError("Invalid process name pattern: %ls", cmdline_group.imagePattern.c_str());
+			return false;
+		}
+	}
+	if (parser.Found("job", &param))
+		cmdline_group.jobName = param.c_str();
+	if (parser.Found("user", &param))
+		cmdline_group.user = param.c_str();
 	if (parser.Found("wine"))
 		prefs.useWineSwitch = true;
 	if (parser.Found("mingw"))
@@ -625,6 +829,103 @@ bool ProfilerGUI::OnCmdLineParsed(wxCmdLineParser& parser)
 		prefs.attachMode = ATTACH_MAIN_THREAD;
 	if (parser.Found("mbt", &param))
 		prefs.attachMode = ATTACH_MOST_BUSY_THREAD;
+	if (parser.Found("top", &prefs.topThreads))
+	{
+		if (prefs.topThreads < 1)
+		{
+			parser.Usage();
+			return false;
+		}
+		prefs.attachMode = ATTACH_TOP_THREADS;
+	}
+	if (parser.Found("alloc"))
+		prefs.captureAllocations = true;
+	if (parser.Found("locks"))
+		prefs.captureLocks = true;
+	if (parser.Found("io"))
+		prefs.captureIo = true;
+	if (parser.Found("placement"))
+		prefs.recordPlacement = true;
+	if (parser.Found("tags"))
+		prefs.recordTags = true;
+	if (parser.Found("bgsymbols"))
+		prefs.backgroundSymbols = true;
+	if (parser.Found("deferred"))
+		prefs.addressOnly = true;
+	if (parser.Found("depth", &prefs.maxDepth) && prefs.maxDepth < 1)
+	{
+		parser.Usage();
+		return false;
+	}
+	if (parser.Found("threads", &prefs.threadsPerTick) && prefs.threadsPerTick < 0)
+	{
+		parser.Usage();
+		return false;
+	}
+	if ((parser.Found("overhead", &prefs.overheadPercent) && prefs.overheadPercent <= 0) ||
+		(parser.Found("stall", &prefs.stallMicroseconds) && prefs.stallMicroseconds <= 0))
+	{
+		parser.Usage();
+		return false;
+	}
+	if (parser.Found("cpus", &param))
+	{
+		GROUP_AFFINITY affinity;
+		std::wstring error;
+		if (!ParseProcessorList(param.c_str().AsWChar(), &affinity, &error))
+		{
+			wxLogError("%ls", error.c_str());
+			return false;
+		}
+		prefs.samplerCpus = param;
+	}
+	if (parser.Found("priority", &prefs.samplerPriority) && !IsValidThreadPriority(prefs.samplerPriority))
+	{
+		parser.Usage();
+		return false;
+	}
+	if (parser.Found("realtime"))
+		prefs.realtimeSampler = true;
+	if (parser.Found("burst", &prefs.burstRate) && prefs.burstRate < 1)
+	{
+		parser.Usage();
+		return false;
+	}
+	if (parser.Found("stuck", &prefs.stuckSeconds) && prefs.stuckSeconds < 1)
+	{
+		parser.Usage();
+		return false;
+	}
+	if (parser.Found("event", &param))
+	{
+		SampleEvent event;
+		std::wstring error;
+		if (!ProfilerThread::parseSampleEvent(param.c_str().AsWChar(), &event, &error))
+		{
+			wxLogError("%ls", error.c_str());
+			return false;
+		}
+		prefs.sampleEvent = param;
+	}
+
+	// Process groups are sampled by ProcessGroupThread, which only takes
+	// plain CPU samples.
+	if (!cmdline_group.empty())
+	{
+		static const char *const unsupported[] = {
+			"alloc", "locks", "io", "event", "placement", "tags", "overhead", "stall",
+			"stuck", "bgsymbols", "burst", "deferred", "top", "threads", "mt", "mbt",
+		};
+		for (size_t n=0;n<_countof(unsupported);n++)
+		{
+			if (parser.Found(unsupported[n]))
+			{
+				wxLogError("-%s can't be used with -name, -job or -user.", unsupported[n]);
+				parser.Usage();
+				return false;
+			}
+		}
+	}
 
 	return true;
 }
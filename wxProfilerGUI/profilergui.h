@@ -50,6 +50,7 @@ enum AttachMode
 	ATTACH_ALL_THREAD,	// default
 	ATTACH_MAIN_THREAD,
 	ATTACH_MOST_BUSY_THREAD,
+	ATTACH_TOP_THREADS,	// the prefs.topThreads busiest, re-ranked during capture
 };
 
 struct AttachInfo
@@ -75,6 +76,23 @@ public:
 		throttle = 100;
 		useWinePref = useWineSwitch = useMingwSwitch = false;
 		attachMode = ATTACH_ALL_THREAD;
+		captureAllocations = false;
+		captureLocks = false;
+		captureIo = false;
+		sampleEvent = "time";
+		recordPlacement = false;
+		recordTags = false;
+		stuckSeconds = 0;
+		backgroundSymbols = false;
+		addressOnly = false;
+		maxDepth = 1024;
+		threadsPerTick = 0;
+		overheadPercent = 0;
+		stallMicroseconds = 0;
+		topThreads = 0;
+		samplerPriority = THREAD_PRIORITY_TIME_CRITICAL;
+		realtimeSampler = false;
+		burstRate = 0;
 	}
 
 	wxString symSearchPath;
@@ -86,6 +104,24 @@ public:
 
 	bool useWinePref, useWineSwitch, useMingwSwitch;
 	AttachMode attachMode;
+	bool captureAllocations; // record sleepyshim allocation samples instead of CPU samples
+	bool captureLocks; // record sleepyshim lock waits instead of CPU samples
+	bool captureIo; // record sleepyshim blocking I/O calls instead of CPU samples
+	wxString sampleEvent; // what CPU samples are weighted by, see ProfilerThread::parseSampleEvent
+	bool recordPlacement; // record processor and NUMA node per CPU sample
+	bool recordTags; // record the sleepyshim tag per CPU sample
+	long stuckSeconds; // report threads stuck this long, 0 = don't look
+	bool backgroundSymbols; // resolve symbols while a CPU capture runs
+	bool addressOnly; // save addresses and Modules.txt; resolve symbols when opened
+	long maxDepth; // deeper stacks are cut off and marked [truncated]
+	long threadsPerTick; // most threads suspended per CPU sample, 0 = all
+	double overheadPercent; // sampler CPU budget as % of the target's, 0 = none
+	long stallMicroseconds; // suspension budget per thread per second, 0 = none
+	long topThreads; // threads sampled with ATTACH_TOP_THREADS
+	wxString samplerCpus; // processors the sampler thread is pinned to, e.g. "0-3,8"; empty = any
+	long samplerPriority; // sampler thread priority, THREAD_PRIORITY_*
+	bool realtimeSampler; // run in REALTIME_PRIORITY_CLASS while capturing
+	long burstRate; // samples per second inside sleepyshim marked regions, 0 = ignore them
 
 	bool UseWine()
 	{
@@ -148,6 +184,8 @@ private:
 	void DestroyProgressWindow();
 
 	std::wstring LaunchProfiler(const AttachInfo *info);
+	std::wstring LaunchProcessGroup(const struct ProcessSelector &selector);
+	template <class T> std::wstring RunCapture(T *profilerthread, int limit_profile_time, bool stopWhenIdle);
 	AttachInfo *RunProcess(const std::wstring &run_cmd, const std::wstring &run_cwd);
 	AttachInfo *AttachToProcess(const std::wstring& processId);
 	static void TryLoadSymbols(AttachInfo* output);
@@ -0,0 +1,211 @@
+/*=====================================================================
+resymbolize.cpp
+---------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================
+*/
+#include "resymbolize.h"
+
+#include "database.h"
+#include "../profiler/symbolinfo.h"
+#include "../utils/stringutils.h"
+#include "../utils/except.h"
+#include <wx/wfstream.h>
+#include <wx/zipstrm.h>
+#include <wx/txtstrm.h>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+
+namespace
+{
+	// One line of Symbols.txt. The address is kept as written, so
+	// untouched lines are written back exactly.
+	struct SymbolLine
+	{
+		std::wstring addrstr;
+		PROFILER_ADDR addr;
+		std::wstring module, proc, file;
+		int line;
+	};
+
+	bool hasNoLine(const SymbolLine &sym)
+	{
+		return sym.file.empty() || sym.file == L"[unknown]";
+	}
+}
+
+void ResymbolizeCapture(const std::wstring &path, const std::wstring &sympath, ResymbolizeStats &stats)
+{
+	stats.candidates = stats.resolved = stats.modulesWanted = stats.modulesFound = 0;
+
+	std::vector<ModuleRecord> records;
+	std::vector<SymbolLine> symbols;
+	{
+		wxFFileInputStream input(path);
+		enforce(input.IsOk(), "Input stream error opening profile data.");
+		wxZipInputStream zip(input);
+		enforce(zip.IsOk(), "ZIP error opening profile data.");
+
+		while (wxZipEntry *entry = zip.GetNextEntry())
+		{
+			wxString name = entry->GetInternalName();
+			delete entry;
+			if (name != "Modules.txt" && name != "Symbols.txt")
+				continue;
+
+			wxTextInputStream str(zip, wxT(" \t"), wxConvAuto(wxFONTENCODING_UTF8));
+			while (!zip.Eof())
+			{
+				wxString line = str.ReadLine();
+				if (line.IsEmpty())
+					break;
+
+				if (name == "Modules.txt")
+				{
+					records.push_back(ModuleRecord());
+					Database::parseModuleRecord(line.c_str().AsWChar(), records.back());
+					continue;
+				}
+
+				std::wistringstream stream(line.c_str().AsWChar());
+				SymbolLine sym;
+				stream >> sym.addrstr;
+				sym.addr = (PROFILER_ADDR)hexStringTo64UInt(sym.addrstr);
+				::readQuote(stream, sym.module);
+				::readQuote(stream, sym.proc);
+				::readQuote(stream, sym.file);
+				stream >> sym.line;
+				symbols.push_back(sym);
+			}
+		}
+	}
+
+	enforce(!records.empty(), "This capture has no module list, so its symbols can't be resolved again.");
+	std::sort(records.begin(), records.end(),
+		[](const ModuleRecord &a, const ModuleRecord &b) { return a.base < b.base; });
+
+	// Find what wants resolving, and which modules it's in.
+	std::vector<size_t> todo;
+	std::vector<PROFILER_ADDR> addrs;
+	std::vector<bool> wanted(records.size(), false);
+	for (size_t n=0;n<symbols.size();n++)
+	{
+		const SymbolLine &sym = symbols[n];
+		if (!SymbolInfo::isUnresolvedName(sym.proc) && !hasNoLine(sym))
+			continue;
+
+		auto i = std::upper_bound(records.begin(), records.end(), sym.addr,
+			[](PROFILER_ADDR addr, const ModuleRecord &mod) { return addr < mod.base; });
+		if (i == records.begin() || sym.addr >= (i-1)->base + (i-1)->size)
+			continue;
+
+		wanted[i-1 - records.begin()] = true;
+		todo.push_back(n);
+		addrs.push_back(sym.addr);
+	}
+	stats.candidates = todo.size();
+	if (todo.empty())
+		return;
+
+	SymbolInfo offline;
+	offline.beginOffline(sympath);
+	std::vector<std::wstring> searchDirs = SymbolInfo::getSearchDirs(sympath);
+	for (size_t n=0;n<records.size();n++)
+	{
+		if (!wanted[n])
+			continue;
+		stats.modulesWanted++;
+		if (offline.addOfflineModule(records[n], searchDirs))
+			stats.modulesFound++;
+	}
+	if (!stats.modulesFound)
+		return;
+
+	// Modules with native symbols are swept on worker threads; see getSymbols.
+	std::vector<ResolvedSymbol> resolved;
+	offline.getSymbols(addrs, resolved, NULL, NULL);
+
+	for (size_t n=0;n<todo.size();n++)
+	{
+		SymbolLine &sym = symbols[todo[n]];
+		const ResolvedSymbol &res = resolved[n];
+		bool improved = false;
+
+		if (SymbolInfo::isUnresolvedName(sym.proc) && !SymbolInfo::isUnresolvedName(res.proc))
+		{
+			sym.proc = res.proc;
+			improved = true;
+		}
+		// Only take the line if it is for the function we already had.
+		if (hasNoLine(sym) && !res.file.empty() && res.file != L"[unknown]" && sym.proc == res.proc)
+		{
+			sym.file = res.file;
+			sym.line = res.line;
+			improved = true;
+		}
+		if (improved)
+			stats.resolved++;
+	}
+	if (!stats.resolved)
+		return;
+
+	// Write the capture out again next to the original, with every other
+	// entry copied over as it is, then swap it in.
+	std::wstring temppath = path + L".tmp";
+	{
+		wxFFileInputStream input(path);
+		wxZipInputStream zip(input);
+		wxFFileOutputStream out(temppath);
+		wxZipOutputStream outzip(out);
+		wxTextOutputStream txt(outzip, wxEOL_NATIVE, wxConvAuto(wxFONTENCODING_UTF8));
+		enforce(input.IsOk() && zip.IsOk() && out.IsOk() && outzip.IsOk(), "Error writing to file");
+
+		while (wxZipEntry *entry = zip.GetNextEntry())
+		{
+			if (entry->GetInternalName() != "Symbols.txt")
+			{
+				enforce(outzip.CopyEntry(entry, zip), "Error writing to file");
+				continue;
+			}
+
+			outzip.PutNextEntry(entry->GetName(), entry->GetDateTime());
+			delete entry;
+			for (size_t n=0;n<symbols.size();n++)
+			{
+				const SymbolLine &sym = symbols[n];
+				txt << sym.addrstr;
+				txt << " ";
+				writeQuote(txt, sym.module);
+				txt << " ";
+				writeQuote(txt, sym.proc);
+				txt << " ";
+				writeQuote(txt, sym.file);
+				txt << " ";
+				txt << ::toString(sym.line);
+				txt << '\n';
+			}
+		}
+
+		enforce(outzip.Close() && out.Close(), "Error writing to file");
+	}
+
+	wenforce(MoveFileEx(temppath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING), "Replacing profile data");
+}
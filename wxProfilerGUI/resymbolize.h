@@ -0,0 +1,46 @@
+/*=====================================================================
+resymbolize.h
+-------------
+
+Copyright (C) Very Sleepy contributors
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+http://www.gnu.org/copyleft/gpl.html.
+=====================================================================*/
+#ifndef __RESYMBOLIZE_H_666_
+#define __RESYMBOLIZE_H_666_
+
+#include <string>
+
+/// What ResymbolizeCapture did.
+struct ResymbolizeStats
+{
+	size_t candidates;		// Symbols.txt entries unresolved or without a line
+	size_t resolved;		// of those, how many it could improve
+	size_t modulesWanted;	// modules those entries are in
+	size_t modulesFound;	// of those, how many had an image of the right build
+};
+
+/// Resolves again whatever a capture's Symbols.txt left unresolved (or
+/// [unknown] for its line), against the images and debug files in
+/// sympath, and rewrites the capture in place. Entries that were resolved
+/// are left as they are, and so is every other part of the capture.
+/// Addresses are mapped to modules through the capture's Modules.txt, so
+/// captures without one (from older versions) can't be resymbolized.
+/// Throws SleepyException on failure.
+void ResymbolizeCapture(const std::wstring &path, const std::wstring &sympath, ResymbolizeStats &stats);
+
+#endif //__RESYMBOLIZE_H_666_
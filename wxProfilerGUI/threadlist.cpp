@@ -348,11 +348,12 @@ std::wstring ThreadList::getLocation(HANDLE thread_handle) {
 			// Collapse functions down
 			if (syminfo && stack.depth > 0)
 			{
+				ResolvedSymbol sym;
 				for (size_t n=0;n<stack.depth;n++)
 				{
 					PROFILER_ADDR addr = stack.addr[n];
-					std::wstring mod = syminfo->getModuleNameForAddr(addr);
-					if (IsOsModule(mod))
+					syminfo->getSymbol(addr, sym);
+					if (IsOsModule(sym.module))
 					{
 						profaddr = addr;
 					} else {
@@ -362,12 +363,9 @@ std::wstring ThreadList::getLocation(HANDLE thread_handle) {
 
 				for (int n=(int)stack.depth-1;n>=0;n--)
 				{
-					std::wstring file;
-					int line;
-
 					PROFILER_ADDR addr = stack.addr[n];
-					std::wstring loc = syminfo->getProcForAddr(addr, file, line);
-					if (IsOsFunction(loc))
+					syminfo->getSymbol(addr, sym);
+					if (IsOsFunction(sym.proc))
 					{
 						profaddr = addr;
 						break;
@@ -381,11 +379,10 @@ std::wstring ThreadList::getLocation(HANDLE thread_handle) {
 
 	if (profaddr && syminfo)
 	{
-		std::wstring file;
-		int line;
-
 		// Grab the name of the current IP location.
-		return syminfo->getProcForAddr(profaddr, file, line);
+		ResolvedSymbol sym;
+		syminfo->getSymbol(profaddr, sym);
+		return sym.proc;
 	}
 
 	return L"-";